@@ -0,0 +1,108 @@
+# run.py
+# Runs every benchmark script a few times and reports the median wall time,
+# peak RSS and number of collections of each, as a table and as JSON. When a
+# baseline file exists the table also shows how each benchmark moved against it.
+#
+#   python3 bench/run.py [--runs=N] [--main=./main] [--save-baseline] [scripts...]
+import argparse
+import glob
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+RESULTS = os.path.join(BENCH_DIR, "results.json")
+BASELINE = os.path.join(BENCH_DIR, "baseline.json")
+THRESHOLD = 0.05  # moves under 5% are reported as noise
+
+
+def run_once(main, script):
+    start = time.perf_counter()
+    proc = subprocess.run([main, "--gc-stats", script],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+    stderr = proc.stderr.decode()
+    if proc.returncode != 0:
+        sys.exit(f"{script} exited with {proc.returncode}:\n{stderr}")
+    # the interpreter reports its own peak RSS, the rusage of a child forked
+    # from this process starts out at the size of python
+    stats = {}
+    for line in stderr.splitlines():
+        if line.startswith("gc collections: "):
+            stats["gc"] = int(line.split(": ")[1])
+        elif line.startswith("peak rss: "):
+            stats["rss"] = int(line.split(": ")[1].split()[0])
+    if "gc" not in stats or "rss" not in stats:
+        sys.exit(f"{script}: {main} --gc-stats printed no collection count or peak rss")
+    return wall, stats["rss"], stats["gc"]
+
+
+def run_bench(main, script, runs):
+    walls, rss, gcs = [], [], []
+    for _ in range(runs):
+        wall, max_rss, gc_cnt = run_once(main, script)
+        walls.append(wall)
+        rss.append(max_rss)
+        gcs.append(gc_cnt)
+    return {
+        "median_ms": round(statistics.median(walls) * 1000, 2),
+        "min_ms": round(min(walls) * 1000, 2),
+        "peak_rss_kb": max(rss),
+        "gc_collections": max(gcs),
+        "runs": runs,
+    }
+
+
+def compare(result, base):
+    if base is None:
+        return ""
+    ratio = result["median_ms"] / base["median_ms"]
+    verdict = "slower" if ratio > 1 + THRESHOLD else "faster" if ratio < 1 - THRESHOLD else "same"
+    rss = result["peak_rss_kb"] - base["peak_rss_kb"]
+    return f"{ratio:6.2f}x {verdict:6} rss {rss:+d} KB"
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the Glide benchmarks")
+    parser.add_argument("scripts", nargs="*", help="defaults to bench/*.gld")
+    parser.add_argument("--main", default="./main", help="interpreter to run")
+    parser.add_argument("--runs", type=int, default=5, help="runs per script")
+    parser.add_argument("--json", default=RESULTS, help="where the results go")
+    parser.add_argument("--baseline", default=BASELINE, help="results to compare against")
+    parser.add_argument("--save-baseline", action="store_true",
+                        help="also save the results as the baseline")
+    args = parser.parse_args()
+
+    scripts = args.scripts or sorted(glob.glob(os.path.join(BENCH_DIR, "*.gld")))
+    baseline = {}
+    if os.path.exists(args.baseline) and not args.save_baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)["benchmarks"]
+
+    results = {}
+    print(f"{'benchmark':16} {'median ms':>10} {'min ms':>10} {'rss KB':>8} {'gcs':>5}  "
+          f"{'vs baseline' if baseline else ''}")
+    for script in scripts:
+        name = os.path.splitext(os.path.basename(script))[0]
+        result = run_bench(args.main, script, args.runs)
+        results[name] = result
+        print(f"{name:16} {result['median_ms']:10.2f} {result['min_ms']:10.2f} "
+              f"{result['peak_rss_kb']:8d} {result['gc_collections']:5d}  "
+              f"{compare(result, baseline.get(name))}")
+
+    report = {"main": args.main, "runs": args.runs, "benchmarks": results}
+    with open(args.json, "w") as f:
+        json.dump(report, f, indent=2)
+        f.write("\n")
+    if args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(report, f, indent=2)
+            f.write("\n")
+        print(f"Baseline saved to {args.baseline}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,15 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "utility.h"
+
+// runs every script in paths, or every path read from stdin if there are
+// none, on worker_cnt threads (0 picks one per core). Each job's output is
+// printed in input order under a header with its exit status and run time.
+// Returns 0 if every script succeeded, otherwise the highest exit status
+int run_batch(const char **paths, int path_cnt, int worker_cnt, bool use_registers);
+
+// the whole file at path as a string the caller frees, NULL if unreadable
+char *read_script(const char *path);
+
+#endif
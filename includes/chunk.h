@@ -20,6 +20,12 @@ typedef enum {
     OP_SUB,
     OP_MUL,
     OP_DIV,
+    OP_MOD,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
     OP_EQUAL,
     OP_GREATER_THAN,
     OP_LESS_THAN,
@@ -56,8 +62,41 @@ typedef enum {
     OP_INHERIT,
     OP_GET_SUPER,
     OP_GET_SUPER_LONG,
+    OP_BUILD_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    // local funcs that never escape their frame, rewritten when their scope ends
+    OP_STACK_CLOSURE, // same operands as OP_CLOSURE, pushes the func's shared closure
+    OP_GET_ENCLOSING, // slot of the calling frame, which is the defining frame
+    OP_SET_ENCLOSING,
+    // superinstructions, only produced by the peephole pass
+    OP_ADD_LOCALS,             // GET_LOCAL a, GET_LOCAL b, ADD
+    OP_LESS_LOCAL_CONST_JUMP,  // GET_LOCAL a, CONSTANT k, LESS_THAN, BRANCH_IF_FALSE, POP
+    OP_INC_LOCAL,              // GET_LOCAL a, CONSTANT k, ADD, SET_LOCAL a, POP
+    OP_NOT_EQUAL,              // EQUAL, NOT
+    OP_LESS_EQUAL,             // GREATER_THAN, NOT
+    OP_GREATER_EQUAL,          // LESS_THAN, NOT
+    // operands proven to be numbers, only produced by the type inference pass
+    OP_ADD_NN,
+    OP_SUB_NN,
+    OP_MUL_NN,
+    OP_DIV_NN,
+    OP_LESS_NN,
+    OP_GREATER_NN,
+    OP_LESS_EQUAL_NN,
+    OP_GREATER_EQUAL_NN,
 } OpCode_t;
 
+#define OP_CODE_CNT (OP_GREATER_EQUAL_NN + 1)
+
+// code in [start, end) is the body of a call the inliner replaced
+typedef struct {
+    int start;
+    int end;
+    int call_line;
+    ObjectStr_t *name; // the callee's global, also a constant of the chunk
+} InlineSite_t;
+
 // Data
 typedef struct {
     int capacity;
@@ -65,6 +104,8 @@ typedef struct {
     uint8_t *code;
     ValueArray_t constants;
     LineRunArray_t line_runs;
+    InlineSite_t *inline_sites;
+    int inline_site_cnt;
 } Chunk_t;
 
 void init_chunk(Chunk_t *chunk);
@@ -72,5 +113,9 @@ void write_chunk(Chunk_t *chunk, uint8_t byte, int line);
 void free_chunk(Chunk_t *chunk);
 int add_constant(Chunk_t *chunk, Value_t value);
 void write_constant(Chunk_t *chunk, Value_t value, int line);
+void truncate_chunk(Chunk_t *chunk, int count);
+int instruction_length(Chunk_t *chunk, int offset);
+bool is_branch(uint8_t op);
+int branch_target(Chunk_t *chunk, int offset);
 
 #endif
@@ -14,8 +14,12 @@ typedef enum {
     PREC_AND,      // and
     PREC_EQUALITY, // ==, !=
     PREC_COMPARE,  // < > <= >=
+    PREC_BIT_OR,   // |
+    PREC_BIT_XOR,  // ^
+    PREC_BIT_AND,  // &
+    PREC_SHIFT,    // << >>
     PREC_ADD_SUB,  // + -
-    PREC_MUL_DIV,  // * /
+    PREC_MUL_DIV,  // * / %
     PREC_UNARY,    // ! -
     PREC_ACCESSOR  // . () function calls and accesses
 } Precedence_t;
@@ -32,7 +36,9 @@ typedef struct {
 typedef struct {
     Token_t name; // variable name
     int depth;
-    bool is_captured; // determines if we move var to heap after out of scope
+    int capture_cnt; // closures holding an upvalue to it, moved to heap if > 0
+    int closure_at;  // offset of the OP_CLOSURE of a local func, -1 otherwise
+    bool escapes;    // used as anything other than the callee of a direct call
 } Local_t;
 
 typedef struct {
@@ -47,6 +53,14 @@ typedef enum {
     TYPE_INITIAZLIER // constructor method
 } FuncType_t;
 
+// the most recently emitted constant operand, so operators can fold it
+typedef struct {
+    int start;    // offset of the constant load instruction
+    int end;      // offset right after it
+    Value_t value;
+    int pool_idx; // -1 for OP_TRUE / OP_FALSE / OP_NONE
+} ConstTail_t;
+
 typedef struct Compiler_t {
     struct Compiler_t *enclosing;
     ObjectFunc_t *func;
@@ -56,6 +70,23 @@ typedef struct Compiler_t {
     int local_cap;
     Upvalue_t upvalues[256];
     int scope_depth;
+    HashTable_t ids; // identifier -> constant idx, per chunk
+    bool forwards_upvalues; // a nested func captured one of our upvalues
+
+    // constant folding state, code before fold_barrier may be a branch target
+    int fold_barrier;
+    ConstTail_t last_const;
+    int bool_start; // last instruction known to leave a bool on the stack
+    int bool_end;
+    int not_pos;      // last OP_NOT emitted
+    bool not_of_bool; // whether that OP_NOT negated a known bool
+    int not_operand_start;
+
+    // last property or super access, a call right after it becomes an invoke
+    int member_start; // for super this includes loading the superclass
+    int member_end;
+    int member_operand;
+    bool member_is_super;
 } Compiler_t;
 
 typedef struct ClassCompiler_t {
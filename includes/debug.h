@@ -3,8 +3,12 @@
 
 #include "../includes/chunk.h"
 #include "../includes/object.h"
+#include "../includes/register.h"
 
 void disassemble_chunk(Chunk_t *chunk, const char *name);
 int disassemble_instruction(Chunk_t *chunk, int offset);
+const char *opcode_name(int op);
+void disassemble_reg_chunk(RegChunk_t *reg_chunk, ValueArray_t *constants, const char *name);
+int disassemble_reg_instruction(RegChunk_t *reg_chunk, ValueArray_t *constants, int pc);
 
 #endif
@@ -0,0 +1,59 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "object.h"
+
+// a task fiber and what its resume passes in: its argument the first time,
+// the result of the operation it waited on afterwards
+typedef struct {
+    ObjectFiber_t *fiber;
+    Value_t value;
+    int arg_cnt;
+} Task_t;
+
+typedef enum { WAIT_READ, WAIT_WRITE, WAIT_ACCEPT, WAIT_RECEIVE } WaitKind_t;
+
+// the task parked on a descriptor, the loop finishes its operation once the
+// descriptor is ready
+typedef struct {
+    ObjectFiber_t *fiber; // NULL if nothing waits on the descriptor
+    WaitKind_t kind;
+    int max;           // bytes a read may return
+    ObjectStr_t *data; // what a write still has to send from written on
+    int written;
+    int child; // pid of the spawn() writing into the descriptor, 0 if none
+} Waiter_t;
+
+typedef struct {
+    double deadline; // CLOCK_MONOTONIC ms
+    ObjectFiber_t *fiber;
+} Timer_t;
+
+typedef struct {
+    int epoll_fd; // -1 until a task waits on a descriptor
+    Task_t *ready; // ring buffer of tasks to resume
+    int ready_head;
+    int ready_cnt;
+    int ready_capacity;
+    Waiter_t *waiters; // indexed by descriptor
+    int waiter_capacity;
+    int waiter_cnt;
+    Timer_t *timers; // min-heap on deadline
+    int timer_cnt;
+    int timer_capacity;
+    bool running;
+} EventLoop_t;
+
+void init_event_loop(EventLoop_t *loop);
+void free_event_loop(EventLoop_t *loop);
+void mark_event_loop(EventLoop_t *loop);
+// resumes the next ready task with its segment right above callee, waiting on
+// descriptors and timers until one is. Once nothing is left callee gets none
+// and the code that called run_loop() continues
+bool run_next_task(Value_t *callee);
+// finishes the operation a native with args waits for on fd now, by parking
+// the running task or by blocking outside of one. The result goes to args[-1]
+bool perform_io(int fd, Waiter_t waiter, Value_t *args, int arg_cnt);
+void define_io_natives();
+
+#endif
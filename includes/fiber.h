@@ -0,0 +1,19 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include "object.h"
+
+// the callee slot of the call is fiber, the arguments sit above it. A new
+// fiber gets them as parameters, a suspended one returns the single optional
+// argument from its pending yield
+bool resume_fiber(ObjectFiber_t *fiber, int arg_cnt);
+// suspends the running fiber, the call that resumed it returns value. callee
+// is the slot of the yield native, arg_cnt its argument count
+bool yield_fiber(Value_t value, Value_t *callee, int arg_cnt);
+// the running fiber's function returned with its result already in the
+// resume call's slot, control goes back to its resumer or the next task
+bool finish_fiber();
+// a runtime error unwound the stack, every running fiber dies with it
+void abandon_fibers();
+
+#endif
@@ -17,6 +17,21 @@ typedef struct {
     Node_t *table;
 } HashTable_t;
 
+// generated from the same open-addressing engine as HashTable_t, see
+// hash_table.c, but keyed on any hashable value
+typedef struct {
+    Value_t key;
+    Value_t value;
+    bool is_used; // false + none value = empty, false + true value = tombstone
+} ValueNode_t;
+
+typedef struct {
+    int num_elems; // live entries + tombstones, drives resizing
+    int count;     // live entries only
+    int capacity;
+    ValueNode_t *table;
+} ValueTable_t;
+
 void init_hash_table(HashTable_t *table);
 void free_hash_table(HashTable_t *table);
 bool insert(HashTable_t *hash_table, ObjectStr_t *key, Value_t value);
@@ -24,7 +39,16 @@ Value_t *get(HashTable_t *hash_table, ObjectStr_t *key);
 bool drop(HashTable_t *hash_table, ObjectStr_t *key);
 ObjectStr_t *find_str(HashTable_t *hash_table, const char *chars, int length, uint32_t hash);
 void table_add_all(HashTable_t *from, HashTable_t *to);
+void reserve_table(HashTable_t *hash_table, int count);
 void mark_table(HashTable_t *table);
 void remove_table_whites(HashTable_t *table);
 
+uint32_t hash_value(Value_t key);
+void init_value_table(ValueTable_t *table);
+void free_value_table(ValueTable_t *table);
+bool value_table_insert(ValueTable_t *table, Value_t key, Value_t value);
+Value_t *value_table_get(ValueTable_t *table, Value_t key);
+bool value_table_drop(ValueTable_t *table, Value_t key);
+void mark_value_table(ValueTable_t *table);
+
 #endif
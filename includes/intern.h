@@ -0,0 +1,27 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "object.h"
+
+// a vm's announcement of when it last started reading the process-wide
+// intern table, payloads unlinked after that stay allocated until it is done
+typedef struct InternReader_t {
+    unsigned long epoch; // 0 while outside the table
+    struct InternReader_t *next;
+} InternReader_t;
+
+// set before the first vm starts to let every vm in the process share the
+// bytes of equal strings, see --shared-strings
+extern bool share_strings;
+
+void register_intern_reader(InternReader_t *reader);
+void unregister_intern_reader(InternReader_t *reader);
+// the shared payload for the string with one more reference taken, NULL if
+// the table has no room left near hash
+SharedStr_t *intern_shared_str(const char *chars, int length, uint32_t hash);
+// called once the last reference to an interned payload is gone
+void retire_shared_str(SharedStr_t *shared);
+// frees the retired payloads no vm can still be reading, run after each gc
+void reclaim_shared_strs();
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include "object.h"
+
+// the isolate the current vm runs as, made on first use for a vm that was not
+// started by Isolate()
+Isolate_t *current_isolate();
+void release_isolate(Isolate_t *isolate);
+// takes the next message off the current vm's inbox and rebuilds it in the
+// vm's heap, false if the inbox is empty
+bool receive_message(Value_t *out);
+void define_isolate_natives();
+
+#endif
@@ -4,12 +4,18 @@
 #include "object.h"
 #include "utility.h"
 
+// the heap size the first collection waits for, later ones never wait for less
+#define GC_MIN_HEAP (1024 * 1024)
+
 // convenience macros so don't have to cast (void *) over and over again
-#define ALLOCATE(type, count) (type *)malloc(sizeof(type) * count)
+#define ALLOCATE(type, count) (type *)malloc(sizeof(type) * (count))
 #define ALLOCATE_OBJ(type, object_type) (type *)(allocate_object(sizeof(type), object_type))
+// frees an array grown with resize(), never collects so sweeping can use it
+#define FREE_ARRAY(type, ptr, count) release(ptr, sizeof(type) * (count))
 
 int grow_capacity(int old_capacity);
 void *resize(void *ptr, size_t type_size, int old_capacity, int new_capacity);
+void release(void *ptr, size_t size);
 void free_objects();
 void collect_garbage();
 void mark_value(Value_t value);
@@ -0,0 +1,10 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "object.h"
+#include "value.h"
+
+void define_native(const char *name, NativeFunc_t func, int arity);
+void define_natives();
+
+#endif
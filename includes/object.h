@@ -6,6 +6,9 @@
 #include "utility.h"
 #include "value.h"
 
+// register code of a function, see register.h
+typedef struct RegChunk_t RegChunk_t;
+
 #define OBJ_TYPE(value) (GET_OBJ_VAL(value)->type)
 
 #define IS_STR(value) is_obj_type(value, OBJ_STR)
@@ -15,6 +18,11 @@
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
+#define IS_LIST(value) is_obj_type(value, OBJ_LIST)
+#define IS_F64_ARRAY(value) is_obj_type(value, OBJ_F64_ARRAY)
+#define IS_MAP(value) is_obj_type(value, OBJ_MAP)
+#define IS_FIBER(value) is_obj_type(value, OBJ_FIBER)
+#define IS_ISOLATE(value) is_obj_type(value, OBJ_ISOLATE)
 
 #define GET_STR_VAL(value) ((ObjectStr_t *)GET_OBJ_VAL(value))
 #define GET_CSTR_VAL(value) (((ObjectStr_t *)GET_OBJ_VAL(value))->chars)
@@ -24,6 +32,11 @@
 #define GET_CLASS(value) ((ObjectClass_t *)GET_OBJ_VAL(value))
 #define GET_INSTANCE(value) ((ObjectInstance_t *)GET_OBJ_VAL(value))
 #define GET_BOUND_METHOD(value) ((ObjectBoundMethod_t *)GET_OBJ_VAL(value))
+#define GET_LIST(value) ((ObjectList_t *)GET_OBJ_VAL(value))
+#define GET_F64_ARRAY(value) ((ObjectFloat64Array_t *)GET_OBJ_VAL(value))
+#define GET_MAP(value) ((ObjectMap_t *)GET_OBJ_VAL(value))
+#define GET_FIBER(value) ((ObjectFiber_t *)GET_OBJ_VAL(value))
+#define GET_ISOLATE(value) (((ObjectIsolate_t *)GET_OBJ_VAL(value))->isolate)
 
 typedef enum {
     OBJ_FUNC,
@@ -33,7 +46,12 @@ typedef enum {
     OBJ_UPVALUE,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_BOUND_METHOD
+    OBJ_BOUND_METHOD,
+    OBJ_LIST,
+    OBJ_F64_ARRAY,
+    OBJ_MAP,
+    OBJ_FIBER,
+    OBJ_ISOLATE
 } ObjectType_t;
 
 // Object_t* can safely cast to ObjectStr_t* if Object_t* pts to ObjectStr_t
@@ -44,12 +62,29 @@ struct Object_t {
     bool is_marked;
 };
 
+// strings at least this long keep their bytes outside of any vm, so sending
+// one to another isolate hands over a reference instead of a copy
+#define SHARED_STR_MIN 1024
+
+// immutable bytes shared by every vm holding a string over them, freed once
+// the last one lets go
+typedef struct {
+    int refs; // updated atomically, vms on other threads may hold it too
+    int length;
+    uint32_t hash;
+    int slot; // index in the process-wide intern table, -1 if not in it
+    char chars[];
+} SharedStr_t;
+
 // ObjectStr_t* can be safely casted to Object_t*
 struct ObjectStr_t {
     Object_t object;
     uint32_t hash;
     int length;
-    char chars[]; // Flexible array member
+    char *chars;        // inline_chars, or the bytes of shared
+    // NULL for strings shorter than SHARED_STR_MIN unless share_strings is on
+    SharedStr_t *shared;
+    char inline_chars[]; // Flexible array member
 };
 
 typedef struct {
@@ -57,34 +92,51 @@ typedef struct {
     int num_params;
     int upvalue_cnt;
     Chunk_t chunk;
+    RegChunk_t *reg_chunk; // NULL until translated for the register VM
+    int profile_idx; // entry in the vm's profile, -1 until it runs under --profile
+    // handed out by OP_CLOSURE when nothing is captured and by OP_STACK_CLOSURE
+    struct ObjectClosure_t *shared_closure;
     ObjectStr_t *name;
 } ObjectFunc_t;
 
-typedef Value_t (*NativeFunc_t)(int arg_cnt, Value_t *args);
+// natives write their result into args[-1] (the callee slot) and return false
+// after reporting a runtime error
+typedef bool (*NativeFunc_t)(int arg_cnt, Value_t *args);
 
 typedef struct {
     Object_t obj;
     NativeFunc_t func;
+    int arity; // -1 if the native checks its own argument count
 } ObjectNative_t;
 
 typedef struct ObjectUpvalue_t {
     Object_t obj;
     Value_t *location;
+    // while open into a suspended fiber this holds the fiber, keeping the
+    // buffer location points into alive
     Value_t closed;
-    struct ObjectUpvalue_t *next;
 } ObjectUpvalue_t;
 
-typedef struct {
+typedef struct ObjectClosure_t {
     Object_t obj;
     ObjectFunc_t *func;
-    ObjectUpvalue_t **upvalues;
     int upvalue_cnt;
+    ObjectUpvalue_t *upvalues[]; // Flexible array member
 } ObjectClosure_t;
 
+typedef struct {
+    ObjectClosure_t *closure;
+    uint8_t *pc;
+    uint32_t *reg_pc; // NULL unless the frame runs register code
+    Value_t *slots;   // actually pts to first frame slot a func can use
+} CallFrame_t;
+
 typedef struct {
     Object_t object;
     ObjectStr_t *name;
     HashTable_t methods;
+    ObjectClosure_t *initializer; // methods["init"] or NULL, kept in sync by the VM
+    int field_cnt; // most fields any instance has had, new instances start that big
 } ObjectClass_t;
 
 typedef struct {
@@ -99,18 +151,78 @@ typedef struct {
     ObjectClosure_t *method;
 } ObjectBoundMethod_t;
 
+// contiguous growable buffer of values, elements are indexed directly
+typedef struct {
+    Object_t object;
+    ValueArray_t items;
+} ObjectList_t;
+
+// fixed length buffer of unboxed doubles for the bulk numeric natives
+typedef struct {
+    Object_t object;
+    int length;
+    double data[]; // Flexible array member
+} ObjectFloat64Array_t;
+
+typedef struct {
+    Object_t object;
+    ValueTable_t entries;
+} ObjectMap_t;
+
+typedef enum { FIBER_NEW, FIBER_SUSPENDED, FIBER_RUNNING, FIBER_DONE } FiberState_t;
+
+// a coroutine over a closure. While it runs its frames and values sit on the
+// vm stack like any other call, while suspended they are copied out to the
+// buffers below with frame slots and open upvalues pointing into them
+typedef struct ObjectFiber_t {
+    Object_t object;
+    ObjectClosure_t *closure;
+    FiberState_t state;
+    bool is_task; // run by the event loop, see event_loop.h
+    struct ObjectFiber_t *caller; // who resumed it while it runs, NULL for the script
+    int stack_base; // first vm stack slot and frame it uses while it runs
+    int frame_base;
+    Value_t *stack;
+    int stack_cnt;
+    int stack_capacity;
+    CallFrame_t *frames;
+    int frame_cnt;
+    int frame_capacity;
+    ObjectUpvalue_t **upvalues; // open upvalues into stack
+    int upvalue_cnt;
+    int upvalue_capacity;
+} ObjectFiber_t;
+
+typedef struct Isolate_t Isolate_t;
+
+// a handle on an isolate, see isolate.h
+typedef struct {
+    Object_t object;
+    Isolate_t *isolate;
+} ObjectIsolate_t;
+
 static inline bool is_obj_type(Value_t value, ObjectType_t type) {
     return IS_OBJ_VAL(value) && GET_OBJ_VAL(value)->type == type;
 }
 
 ObjectStr_t *allocate_str(const char *chars, int length);
+SharedStr_t *create_shared_str(const char *chars, int length, uint32_t hash);
+SharedStr_t *retain_shared_str(SharedStr_t *shared);
+void release_shared_str(SharedStr_t *shared);
+// the string over shared in the current vm, taking over the caller's reference
+ObjectStr_t *adopt_shared_str(SharedStr_t *shared);
 ObjectFunc_t *create_func();
-ObjectNative_t *create_native(NativeFunc_t func);
+ObjectNative_t *create_native(NativeFunc_t func, int arity);
 ObjectClosure_t *create_closure(ObjectFunc_t *func);
 ObjectUpvalue_t *create_upvalue(Value_t *slot);
 ObjectClass_t *create_class(ObjectStr_t *name);
 ObjectInstance_t *create_instance(ObjectClass_t *class_);
 ObjectBoundMethod_t *create_bound_method(Value_t receiver,
                                          ObjectClosure_t *method);
+ObjectList_t *create_list();
+ObjectFloat64Array_t *create_f64_array(int length);
+ObjectMap_t *create_map();
+ObjectFiber_t *create_fiber(ObjectClosure_t *closure);
+ObjectIsolate_t *create_isolate_handle(Isolate_t *isolate);
 
 #endif
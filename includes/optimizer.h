@@ -0,0 +1,12 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "chunk.h"
+#include "object.h"
+
+void optimize_chunk(Chunk_t *chunk);
+void infer_types(Chunk_t *chunk, int num_params);
+bool stack_depths(Chunk_t *chunk, int num_params, int *depth_at);
+void inline_calls(ObjectFunc_t *script);
+
+#endif
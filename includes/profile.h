@@ -0,0 +1,60 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chunk.h"
+#include "object.h"
+
+#include <stdio.h>
+
+typedef struct {
+    char *name; // copied, the function may be collected before the report
+    uint64_t instructions;
+    uint64_t cycles; // sampled, see Profile_t
+    uint64_t samples;
+} FuncProfile_t;
+
+// what the stack VM ran under --profile. Every instruction is counted, along
+// with the one before it. About one in 16 instructions, at a random distance so
+// loops cannot alias with the sampling, is timed from its dispatch to the next
+// one and the cost of the rest is estimated from those
+typedef struct {
+    uint64_t counts[OP_CODE_CNT];
+    uint64_t pairs[OP_CODE_CNT][OP_CODE_CNT]; // [previous][current]
+    uint64_t cycles[OP_CODE_CNT];
+    uint64_t samples[OP_CODE_CNT];
+    int prev_op; // -1 before the first instruction
+    uint32_t countdown; // instructions until the next sample
+    uint64_t rng;
+    int sample_op; // -1 unless the last instruction is being timed
+    int sample_func;
+    uint64_t sample_start;
+    FuncProfile_t *funcs; // indexed by ObjectFunc_t.profile_idx
+    int func_cnt;
+    int func_capacity;
+    char *json_path; // NULL to only print the table
+} Profile_t;
+
+Profile_t *create_profile(const char *json_path);
+void free_profile(Profile_t *profile);
+void add_func_profile(Profile_t *profile, ObjectFunc_t *func);
+// prints the table to out and writes the JSON report if asked for
+void report_profile(Profile_t *profile, FILE *out);
+// called by the stack VM before it dispatches op while profiling
+void profile_instruction(Profile_t *profile, uint8_t op, ObjectFunc_t *func);
+
+// samples the script's call stack on SIGPROF, see start_sampler
+typedef struct Sampler_t Sampler_t;
+
+// the stacks go to path in the folded format of flamegraph.pl
+Sampler_t *create_sampler(const char *path, int hz);
+void free_sampler(Sampler_t *sampler);
+// interrupts the calling thread hz times per second of its CPU time, each
+// interrupt copies the frames of cur_vm if cur_vm->sampler is set
+bool start_sampler(Sampler_t *sampler);
+// folds the frames copied so far into stacks, collections call this before
+// sweeping so no sampled function is freed while only its address is kept
+void drain_samples(Sampler_t *sampler);
+// stops sampling, writes the stacks and prints a summary to out
+void report_sampler(Sampler_t *sampler, FILE *out);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef REGISTER_H
+#define REGISTER_H
+
+#include "chunk.h"
+#include "object.h"
+#include "utility.h"
+
+// registers are the frame slots the stack VM would use, so a frame never
+// needs more than a byte to name one
+#define MAX_REGISTERS 256
+
+// instruction words are op | A << 8 | B << 16 | C << 24, or op | A << 8 | Bx << 16
+#define REG_ENCODE(op, a, b, c)                                                \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) |           \
+     ((uint32_t)(c) << 24))
+#define REG_ENCODE_BX(op, a, bx)                                               \
+    ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+#define REG_OP(word) ((word) & 0xff)
+#define REG_A(word) (((word) >> 8) & 0xff)
+#define REG_B(word) (((word) >> 16) & 0xff)
+#define REG_C(word) ((word) >> 24)
+#define REG_BX(word) ((word) >> 16)
+
+// R[x] is a frame register, K[x] a constant of the function's chunk. Ops
+// marked (+name) or (+offset) are followed by one extra word holding a
+// constant index or a signed jump offset relative to the next instruction
+typedef enum {
+    ROP_MOVE,         // R[A] = R[B]
+    ROP_LOADK,        // R[A] = K[Bx]
+    ROP_LOAD_NONE,    // R[A] = none
+    ROP_LOAD_TRUE,    // R[A] = true
+    ROP_LOAD_FALSE,   // R[A] = false
+    ROP_ADD,          // R[A] = R[B] + R[C]
+    ROP_ADDK,         // R[A] = R[B] + K[C]
+    ROP_SUB,
+    ROP_SUBK,
+    ROP_MUL,
+    ROP_MULK,
+    ROP_DIV,
+    ROP_DIVK,
+    ROP_MOD,
+    ROP_MODK,
+    ROP_BIT_AND,
+    ROP_BIT_ANDK,
+    ROP_BIT_OR,
+    ROP_BIT_ORK,
+    ROP_BIT_XOR,
+    ROP_BIT_XORK,
+    ROP_SHIFT_LEFT,
+    ROP_SHIFT_LEFTK,
+    ROP_SHIFT_RIGHT,
+    ROP_SHIFT_RIGHTK,
+    ROP_EQUAL,        // R[A] = R[B] == R[C]
+    ROP_EQUALK,
+    ROP_NOT_EQUAL,
+    ROP_NOT_EQUALK,
+    ROP_LESS,
+    ROP_LESSK,
+    ROP_LESS_EQUAL,
+    ROP_LESS_EQUALK,
+    ROP_GREATER,
+    ROP_GREATERK,
+    ROP_GREATER_EQUAL,
+    ROP_GREATER_EQUALK,
+    ROP_NOT,          // R[A] = !R[B]
+    ROP_NEGATE,       // R[A] = -R[B]
+    ROP_JUMP,         // (+offset)
+    ROP_JUMP_IF_FALSE, // if R[A] is falsey jump (+offset)
+    // compare and jump when the comparison is false, (+offset)
+    ROP_LESS_JUMP,    // unless R[A] < R[B]
+    ROP_LESSK_JUMP,   // unless R[A] < K[B]
+    ROP_LESS_EQUAL_JUMP,
+    ROP_LESS_EQUALK_JUMP,
+    ROP_GREATER_JUMP,
+    ROP_GREATERK_JUMP,
+    ROP_GREATER_EQUAL_JUMP,
+    ROP_GREATER_EQUALK_JUMP,
+    ROP_PRINT,        // print R[A]
+    ROP_DEFINE_GLOBAL, // globals[K[Bx]] = R[A]
+    ROP_GET_GLOBAL,   // R[A] = globals[K[Bx]]
+    ROP_SET_GLOBAL,   // globals[K[Bx]] = R[A]
+    ROP_GET_UPVALUE,  // R[A] = upvalues[B]
+    ROP_SET_UPVALUE,  // upvalues[B] = R[A]
+    ROP_CLOSE_UPVALUE, // close upvalues at or above R[A]
+    ROP_GET_ENCLOSING, // R[A] = caller's R[B]
+    ROP_SET_ENCLOSING, // caller's R[B] = R[A]
+    ROP_CALL,         // R[A] = R[A](R[A + 1] .. R[A + B])
+    ROP_INVOKE,       // R[A] = R[A].name(R[A + 1] .. R[A + B]) (+name)
+    ROP_SUPER_INVOKE, // same with the superclass in R[A + B + 1] (+name)
+    ROP_RETURN,       // return R[A]
+    ROP_CLOSURE,      // R[A] = closure(K[Bx]), then a word is_local | idx << 8 per upvalue
+    ROP_STACK_CLOSURE, // R[A] = shared closure of K[Bx]
+    ROP_CLASS,        // R[A] = class named K[Bx]
+    ROP_GET_PROPERTY, // R[A] = R[B].name (+name)
+    ROP_SET_PROPERTY, // R[A].name = R[B] (+name)
+    ROP_METHOD,       // R[A].methods[name] = R[B] (+name)
+    ROP_INHERIT,      // copy methods of R[A] into R[B]
+    ROP_GET_SUPER,    // R[A] = R[C].name bound to R[B] (+name)
+    ROP_BUILD_LIST,   // R[A] = [R[A] .. R[A + B - 1]]
+    ROP_INDEX_GET,    // R[A] = R[B][R[C]]
+    ROP_INDEX_SET,    // R[A][R[B]] = R[C]
+} RegOpCode_t;
+
+struct RegChunk_t {
+    int count;
+    int capacity;
+    uint32_t *code;
+    int *lines;   // source line of every word
+    int *origins; // stack code offset every word was translated from
+    int reg_cnt; // registers the frame needs, slot 0 included
+};
+
+void free_reg_chunk(RegChunk_t *reg_chunk);
+bool generate_register_code(ObjectFunc_t *func);
+
+#endif
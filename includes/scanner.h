@@ -15,12 +15,18 @@ typedef enum {
     TOKEN_CLOSE_PAREN,
     TOKEN_OPEN_CURLY,
     TOKEN_CLOSE_CURLY,
+    TOKEN_OPEN_BRACKET,
+    TOKEN_CLOSE_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_SUB,
     TOKEN_ADD,
     TOKEN_DIV,
     TOKEN_MUL,
+    TOKEN_MOD,
+    TOKEN_BIT_AND,
+    TOKEN_BIT_OR,
+    TOKEN_BIT_XOR,
     TOKEN_SEMICOLON,
 
     // one or two char tokens
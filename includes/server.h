@@ -0,0 +1,17 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "utility.h"
+
+// runs the script at prelude_path, if any, then keeps worker_cnt forked copies
+// of the warmed vm accepting jobs on the Unix socket at socket_path. A worker
+// runs one job and exits, the server forks a fresh one from the untouched
+// prelude state in its place and kills workers busy for over timeout_ms (0
+// waits forever). Returns once SIGINT or SIGTERM arrives
+int run_server(const char *socket_path, const char *prelude_path, int worker_cnt,
+               double timeout_ms, bool use_registers);
+// sends the script at path to the server at socket_path and prints what it
+// printed, returns the exit status the job would have had under ./main
+int run_client(const char *socket_path, const char *path);
+
+#endif
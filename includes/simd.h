@@ -0,0 +1,23 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "utility.h"
+
+// bulk kernels over raw double buffers, picked once at startup by cpu features
+typedef struct {
+    const char *name;
+    double (*sum)(const double *a, int n);
+    double (*min)(const double *a, int n);
+    double (*max)(const double *a, int n);
+    double (*dot)(const double *a, const double *b, int n);
+    void (*scale)(double *a, double k, int n);
+    void (*add)(double *a, const double *b, int n);
+    void (*fill)(double *a, double v, int n);
+    void (*prefix_sum)(double *a, int n);
+} Float64Kernels_t;
+
+extern Float64Kernels_t f64_kernels;
+
+void init_simd_kernels();
+
+#endif
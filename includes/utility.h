@@ -9,10 +9,26 @@
 #include <stdlib.h>
 #include <string.h>
 
+// state that is global to one interpreter lives in a per-thread variable, so
+// separate threads can each compile and run their own vm_t
+#define THREAD_LOCAL __thread
+
 // if flag defined -> vm disassembles and prints instructions before execution
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// if flag defined -> compiled chunks skip the peephole superinstruction pass
+// #define DISABLE_PEEPHOLE
+
+// if flag defined -> compiled chunks keep the checked arithmetic and comparison ops
+// #define DISABLE_TYPE_INFERENCE
+
+// if flag defined -> calls to small global funcs are never inlined
+// #define DISABLE_INLINING
+
+// if flag defined -> both VMs count executed instructions and report on exit
+// #define DEBUG_COUNT_DISPATCH
+
 #endif
@@ -3,32 +3,42 @@
 
 #include "utility.h"
 
+#include <math.h>
+
 // declaration in object.h; needed to avoid circular includes leading to errors
 typedef struct Object_t Object_t;
 typedef struct ObjectStr_t ObjectStr_t;
 
-typedef enum { VAL_BOOL, VAL_NONE, VAL_NUM, VAL_OBJ } ValueType_t;
+typedef enum { VAL_BOOL, VAL_NONE, VAL_NUM, VAL_INT, VAL_OBJ } ValueType_t;
 
 typedef struct {
     ValueType_t type;
     union {
         bool boolean;
         double num;
+        int64_t integer;
         Object_t *object;
     } data;
 } Value_t;
 
 #define IS_BOOL_VAL(value) ((value).type == VAL_BOOL)
 #define IS_NUM_VAL(value) ((value).type == VAL_NUM)
+#define IS_INT_VAL(value) ((value).type == VAL_INT)
+#define IS_NUMERIC_VAL(value) (IS_NUM_VAL(value) || IS_INT_VAL(value))
 #define IS_NONE_VAL(value) ((value).type == VAL_NONE)
 #define IS_OBJ_VAL(value) ((value).type == VAL_OBJ)
 
 #define GET_BOOL_VAL(value) ((value).data.boolean)
 #define GET_NUM_VAL(value) ((value).data.num)
+#define GET_INT_VAL(value) ((value).data.integer)
+// any numeric value as a double
+#define GET_DOUBLE_VAL(value)                                                  \
+    (IS_INT_VAL(value) ? (double)GET_INT_VAL(value) : GET_NUM_VAL(value))
 #define GET_OBJ_VAL(value) ((value).data.object)
 
 #define DECL_BOOL_VAL(value) ((Value_t){.type = VAL_BOOL, .data.boolean = value})
 #define DECL_NUM_VAL(value) ((Value_t){.type = VAL_NUM, .data.num = value})
+#define DECL_INT_VAL(value) ((Value_t){.type = VAL_INT, .data.integer = value})
 #define DECL_OBJ_VAL(obj) ((Value_t){.type = VAL_OBJ, .data.object = (Object_t *)obj})
 #define DECL_NONE_VAL ((Value_t){.type = VAL_NONE, .data.num = 0})
 
@@ -41,8 +51,83 @@ typedef struct {
 void init_value_array(ValueArray_t *array);
 void write_value_array(ValueArray_t *array, Value_t value);
 void free_value_array(ValueArray_t *array);
+void write_value(FILE *out, Value_t value);
 void print_value(Value_t value);
 
 bool equals(Value_t a, Value_t b);
 
+// arithmetic on numeric operands shared by both VMs and the constant folder.
+// two ints give an exact int unless the result overflows, then the operation
+// is redone on doubles; an int mixed with a double is a double operation
+static inline Value_t num_add(Value_t a, Value_t b) {
+    int64_t res;
+    if (IS_INT_VAL(a) && IS_INT_VAL(b) &&
+        !__builtin_add_overflow(GET_INT_VAL(a), GET_INT_VAL(b), &res)) {
+        return DECL_INT_VAL(res);
+    }
+    return DECL_NUM_VAL(GET_DOUBLE_VAL(a) + GET_DOUBLE_VAL(b));
+}
+
+static inline Value_t num_sub(Value_t a, Value_t b) {
+    int64_t res;
+    if (IS_INT_VAL(a) && IS_INT_VAL(b) &&
+        !__builtin_sub_overflow(GET_INT_VAL(a), GET_INT_VAL(b), &res)) {
+        return DECL_INT_VAL(res);
+    }
+    return DECL_NUM_VAL(GET_DOUBLE_VAL(a) - GET_DOUBLE_VAL(b));
+}
+
+static inline Value_t num_mul(Value_t a, Value_t b) {
+    int64_t res;
+    if (IS_INT_VAL(a) && IS_INT_VAL(b) &&
+        !__builtin_mul_overflow(GET_INT_VAL(a), GET_INT_VAL(b), &res)) {
+        return DECL_INT_VAL(res);
+    }
+    return DECL_NUM_VAL(GET_DOUBLE_VAL(a) * GET_DOUBLE_VAL(b));
+}
+
+// division always gives a double, 7 / 2 is 3.5
+static inline Value_t num_div(Value_t a, Value_t b) {
+    return DECL_NUM_VAL(GET_DOUBLE_VAL(a) / GET_DOUBLE_VAL(b));
+}
+
+// callers rule out an int modulo by zero, the remainder takes the sign of a
+static inline Value_t num_mod(Value_t a, Value_t b) {
+    if (IS_INT_VAL(a) && IS_INT_VAL(b)) {
+        // INT64_MIN % -1 overflows in C
+        return DECL_INT_VAL(GET_INT_VAL(b) == -1 ? 0 : GET_INT_VAL(a) % GET_INT_VAL(b));
+    }
+    return DECL_NUM_VAL(fmod(GET_DOUBLE_VAL(a), GET_DOUBLE_VAL(b)));
+}
+
+static inline Value_t num_negate(Value_t a) {
+    if (IS_INT_VAL(a) && GET_INT_VAL(a) != INT64_MIN) {
+        return DECL_INT_VAL(-GET_INT_VAL(a));
+    }
+    return DECL_NUM_VAL(-GET_DOUBLE_VAL(a));
+}
+
+static inline bool num_less(Value_t a, Value_t b) {
+    if (IS_INT_VAL(a) && IS_INT_VAL(b)) {
+        return GET_INT_VAL(a) < GET_INT_VAL(b);
+    }
+    return GET_DOUBLE_VAL(a) < GET_DOUBLE_VAL(b);
+}
+
+static inline bool num_greater(Value_t a, Value_t b) {
+    if (IS_INT_VAL(a) && IS_INT_VAL(b)) {
+        return GET_INT_VAL(a) > GET_INT_VAL(b);
+    }
+    return GET_DOUBLE_VAL(a) > GET_DOUBLE_VAL(b);
+}
+
+// callers check the count is within 0..63, shifting left wraps like unsigned
+static inline int64_t shift_left(int64_t a, int64_t count) {
+    return (int64_t)((uint64_t)a << count);
+}
+
+static inline int64_t shift_right(int64_t a, int64_t count) {
+    return a >> count; // arithmetic, the sign is kept
+}
+
 #endif
@@ -3,15 +3,22 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#include "event_loop.h"
 #include "hash_table.h"
+#include "intern.h"
 #include "object.h"
+#include "profile.h"
 #include "value.h"
 
+// direct-mapped cache of method lookups shared by every call site
+#define METHOD_CACHE_SIZE 1024
+#define BOUND_CACHE_SIZE 64
+
 typedef struct {
-    ObjectClosure_t *closure;
-    uint8_t *pc;
-    Value_t *slots; // actually pts to first frame slot a func can use
-} CallFrame_t;
+    ObjectClass_t *class_; // NULL if the entry is empty
+    ObjectStr_t *name;
+    ObjectClosure_t *method;
+} MethodCacheEntry_t;
 
 typedef struct {
     Chunk_t *chunk;
@@ -19,27 +26,68 @@ typedef struct {
     Value_t stack[64 * 256]; // 64 frames with 256 slots each
     Value_t *stack_top;
     HashTable_t strings;
+    InternReader_t intern_reader;
     HashTable_t globals;
     Object_t *objects;
     CallFrame_t frames[64];
     int frame_cnt;
-    ObjectUpvalue_t *open_upvalues;
+    ObjectUpvalue_t *open_upvalues[64 * 256]; // open upvalue of each stack slot or NULL
+    int open_top; // no slot at or above this index has an open upvalue
+    ObjectFiber_t *fiber; // the running fiber, NULL while the script itself runs
+    EventLoop_t loop;
+    Isolate_t *isolate; // NULL until the script first needs one, see isolate.h
     int grey_cnt;
     int grey_capacity;
     Object_t **grey_stack;
     size_t bytes_allocated;
     size_t next_GC;
+    size_t gc_cnt; // collections run, printed by --gc-stats
     ObjectStr_t *init_str;
+    MethodCacheEntry_t method_cache[METHOD_CACHE_SIZE];
+    // recently bound methods, weak so a collection empties it
+    ObjectBoundMethod_t *bound_cache[BOUND_CACHE_SIZE];
+    bool use_registers; // run programs on the register VM instead of the stack VM
+    bool whole_program; // the code handed to interpret() is the entire program
+    FILE *out; // where print writes, stdout by default
+    FILE *err; // where compile and runtime errors go, stderr by default
+    size_t dispatch_cnt; // instructions executed, see DEBUG_COUNT_DISPATCH
+    Profile_t *profile;  // NULL unless the stack VM runs under --profile
+    Sampler_t *sampler;  // NULL unless the script runs under --sample
 } vm_t;
 
 typedef enum { INTERPRET_OK, INTERPRET_COMPILE_ERROR, INTERPRET_RUNTIME_ERROR } InterpretResult_t;
 
-extern vm_t vm;
+// the vm the calling thread is running, interpret() sets it for its duration
+extern THREAD_LOCAL vm_t *cur_vm;
 
-void init_vm();
-void free_vm();
+vm_t *create_vm();
+void reset_vm(vm_t *vm);
+void free_vm(vm_t *vm);
 void push(Value_t value);
 Value_t pop();
-InterpretResult_t interpret(const char *code);
+void throw_runtime_error(const char *format, ...);
+InterpretResult_t interpret(vm_t *vm, const char *code);
+InterpretResult_t run_registers();
+
+// shared by the stack and register execution loops
+bool is_falsey(Value_t value);
+bool call_closure(ObjectClosure_t *closure, int arg_cnt);
+bool call_value(Value_t callee, int arg_cnt);
+bool add_values();
+bool mod_values(Value_t a, Value_t b, Value_t *out);
+bool shift_values(bool left, Value_t a, Value_t b, Value_t *out);
+ObjectUpvalue_t *capture_upvalue(Value_t *local);
+void close_upvalues(Value_t *last);
+ObjectClosure_t *lookup_method(ObjectClass_t *class_, ObjectStr_t *name);
+void flush_method_cache(ObjectClass_t *class_);
+void flush_bound_cache();
+void define_method(ObjectStr_t *name);
+void inherit(ObjectClass_t *superclass, ObjectClass_t *subclass);
+void set_field(ObjectInstance_t *instance, ObjectStr_t *name, Value_t value);
+bool bind_method(ObjectClass_t *class_, ObjectStr_t *name);
+bool invoke(ObjectStr_t *name, int arg_cnt);
+bool invoke_from_class(ObjectClass_t *class_, ObjectStr_t *name, int arg_cnt);
+bool index_get(Value_t target, Value_t index, Value_t *out);
+bool index_set(Value_t target, Value_t index, Value_t value);
 
 #endif
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../includes/batch.h"
+#include "../includes/vm.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *path;
+    char *output; // everything the script printed, errors included
+    size_t output_size;
+    int status; // the exit status ./main would have for the script alone
+    double elapsed_ms;
+    bool is_done;
+} Job_t;
+
+typedef struct {
+    Job_t *jobs;
+    int job_cnt;
+    int next_job; // claimed with an atomic add, so workers never wait on it
+    int flushed;  // jobs before this one have been printed
+    bool use_registers;
+    pthread_mutex_t lock;
+} Batch_t;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+char *read_script(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *code = (char *)malloc(size + 1);
+    if (code != NULL) {
+        size_t end = fread(code, sizeof(char), size, fp);
+        code[end] = '\0';
+    }
+    fclose(fp);
+    return code;
+}
+
+static void run_job(vm_t *vm, Job_t *job, bool use_registers) {
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    double start = now_ms();
+
+    char *code = read_script(job->path);
+    if (code == NULL) {
+        fprintf(out, "Error: invalid path \"%s\"\n", job->path);
+        job->status = 74;
+    } else {
+        vm->out = out;
+        vm->err = out;
+        vm->use_registers = use_registers;
+        vm->whole_program = true;
+        InterpretResult_t result = interpret(vm, code);
+        job->status = result == INTERPRET_COMPILE_ERROR   ? 65
+                      : result == INTERPRET_RUNTIME_ERROR ? 70
+                                                          : 0;
+        free(code);
+        reset_vm(vm);
+    }
+
+    job->elapsed_ms = now_ms() - start;
+    fclose(out);
+}
+
+// prints every finished job that no unfinished one precedes, caller holds lock
+static void flush_jobs(Batch_t *batch) {
+    while (batch->flushed < batch->job_cnt && batch->jobs[batch->flushed].is_done) {
+        Job_t *job = &batch->jobs[batch->flushed++];
+        printf("== %s: exit %d in %.3f ms\n", job->path, job->status, job->elapsed_ms);
+        fwrite(job->output, 1, job->output_size, stdout);
+        free(job->output);
+        job->output = NULL;
+    }
+    fflush(stdout);
+}
+
+static void *work(void *arg) {
+    Batch_t *batch = (Batch_t *)arg;
+    vm_t *vm = create_vm();
+    while (true) {
+        int idx = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+        if (idx >= batch->job_cnt) {
+            break;
+        }
+        run_job(vm, &batch->jobs[idx], batch->use_registers);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->jobs[idx].is_done = true;
+        flush_jobs(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    free_vm(vm);
+    return NULL;
+}
+
+// one path per line, blank lines skipped
+static const char **read_paths(FILE *in, int *path_cnt) {
+    const char **paths = NULL;
+    int capacity = 0;
+    *path_cnt = 0;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, in)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (*path_cnt == capacity) {
+            capacity = capacity < 8 ? 8 : capacity * 2;
+            paths = (const char **)realloc(paths, sizeof(char *) * capacity);
+            if (paths == NULL) {
+                fprintf(stderr, "Error: not enough memory available to read paths\n");
+                exit(74);
+            }
+        }
+        paths[(*path_cnt)++] = strdup(line);
+    }
+    free(line);
+    return paths;
+}
+
+int run_batch(const char **paths, int path_cnt, int worker_cnt, bool use_registers) {
+    const char **owned_paths = NULL;
+    if (path_cnt == 0) {
+        owned_paths = read_paths(stdin, &path_cnt);
+        paths = owned_paths;
+    }
+    if (worker_cnt <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_cnt = cores > 0 ? (int)cores : 1;
+    }
+    if (worker_cnt > path_cnt) {
+        worker_cnt = path_cnt > 0 ? path_cnt : 1;
+    }
+
+    Batch_t batch;
+    batch.jobs = (Job_t *)calloc(path_cnt > 0 ? path_cnt : 1, sizeof(Job_t));
+    if (batch.jobs == NULL) {
+        fprintf(stderr, "Error: not enough memory available to start the batch\n");
+        exit(74);
+    }
+    batch.job_cnt = path_cnt;
+    batch.next_job = 0;
+    batch.flushed = 0;
+    batch.use_registers = use_registers;
+    pthread_mutex_init(&batch.lock, NULL);
+    for (int i = 0; i < path_cnt; i++) {
+        batch.jobs[i].path = paths[i];
+    }
+
+    double start = now_ms();
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * worker_cnt);
+    for (int i = 0; i < worker_cnt; i++) {
+        pthread_create(&workers[i], NULL, work, &batch);
+    }
+    for (int i = 0; i < worker_cnt; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double elapsed_ms = now_ms() - start;
+
+    int status = 0;
+    int failed = 0;
+    for (int i = 0; i < path_cnt; i++) {
+        if (batch.jobs[i].status != 0) {
+            failed++;
+        }
+        if (batch.jobs[i].status > status) {
+            status = batch.jobs[i].status;
+        }
+    }
+    fprintf(stderr, "%d scripts, %d failed, %.3f ms on %d workers\n", path_cnt, failed,
+            elapsed_ms, worker_cnt);
+
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    free(batch.jobs);
+    if (owned_paths != NULL) {
+        for (int i = 0; i < path_cnt; i++) {
+            free((char *)owned_paths[i]);
+        }
+        free(owned_paths);
+    }
+    return status;
+}
@@ -9,6 +9,8 @@ void init_chunk(Chunk_t *chunk) {
     chunk->code = NULL;
     init_value_array(&chunk->constants);
     init_line_run_array(&chunk->line_runs);
+    chunk->inline_sites = NULL;
+    chunk->inline_site_cnt = 0;
 }
 
 // append a new chunk
@@ -26,9 +28,10 @@ void write_chunk(Chunk_t *chunk, uint8_t byte, int line) {
 
 // cleanup free method for chunks
 void free_chunk(Chunk_t *chunk) {
-    free(chunk->code);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     free_value_array(&chunk->constants);
     free_line_array(&chunk->line_runs);
+    free(chunk->inline_sites);
     init_chunk(chunk);
 }
 
@@ -53,3 +56,121 @@ void write_constant(Chunk_t *chunk, Value_t value, int line) {
         write_chunk(chunk, (idx >> 16) & 0xFF, line); // front 8 bits
     }
 }
+
+// drop every byte from count onwards along with its line info
+void truncate_chunk(Chunk_t *chunk, int count) {
+    int to_remove = chunk->count - count;
+    LineRunArray_t *lines = &chunk->line_runs;
+    while (to_remove > 0 && lines->count > 0) {
+        LineRun_t *run = &lines->line_runs[lines->count - 1];
+        if (run->count <= to_remove) {
+            to_remove -= run->count;
+            lines->count--;
+        } else {
+            run->count -= to_remove;
+            to_remove = 0;
+        }
+    }
+    chunk->count = count;
+}
+
+// size in bytes of the instruction at offset including its operands
+int instruction_length(Chunk_t *chunk, int offset) {
+    switch ((OpCode_t)chunk->code[offset]) {
+        case OP_NONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_EQUAL:
+        case OP_GREATER_THAN:
+        case OP_LESS_THAN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_RETURN:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_NOT_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_ADD_NN:
+        case OP_SUB_NN:
+        case OP_MUL_NN:
+        case OP_DIV_NN:
+        case OP_LESS_NN:
+        case OP_GREATER_NN:
+        case OP_LESS_EQUAL_NN:
+        case OP_GREATER_EQUAL_NN:
+            return 1;
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLASS:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+            return 2;
+        case OP_BRANCH_IF_FALSE:
+        case OP_BRANCH:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_ADD_LOCALS:
+        case OP_INC_LOCAL:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER_LONG:
+            return 4;
+        case OP_SUPER_INVOKE_LONG:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return 5;
+        case OP_CLOSURE:
+        case OP_STACK_CLOSURE: {
+            ObjectFunc_t *func = GET_FUNC(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * func->upvalue_cnt;
+        }
+    }
+    return 1;
+}
+
+bool is_branch(uint8_t op) {
+    return op == OP_BRANCH || op == OP_BRANCH_IF_FALSE || op == OP_LOOP ||
+           op == OP_LESS_LOCAL_CONST_JUMP;
+}
+
+// absolute target of the branch instruction at offset
+int branch_target(Chunk_t *chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    int len = instruction_length(chunk, offset);
+    uint16_t jump = (uint16_t)((chunk->code[offset + len - 2] << 8) | chunk->code[offset + len - 1]);
+    return op == OP_LOOP ? offset + len - jump : offset + len + jump;
+}
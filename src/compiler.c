@@ -2,13 +2,16 @@
 #include "../includes/hash_table.h"
 #include "../includes/memory.h"
 #include "../includes/object.h"
+#include "../includes/optimizer.h"
+#include "../includes/vm.h"
 
+#include <errno.h>
 #include <stdint.h>
 
-Parser_t parser;
-Chunk_t *cur_chunk = NULL;
-Compiler_t *cur_compiler = NULL;
-ClassCompiler_t *cur_class = NULL;
+THREAD_LOCAL Parser_t parser;
+THREAD_LOCAL Chunk_t *cur_chunk = NULL;
+THREAD_LOCAL Compiler_t *cur_compiler = NULL;
+THREAD_LOCAL ClassCompiler_t *cur_class = NULL;
 
 void go_next();
 void expression();
@@ -29,6 +32,8 @@ void and_(bool can_assign);
 void or_(bool can_assign);
 void block();
 static void call(bool can_assign);
+void list(bool can_assign);
+void index_(bool can_assign);
 int constant_identifier(Chunk_t *chunk, HashTable_t *ids, ObjectStr_t *name);
 void emit_sized_opcode(OpCode_t short_op, OpCode_t long_op, int operand);
 void dot(bool can_assign);
@@ -36,6 +41,7 @@ void named_let(Token_t name, bool can_assign);
 void this_(bool can_assign);
 void add_local(Token_t token);
 void end_scope();
+void settle_closure(Local_t *local);
 void super_(bool can_assign);
 
 bool match(TokenType_t type);
@@ -46,12 +52,21 @@ void declare_let();
 
 void init_compiler(Compiler_t *compiler, FuncType_t type);
 bool identifiers_equals(Token_t *a, Token_t *b);
-
-HashTable_t compiler_ids;
+void set_fold_barrier();
+void emit_constant(Value_t value);
+void emit_literal(Value_t value);
+void emit_bool_op(OpCode_t op);
+void emit_not();
+bool tail_constant(ConstTail_t *out);
+void drop_constant(ConstTail_t *tail);
+void truncate_code(int count);
+void set_member_tail(int start, int operand, bool is_super);
+void dead_statement();
+bool const_is_falsey(Value_t value);
+bool fold_binary(TokenType_t op_type, Value_t a, Value_t b, Value_t *out);
 
 ObjectFunc_t *compile(const char *code) {
     init_scanner(code);
-    init_hash_table(&compiler_ids);
     Compiler_t compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
     // cur_chunk = chunk;
@@ -62,7 +77,6 @@ ObjectFunc_t *compile(const char *code) {
         declaration();
     }
     ObjectFunc_t *func = stop_compiler();
-    free_hash_table(&compiler_ids);
     return parser.has_error ? NULL : func;
 }
 
@@ -106,8 +120,16 @@ void init_compiler(Compiler_t *compiler, FuncType_t type) {
     compiler->local_cnt = 0;
     compiler->scope_depth = 0;
     compiler->local_cap = 8;
+    // before create_func(), which isn't a root until cur_compiler points here
+    compiler->locals = resize(NULL, sizeof(Local_t), 0, compiler->local_cap);
     compiler->func = create_func();
-    compiler->locals = malloc(sizeof(Local_t) * compiler->local_cap);
+    init_hash_table(&compiler->ids);
+    compiler->fold_barrier = 0;
+    compiler->last_const.end = -1;
+    compiler->bool_end = -1;
+    compiler->not_pos = -1;
+    compiler->member_end = -1;
+    compiler->forwards_upvalues = false;
     cur_compiler = compiler;
 
     if (type != TYPE_SCRIPT) {
@@ -120,7 +142,9 @@ void init_compiler(Compiler_t *compiler, FuncType_t type) {
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
-    local->is_captured = false;
+    local->capture_cnt = 0;
+    local->closure_at = -1;
+    local->escapes = false;
 
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
@@ -132,8 +156,21 @@ void init_compiler(Compiler_t *compiler, FuncType_t type) {
 }
 
 ObjectFunc_t *stop_compiler() {
+    for (int i = 0; i < cur_compiler->local_cnt; i++) {
+        settle_closure(&cur_compiler->locals[i]);
+    }
     emit_return();
     ObjectFunc_t *func = cur_compiler->func;
+#ifndef DISABLE_PEEPHOLE
+    if (!parser.has_error) {
+        optimize_chunk(get_cur_chunk());
+    }
+#endif
+#ifndef DISABLE_TYPE_INFERENCE
+    if (!parser.has_error) {
+        infer_types(get_cur_chunk(), func->num_params);
+    }
+#endif
 #ifdef DEBUG_PRINT_CODE
     if (!parser.has_error) {
         disassemble_chunk(get_cur_chunk(),
@@ -141,9 +178,10 @@ ObjectFunc_t *stop_compiler() {
     }
 #endif
     if (cur_compiler->locals != NULL) {
-        free(cur_compiler->locals);
+        FREE_ARRAY(Local_t, cur_compiler->locals, cur_compiler->local_cap);
         cur_compiler->locals = NULL;
     }
+    free_hash_table(&cur_compiler->ids);
 
     cur_compiler = cur_compiler->enclosing;
     return func;
@@ -156,6 +194,8 @@ ParseRule_t rules[] = {
     [TOKEN_CLOSE_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_OPEN_CURLY] = {NULL, NULL, PREC_NONE},
     [TOKEN_CLOSE_CURLY] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OPEN_BRACKET] = {list, index_, PREC_ACCESSOR},
+    [TOKEN_CLOSE_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_ACCESSOR},
     [TOKEN_SUB] = {unary, binary, PREC_ADD_SUB},
@@ -163,6 +203,12 @@ ParseRule_t rules[] = {
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_DIV] = {NULL, binary, PREC_MUL_DIV},
     [TOKEN_MUL] = {NULL, binary, PREC_MUL_DIV},
+    [TOKEN_MOD] = {NULL, binary, PREC_MUL_DIV},
+    [TOKEN_BIT_AND] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_BIT_OR] = {NULL, binary, PREC_BIT_OR},
+    [TOKEN_BIT_XOR] = {NULL, binary, PREC_BIT_XOR},
+    [TOKEN_LEFT_SHIFT] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_RIGHT_SHIFT] = {NULL, binary, PREC_SHIFT},
     [TOKEN_NOT] = {unary, NULL, PREC_NONE},
     [TOKEN_NOT_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, binary, PREC_NONE},
@@ -286,7 +332,8 @@ void synchronize() {
     }
 }
 
-void function(FuncType_t type) {
+// returns whether every upvalue of the func is a slot of the enclosing frame
+bool function(FuncType_t type) {
     Compiler_t compiler;
     init_compiler(&compiler, type);
     cur_compiler->scope_depth++;
@@ -314,18 +361,29 @@ void function(FuncType_t type) {
 
     int idx = add_constant(get_cur_chunk(), DECL_OBJ_VAL(function));
     emit_bytes(OP_CLOSURE, idx);
+    if (function->upvalue_cnt == 0) {
+        // nothing to capture, so every OP_CLOSURE can hand out the same closure
+        function->shared_closure = create_closure(function);
+    }
 
     // closure variables
+    bool frame_only = !compiler.forwards_upvalues;
     for (int i = 0; i < function->upvalue_cnt; i++) {
         emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
         emit_byte(compiler.upvalues[i].idx);
+        frame_only = frame_only && compiler.upvalues[i].is_local;
     }
+    return frame_only;
 }
 
 void func_declaration() {
     uint8_t global_id = parse_let("Expected function name");
     mark_initialized();
-    function(TYPE_FUNCTION);
+    int closure_at = get_cur_chunk()->count;
+    if (function(TYPE_FUNCTION) && cur_compiler->scope_depth > 0) {
+        // candidate for OP_STACK_CLOSURE, decided once the local goes out of scope
+        cur_compiler->locals[cur_compiler->local_cnt - 1].closure_at = closure_at;
+    }
     define_let(global_id);
 }
 
@@ -333,7 +391,7 @@ void method() {
     consume(TOKEN_IDENTIFIER, "Expected method name");
     ObjectStr_t *method_name =
         allocate_str(parser.prev.start, parser.prev.length);
-    // int operand = constant_identifier(get_cur_chunk(), &compiler_ids,
+    // int operand = constant_identifier(get_cur_chunk(), &cur_compiler->ids,
     // method_name);
     int operand = add_constant(get_cur_chunk(), DECL_OBJ_VAL(method_name));
 
@@ -364,7 +422,7 @@ void super_(bool can_assign) {
     consume(TOKEN_IDENTIFIER, "Missing superlcass method name");
     ObjectStr_t *method_name =
         allocate_str(parser.prev.start, parser.prev.length);
-    // int operand = constant_identifier(get_cur_chunk(), &compiler_ids,
+    // int operand = constant_identifier(get_cur_chunk(), &cur_compiler->ids,
     // method_name);
     int operand = add_constant(get_cur_chunk(), DECL_OBJ_VAL(method_name));
 
@@ -378,8 +436,10 @@ void super_(bool can_assign) {
     } else {
         // let method = super.method() -> other case where we actaully need the
         // memory alloation
+        int start = get_cur_chunk()->count;
         named_let(synthetic_token("super"), false);
         emit_sized_opcode(OP_GET_SUPER, OP_GET_SUPER_LONG, operand);
+        set_member_tail(start, operand, true);
     }
 }
 
@@ -389,7 +449,7 @@ void class_declaration() {
     Token_t class_name = parser.prev;
 
     ObjectStr_t *constant = allocate_str(parser.prev.start, parser.prev.length);
-    int operand = constant_identifier(get_cur_chunk(), &compiler_ids, constant);
+    int operand = constant_identifier(get_cur_chunk(), &cur_compiler->ids, constant);
     // int operand = add_constant(get_cur_chunk(), DECL_OBJ_VAL(constant));
     declare_let();
 
@@ -438,6 +498,7 @@ void class_declaration() {
 }
 
 void declaration() {
+    set_fold_barrier();
     if (match(TOKEN_LET)) {
         let_declaration();
     } else if (match(TOKEN_FUNC)) {
@@ -473,7 +534,8 @@ void end_scope() {
     while (cur_compiler->local_cnt > 0 &&
            cur_compiler->locals[cur_compiler->local_cnt - 1].depth >
                cur_compiler->scope_depth) {
-        if (cur_compiler->locals[cur_compiler->local_cnt - 1].is_captured) {
+        settle_closure(&cur_compiler->locals[cur_compiler->local_cnt - 1]);
+        if (cur_compiler->locals[cur_compiler->local_cnt - 1].capture_cnt > 0) {
             emit_byte(OP_CLOSE_UPVALUE); // promote to heap
         } else {
             emit_byte(OP_POP);
@@ -482,6 +544,41 @@ void end_scope() {
     }
 }
 
+/*
+ * A local func that is only ever called directly by name cannot outlive the
+ * frame that declared it, and every call comes from that frame. Its upvalues
+ * are then read straight from the caller's slots and one closure object is
+ * shared by every run, so declaring it allocates nothing.
+ */
+void settle_closure(Local_t *local) {
+    if (local->closure_at == -1 || local->escapes || parser.has_error) {
+        return;
+    }
+    uint8_t *code = get_cur_chunk()->code + local->closure_at;
+    ObjectFunc_t *func = GET_FUNC(get_cur_chunk()->constants.values[code[1]]);
+    uint8_t *slots = code + 3; // is_local, idx pairs follow the constant
+    for (int i = 0; i < func->upvalue_cnt; i++) {
+        cur_compiler->locals[slots[2 * i]].capture_cnt--;
+    }
+
+    Chunk_t *body = &func->chunk;
+    for (int offset = 0; offset < body->count; offset += instruction_length(body, offset)) {
+        if (body->code[offset] == OP_GET_UPVALUE) {
+            body->code[offset] = OP_GET_ENCLOSING;
+            body->code[offset + 1] = slots[2 * body->code[offset + 1]];
+        } else if (body->code[offset] == OP_SET_UPVALUE) {
+            body->code[offset] = OP_SET_ENCLOSING;
+            body->code[offset + 1] = slots[2 * body->code[offset + 1]];
+        }
+    }
+
+    if (func->shared_closure == NULL) {
+        func->shared_closure = create_closure(func);
+    }
+    code[0] = OP_STACK_CLOSURE;
+    local->closure_at = -1;
+}
+
 // put a temporary offset while we calculate the actual offset of branch then
 // replace temp later
 int emit_branch(uint8_t instruction) {
@@ -501,6 +598,7 @@ void fix_branch(int offset) {
 
     get_cur_chunk()->code[offset] = (branch >> 8) & 0xff;
     get_cur_chunk()->code[offset + 1] = branch & 0xff;
+    set_fold_barrier(); // the branch lands here
 }
 
 /*
@@ -518,6 +616,26 @@ void if_statement() {
     expression(); // condition
     consume(TOKEN_CLOSE_PAREN, "Expected ')' after condition statement");
 
+    // constant condition -> only the arm that can run is kept
+    ConstTail_t cond;
+    if (tail_constant(&cond)) {
+        drop_constant(&cond);
+        bool take_then = !const_is_falsey(cond.value);
+        if (take_then) {
+            statement();
+        } else {
+            dead_statement();
+        }
+        if (match(TOKEN_ELSE)) {
+            if (take_then) {
+                dead_statement();
+            } else {
+                statement();
+            }
+        }
+        return;
+    }
+
     int then_offset = emit_branch(OP_BRANCH_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -539,6 +657,21 @@ void if_statement() {
  * end:
  */
 void and_(bool can_assign) {
+    ConstTail_t left;
+    if (tail_constant(&left)) {
+        if (const_is_falsey(left.value)) {
+            // right side can never be evaluated
+            int dead_start = get_cur_chunk()->count;
+            parse_precedence(PREC_AND);
+            truncate_code(dead_start);
+            cur_compiler->last_const = left;
+        } else {
+            drop_constant(&left);
+            parse_precedence(PREC_AND);
+        }
+        return;
+    }
+
     int end_branch = emit_branch(OP_BRANCH_IF_FALSE);
 
     emit_byte(OP_POP);
@@ -556,6 +689,20 @@ void and_(bool can_assign) {
  * end:
  */
 void or_(bool can_assign) {
+    ConstTail_t left;
+    if (tail_constant(&left)) {
+        if (!const_is_falsey(left.value)) {
+            int dead_start = get_cur_chunk()->count;
+            parse_precedence(PREC_OR);
+            truncate_code(dead_start);
+            cur_compiler->last_const = left;
+        } else {
+            drop_constant(&left);
+            parse_precedence(PREC_OR);
+        }
+        return;
+    }
+
     int else_branch = emit_branch(OP_BRANCH_IF_FALSE);
     int end_branch = emit_branch(OP_BRANCH);
 
@@ -587,11 +734,25 @@ void emit_loop(int loop_start) {
  */
 void while_statement() {
     int loop_start = get_cur_chunk()->count;
+    set_fold_barrier();
 
     consume(TOKEN_OPEN_PAREN, "Expected '(' after if");
     expression(); // condition
     consume(TOKEN_CLOSE_PAREN, "Expected ')' after condition statement");
 
+    ConstTail_t cond;
+    if (tail_constant(&cond)) {
+        drop_constant(&cond);
+        if (const_is_falsey(cond.value)) {
+            dead_statement();
+        } else {
+            // while (true) -> no exit test at all
+            statement();
+            emit_loop(loop_start);
+        }
+        return;
+    }
+
     int exit_branch = emit_branch(OP_BRANCH_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -628,14 +789,20 @@ void for_statement() {
 
     // potential loop condition
     int loop_start = get_cur_chunk()->count;
+    set_fold_barrier();
     int exit_branch = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after condition statement");
 
-        // exit loop if condition = False
-        exit_branch = emit_branch(OP_BRANCH_IF_FALSE);
-        emit_byte(OP_POP);
+        ConstTail_t cond;
+        if (tail_constant(&cond) && !const_is_falsey(cond.value)) {
+            drop_constant(&cond); // always true, same as an empty condition
+        } else {
+            // exit loop if condition = False
+            exit_branch = emit_branch(OP_BRANCH_IF_FALSE);
+            emit_byte(OP_POP);
+        }
     }
 
     // potential incremetor
@@ -643,6 +810,7 @@ void for_statement() {
         int body_branch = emit_branch(OP_BRANCH);
 
         int increment_start = get_cur_chunk()->count;
+        set_fold_barrier();
         expression();
         emit_byte(OP_POP);
         consume(TOKEN_CLOSE_PAREN, "Expect ')'");
@@ -683,6 +851,7 @@ void return_statement() {
 }
 
 void statement() {
+    set_fold_barrier();
     if (match(TOKEN_PRINT)) {
         print_statement();
     } else if (match(TOKEN_IF)) {
@@ -703,10 +872,8 @@ void statement() {
 }
 
 void string(bool can_assign) {
-    write_constant(get_cur_chunk(),
-                   DECL_OBJ_VAL(allocate_str(parser.prev.start + 1,
-                                             parser.prev.length - 2)),
-                   parser.prev.line);
+    emit_constant(
+        DECL_OBJ_VAL(allocate_str(parser.prev.start + 1, parser.prev.length - 2)));
 }
 
 void emit_sized_opcode(OpCode_t short_op, OpCode_t long_op, int operand) {
@@ -778,12 +945,19 @@ int resolve_upvalue(Compiler_t *compiler, Token_t *name) {
 
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        Local_t *captured = &compiler->enclosing->locals[local];
+        int upvalue_cnt = compiler->func->upvalue_cnt;
+        int idx = add_upvalue(compiler, (uint8_t)local, true);
+        if (compiler->func->upvalue_cnt > upvalue_cnt) {
+            captured->capture_cnt++;
+        }
+        captured->escapes = true; // a local func captured by another closure can outlive its frame
+        return idx;
     }
 
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1) {
+        compiler->enclosing->forwards_upvalues = true;
         return add_upvalue(compiler, (uint8_t)upvalue, false);
     }
 
@@ -805,11 +979,17 @@ void named_let(Token_t name, bool can_assign) {
     } else {
         ObjectStr_t *global_name = allocate_str(name.start, name.length);
         operand =
-            constant_identifier(get_cur_chunk(), &compiler_ids, global_name);
+            constant_identifier(get_cur_chunk(), &cur_compiler->ids, global_name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
+    // a local read only to be called right away never leaves the frame
+    if (get_op == OP_GET_LOCAL &&
+        ((can_assign && check(TOKEN_EQUAL)) || !check(TOKEN_OPEN_PAREN))) {
+        cur_compiler->locals[operand].escapes = true;
+    }
+
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
         if (set_op == OP_SET_GLOBAL) {
@@ -838,7 +1018,7 @@ void dot(bool can_assign) {
     consume(TOKEN_IDENTIFIER, "Expected field name after '.'");
     ObjectStr_t *class_name =
         allocate_str(parser.prev.start, parser.prev.length);
-    // int operand = constant_identifier(get_cur_chunk(), &compiler_ids,
+    // int operand = constant_identifier(get_cur_chunk(), &cur_compiler->ids,
     // class_name);
     int operand = add_constant(get_cur_chunk(), DECL_OBJ_VAL(class_name));
 
@@ -850,7 +1030,9 @@ void dot(bool can_assign) {
         emit_bytes(OP_INVOKE, operand);
         emit_byte(arg_cnt);
     } else {
+        int start = get_cur_chunk()->count;
         emit_bytes(OP_GET_PROPERTY, operand);
+        set_member_tail(start, operand, false);
     }
 }
 
@@ -882,7 +1064,7 @@ void parse_precedence(Precedence_t prec) {
 
 void add_local(Token_t token) {
     if (cur_compiler->local_cnt + 1 > cur_compiler->local_cap) {
-        int old_capacity = cur_compiler->local_cnt;
+        int old_capacity = cur_compiler->local_cap;
         cur_compiler->local_cap = grow_capacity(old_capacity);
         cur_compiler->locals = resize(cur_compiler->locals, sizeof(Local_t),
                                       old_capacity, cur_compiler->local_cap);
@@ -890,7 +1072,9 @@ void add_local(Token_t token) {
     Local_t *local = &cur_compiler->locals[cur_compiler->local_cnt++];
     local->name = token;
     local->depth = -1;
-    local->is_captured = false;
+    local->capture_cnt = 0;
+    local->closure_at = -1;
+    local->escapes = false;
 }
 
 bool identifiers_equals(Token_t *a, Token_t *b) {
@@ -933,25 +1117,219 @@ int parse_let(const char *msg) {
         DECL_OBJ_VAL(allocate_str(parser.prev.start, parser.prev.length)));
 }
 
+// ===================================================================================================
+// constant folding -> operators look at the tail of the chunk and, when their operands are
+// constant loads emitted right before them, replace the loads with the result
+
+void set_fold_barrier() {
+    cur_compiler->fold_barrier = get_cur_chunk()->count;
+}
+
+bool const_is_falsey(Value_t value) {
+    return IS_NONE_VAL(value) || (IS_BOOL_VAL(value) && !GET_BOOL_VAL(value));
+}
+
+void record_bool(int start) {
+    cur_compiler->bool_start = start;
+    cur_compiler->bool_end = get_cur_chunk()->count;
+}
+
+void emit_constant(Value_t value) {
+    Chunk_t *chunk = get_cur_chunk();
+    int start = chunk->count;
+    write_constant(chunk, value, parser.prev.line);
+    cur_compiler->last_const =
+        (ConstTail_t){start, chunk->count, value, chunk->constants.count - 1};
+}
+
+void emit_literal(Value_t value) {
+    int start = get_cur_chunk()->count;
+    if (IS_NONE_VAL(value)) {
+        emit_byte(OP_NONE);
+    } else {
+        emit_byte(GET_BOOL_VAL(value) ? OP_TRUE : OP_FALSE);
+        record_bool(start);
+    }
+    cur_compiler->last_const = (ConstTail_t){start, start + 1, value, -1};
+}
+
+void emit_bool_op(OpCode_t op) {
+    int start = get_cur_chunk()->count;
+    emit_byte(op);
+    record_bool(start);
+}
+
+void emit_not() {
+    Compiler_t *compiler = cur_compiler;
+    int start = get_cur_chunk()->count;
+    compiler->not_of_bool =
+        compiler->bool_end == start && compiler->bool_start >= compiler->fold_barrier;
+    compiler->not_operand_start = compiler->bool_start;
+    emit_byte(OP_NOT);
+    compiler->not_pos = start;
+    record_bool(start);
+}
+
+// is the code just emitted a lone constant load nothing can branch into
+bool tail_constant(ConstTail_t *out) {
+    ConstTail_t *tail = &cur_compiler->last_const;
+    if (tail->end != get_cur_chunk()->count || tail->start < cur_compiler->fold_barrier) {
+        return false;
+    }
+    *out = *tail;
+    return true;
+}
+
+// remove code from count onwards and forget any fold state that pointed into it
+void truncate_code(int count) {
+    truncate_chunk(get_cur_chunk(), count);
+    if (cur_compiler->last_const.end > count) {
+        cur_compiler->last_const.end = -1;
+    }
+    if (cur_compiler->bool_end > count) {
+        cur_compiler->bool_end = -1;
+    }
+    if (cur_compiler->not_pos >= count) {
+        cur_compiler->not_pos = -1;
+    }
+    if (cur_compiler->member_end > count) {
+        cur_compiler->member_end = -1;
+    }
+}
+
+void set_member_tail(int start, int operand, bool is_super) {
+    cur_compiler->member_start = start;
+    cur_compiler->member_end = get_cur_chunk()->count;
+    cur_compiler->member_operand = operand;
+    cur_compiler->member_is_super = is_super;
+}
+
+// removes the load and its pool slot too if nothing else could have used it
+void drop_constant(ConstTail_t *tail) {
+    ValueArray_t *constants = &get_cur_chunk()->constants;
+    truncate_code(tail->start);
+    if (tail->pool_idx != -1 && tail->pool_idx == constants->count - 1) {
+        constants->count--;
+    }
+}
+
+// compiles a statement for its errors only, none of its code is kept
+void dead_statement() {
+    int dead_start = get_cur_chunk()->count;
+    statement();
+    truncate_code(dead_start);
+    set_fold_barrier();
+}
+
+bool fold_binary(TokenType_t op_type, Value_t a, Value_t b, Value_t *out) {
+    if (op_type == TOKEN_EQUAL_EQUAL || op_type == TOKEN_NOT_EQUAL) {
+        *out = DECL_BOOL_VAL(equals(a, b) == (op_type == TOKEN_EQUAL_EQUAL));
+        return true;
+    }
+    if (op_type == TOKEN_ADD && IS_STR(a) && IS_STR(b)) {
+        ObjectStr_t *str_a = GET_STR_VAL(a);
+        ObjectStr_t *str_b = GET_STR_VAL(b);
+        int length = str_a->length + str_b->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, str_a->chars, str_a->length);
+        memcpy(chars + str_a->length, str_b->chars, str_b->length);
+        chars[length] = '\0';
+        *out = DECL_OBJ_VAL(allocate_str(chars, length));
+        free(chars);
+        return true;
+    }
+    if (!IS_NUMERIC_VAL(a) || !IS_NUMERIC_VAL(b)) {
+        return false; // leave it for the runtime error
+    }
+    switch (op_type) {
+        case TOKEN_ADD:
+            *out = num_add(a, b);
+            return true;
+        case TOKEN_SUB:
+            *out = num_sub(a, b);
+            return true;
+        case TOKEN_MUL:
+            *out = num_mul(a, b);
+            return true;
+        case TOKEN_DIV:
+            *out = num_div(a, b);
+            return true;
+        case TOKEN_MOD:
+            if (IS_INT_VAL(a) && IS_INT_VAL(b) && GET_INT_VAL(b) == 0) {
+                return false;
+            }
+            *out = num_mod(a, b);
+            return true;
+        case TOKEN_LESS_THAN:
+            *out = DECL_BOOL_VAL(num_less(a, b));
+            return true;
+        case TOKEN_LESS_THAN_EQUAL:
+            *out = DECL_BOOL_VAL(!num_greater(a, b));
+            return true;
+        case TOKEN_GREATER_THAN:
+            *out = DECL_BOOL_VAL(num_greater(a, b));
+            return true;
+        case TOKEN_GREATER_THAN_EQUAL:
+            *out = DECL_BOOL_VAL(!num_less(a, b));
+            return true;
+        default:
+            break;
+    }
+    if (!IS_INT_VAL(a) || !IS_INT_VAL(b)) {
+        return false;
+    }
+    int64_t x = GET_INT_VAL(a);
+    int64_t y = GET_INT_VAL(b);
+    switch (op_type) {
+        case TOKEN_BIT_AND:
+            *out = DECL_INT_VAL(x & y);
+            return true;
+        case TOKEN_BIT_OR:
+            *out = DECL_INT_VAL(x | y);
+            return true;
+        case TOKEN_BIT_XOR:
+            *out = DECL_INT_VAL(x ^ y);
+            return true;
+        case TOKEN_LEFT_SHIFT:
+        case TOKEN_RIGHT_SHIFT:
+            if (y < 0 || y > 63) {
+                return false;
+            }
+            *out = DECL_INT_VAL(op_type == TOKEN_LEFT_SHIFT ? shift_left(x, y) : shift_right(x, y));
+            return true;
+        default:
+            return false;
+    }
+}
+
 void literal(bool can_assign) {
     switch (parser.prev.type) {
         case TOKEN_FALSE:
-            emit_byte(OP_FALSE);
+            emit_literal(DECL_BOOL_VAL(false));
             break;
         case TOKEN_TRUE:
-            emit_byte(OP_TRUE);
+            emit_literal(DECL_BOOL_VAL(true));
             break;
         case TOKEN_NONE:
-            emit_byte(OP_NONE);
+            emit_literal(DECL_NONE_VAL);
             break;
         default:
             return;
     }
 }
 
+// literals without a decimal point are ints unless they don't fit in 64 bits
 void number(bool can_assign) {
+    if (memchr(parser.prev.start, '.', parser.prev.length) == NULL) {
+        errno = 0;
+        long long val = strtoll(parser.prev.start, NULL, 10);
+        if (errno != ERANGE) {
+            emit_constant(DECL_INT_VAL((int64_t)val));
+            return;
+        }
+    }
     double val = strtod(parser.prev.start, NULL);
-    write_constant(get_cur_chunk(), DECL_NUM_VAL(val), parser.prev.line);
+    emit_constant(DECL_NUM_VAL(val));
 }
 
 void grouping(bool can_assign) {
@@ -963,12 +1341,37 @@ void unary(bool can_assign) {
     TokenType_t op_type = parser.prev.type;
     parse_precedence(PREC_UNARY);
 
+    ConstTail_t operand;
+    if (tail_constant(&operand)) {
+        if (op_type == TOKEN_NOT) {
+            drop_constant(&operand);
+            emit_literal(DECL_BOOL_VAL(const_is_falsey(operand.value)));
+            return;
+        }
+        if (op_type == TOKEN_SUB && IS_NUMERIC_VAL(operand.value)) {
+            drop_constant(&operand);
+            emit_constant(num_negate(operand.value));
+            return;
+        }
+    }
+
     // negate operator emitted last bc we need value first so we have smtg to
     // negate
     switch (op_type) {
-        case TOKEN_NOT:
-            emit_byte(OP_NOT);
+        case TOKEN_NOT: {
+            // !!b where b is already a bool -> the two nots cancel out
+            Compiler_t *compiler = cur_compiler;
+            if (compiler->not_pos + 1 == get_cur_chunk()->count &&
+                compiler->not_pos >= compiler->fold_barrier && compiler->not_of_bool) {
+                int operand_start = compiler->not_operand_start;
+                truncate_code(compiler->not_pos);
+                compiler->bool_start = operand_start;
+                compiler->bool_end = get_cur_chunk()->count;
+                return;
+            }
+            emit_not();
             break;
+        }
         case TOKEN_SUB:
             emit_byte(OP_NEGATE);
             break;
@@ -980,30 +1383,50 @@ void unary(bool can_assign) {
 void binary(bool can_assign) {
     // left operator
     TokenType_t op_type = parser.prev.type;
+    ConstTail_t left;
+    bool left_is_const = tail_constant(&left);
 
     // parse right expression
     ParseRule_t *rule = &rules[op_type];
     parse_precedence((Precedence_t)(rule->precedence + 1));
 
+    // both operands are adjacent constant loads -> evaluate now
+    ConstTail_t right;
+    Value_t folded;
+    if (left_is_const && tail_constant(&right) && right.start == left.end &&
+        fold_binary(op_type, left.value, right.value, &folded)) {
+        drop_constant(&right);
+        drop_constant(&left);
+        if (IS_OBJ_VAL(folded) || IS_NUMERIC_VAL(folded)) {
+            emit_constant(folded);
+        } else {
+            emit_literal(folded);
+        }
+        return;
+    }
+
     // write the op instruction
     switch (op_type) {
         case TOKEN_NOT_EQUAL:
-            emit_bytes(OP_EQUAL, OP_NOT);
+            emit_bool_op(OP_EQUAL);
+            emit_not();
             break;
         case TOKEN_LESS_THAN:
-            emit_byte(OP_LESS_THAN);
+            emit_bool_op(OP_LESS_THAN);
             break;
         case TOKEN_LESS_THAN_EQUAL:
-            emit_bytes(OP_GREATER_THAN, OP_NOT);
+            emit_bool_op(OP_GREATER_THAN);
+            emit_not();
             break;
         case TOKEN_GREATER_THAN:
-            emit_byte(OP_GREATER_THAN);
+            emit_bool_op(OP_GREATER_THAN);
             break;
         case TOKEN_GREATER_THAN_EQUAL:
-            emit_bytes(OP_LESS_THAN, OP_NOT);
+            emit_bool_op(OP_LESS_THAN);
+            emit_not();
             break;
         case TOKEN_EQUAL_EQUAL:
-            emit_byte(OP_EQUAL);
+            emit_bool_op(OP_EQUAL);
             break;
         case TOKEN_ADD:
             emit_byte(OP_ADD);
@@ -1017,16 +1440,83 @@ void binary(bool can_assign) {
         case TOKEN_DIV:
             emit_byte(OP_DIV);
             break;
+        case TOKEN_MOD:
+            emit_byte(OP_MOD);
+            break;
+        case TOKEN_BIT_AND:
+            emit_byte(OP_BIT_AND);
+            break;
+        case TOKEN_BIT_OR:
+            emit_byte(OP_BIT_OR);
+            break;
+        case TOKEN_BIT_XOR:
+            emit_byte(OP_BIT_XOR);
+            break;
+        case TOKEN_LEFT_SHIFT:
+            emit_byte(OP_SHIFT_LEFT);
+            break;
+        case TOKEN_RIGHT_SHIFT:
+            emit_byte(OP_SHIFT_RIGHT);
+            break;
         default:
             return;
     }
 }
 
 void call(bool can_assign) {
+    // (obj.method)(args) and (super.method)(args) skip the bound method too
+    Compiler_t *compiler = cur_compiler;
+    if (compiler->member_end == get_cur_chunk()->count &&
+        compiler->member_start >= compiler->fold_barrier) {
+        int operand = compiler->member_operand;
+        bool is_super = compiler->member_is_super;
+        truncate_code(compiler->member_start);
+        uint8_t arg_cnt = arg_list();
+        if (is_super) {
+            named_let(synthetic_token("super"), false);
+            emit_sized_opcode(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, operand);
+        } else {
+            emit_bytes(OP_INVOKE, operand);
+        }
+        emit_byte(arg_cnt);
+        return;
+    }
     uint8_t arg_count = arg_list();
     emit_bytes(OP_CALL, arg_count);
 }
 
+// [a, b, c] -> elements are pushed in order then collected by OP_BUILD_LIST
+void list(bool can_assign) {
+    int elem_cnt = 0;
+    if (!check(TOKEN_CLOSE_BRACKET)) {
+        do {
+            if (check(TOKEN_CLOSE_BRACKET)) {
+                break; // allow a trailing comma
+            }
+            expression();
+            if (elem_cnt == 255) {
+                report_error(&parser.prev,
+                             "Cannot have more than 255 elements in a list literal");
+            }
+            elem_cnt++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_CLOSE_BRACKET, "Expected ']' after list elements");
+    emit_bytes(OP_BUILD_LIST, (uint8_t)elem_cnt);
+}
+
+void index_(bool can_assign) {
+    expression();
+    consume(TOKEN_CLOSE_BRACKET, "Expected ']' after index");
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        expression();
+        emit_byte(OP_INDEX_SET);
+    } else {
+        emit_byte(OP_INDEX_GET);
+    }
+}
+
 // ===================================================================================================
 
 bool check(TokenType_t type) {
@@ -1059,15 +1549,15 @@ void report_error(Token_t *token, const char *msg) {
         return;
     }
     parser.is_panicking = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(cur_vm->err, "[line %d] Error", token->line);
     if (token->type == TOKEN_END_FILE) {
-        fprintf(stderr, " end of file");
+        fprintf(cur_vm->err, " end of file");
     } else if (token->type != TOKEN_ERROR) {
         // error tokens are not stored in entirety so only print the lexme if
         // token != error
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(cur_vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", msg);
+    fprintf(cur_vm->err, ": %s\n", msg);
     parser.has_error = true;
 }
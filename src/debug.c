@@ -11,6 +11,8 @@ int byte_instruction_long(const char *name, Chunk_t *chunk, int offset);
 int branch_instruction(const char *name, int sign, Chunk_t *chunk, int offset);
 int invoke_instruction(const char *name, Chunk_t *chunk, int offset);
 int invoke_instruction_long(const char *name, Chunk_t *chunk, int offset);
+int local_pair_instruction(const char *name, Chunk_t *chunk, int offset);
+int local_constant_instruction(const char *name, Chunk_t *chunk, int offset);
 
 // given machine code -> output list of instructions
 void disassemble_chunk(Chunk_t *chunk, const char *name) {
@@ -83,6 +85,18 @@ int disassemble_instruction(Chunk_t *chunk, int offset) {
             return standard_instruction("OP_MUL", offset);
         case OP_DIV:
             return standard_instruction("OP_DIV", offset);
+        case OP_MOD:
+            return standard_instruction("OP_MOD", offset);
+        case OP_BIT_AND:
+            return standard_instruction("OP_BIT_AND", offset);
+        case OP_BIT_OR:
+            return standard_instruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:
+            return standard_instruction("OP_BIT_XOR", offset);
+        case OP_SHIFT_LEFT:
+            return standard_instruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT:
+            return standard_instruction("OP_SHIFT_RIGHT", offset);
         case OP_PRINT:
             return standard_instruction("OP_PRINT", offset);
         case OP_POP:
@@ -95,10 +109,12 @@ int disassemble_instruction(Chunk_t *chunk, int offset) {
             return branch_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
-        case OP_CLOSURE: {
+        case OP_CLOSURE:
+        case OP_STACK_CLOSURE: {
+            const char *name = chunk->code[offset] == OP_CLOSURE ? "OP_CLOSURE" : "OP_STACK_CLOSURE";
             offset++;
             uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            printf("%-16s %4d ", name, constant);
             print_value(chunk->constants.values[constant]);
             printf("\n");
 
@@ -116,6 +132,10 @@ int disassemble_instruction(Chunk_t *chunk, int offset) {
             return byte_instruction("OP_SET_UPVALUE", chunk, offset);
         case OP_CLOSE_UPVALUE:
             return standard_instruction("OP_CLOSE_UPVALUE", offset);
+        case OP_GET_ENCLOSING:
+            return byte_instruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return byte_instruction("OP_SET_ENCLOSING", chunk, offset);
         case OP_CLASS:
             return constant_instruction("OP_CLASS", chunk, offset);
         case OP_CLASS_LONG:
@@ -133,13 +153,53 @@ int disassemble_instruction(Chunk_t *chunk, int offset) {
         case OP_INHERIT:
             return standard_instruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
-            return standard_instruction("OP_GET_SUPER", offset);
+            return constant_instruction("OP_GET_SUPER", chunk, offset);
         case OP_GET_SUPER_LONG:
             return constant_long_instruction("OP_GET_SUPER_LONG", chunk, offset);
         case OP_SUPER_INVOKE:
             return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE_LONG:
             return invoke_instruction_long("OP_SUPER_INVOKE_LONG", chunk, offset);
+        case OP_BUILD_LIST:
+            return byte_instruction("OP_BUILD_LIST", chunk, offset);
+        case OP_INDEX_GET:
+            return standard_instruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return standard_instruction("OP_INDEX_SET", offset);
+        case OP_ADD_LOCALS:
+            return local_pair_instruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_INC_LOCAL:
+            return local_constant_instruction("OP_INC_LOCAL", chunk, offset);
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+            jump |= chunk->code[offset + 4];
+            printf("%-16s %4d < '", "OP_LESS_LOCAL_CONST_JUMP", chunk->code[offset + 1]);
+            print_value(chunk->constants.values[chunk->code[offset + 2]]);
+            printf("' else -> %d\n", offset + 5 + jump);
+            return offset + 5;
+        }
+        case OP_NOT_EQUAL:
+            return standard_instruction("OP_NOT_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return standard_instruction("OP_LESS_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return standard_instruction("OP_GREATER_EQUAL", offset);
+        case OP_ADD_NN:
+            return standard_instruction("OP_ADD_NN", offset);
+        case OP_SUB_NN:
+            return standard_instruction("OP_SUB_NN", offset);
+        case OP_MUL_NN:
+            return standard_instruction("OP_MUL_NN", offset);
+        case OP_DIV_NN:
+            return standard_instruction("OP_DIV_NN", offset);
+        case OP_LESS_NN:
+            return standard_instruction("OP_LESS_NN", offset);
+        case OP_GREATER_NN:
+            return standard_instruction("OP_GREATER_NN", offset);
+        case OP_LESS_EQUAL_NN:
+            return standard_instruction("OP_LESS_EQUAL_NN", offset);
+        case OP_GREATER_EQUAL_NN:
+            return standard_instruction("OP_GREATER_EQUAL_NN", offset);
         default:
             printf("Unknown OpCode %d\n", instruction);
             return offset + 1;
@@ -195,6 +255,18 @@ int byte_instruction_long(const char *name, Chunk_t *chunk, int offset) {
     return offset + 4;
 }
 
+int local_pair_instruction(const char *name, Chunk_t *chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+int local_constant_instruction(const char *name, Chunk_t *chunk, int offset) {
+    printf("%-16s %4d '", name, chunk->code[offset + 1]);
+    print_value(chunk->constants.values[chunk->code[offset + 2]]);
+    printf("'\n");
+    return offset + 3;
+}
+
 int invoke_instruction(const char *name, Chunk_t *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
@@ -221,3 +293,294 @@ int invoke_instruction_long(const char *name, Chunk_t *chunk, int offset) {
     printf("'\n");
     return offset + 5;
 }
+
+// ------------------------ Register Code ------------------------ //
+static const char *reg_op_names[] = {
+    [ROP_MOVE] = "MOVE",
+    [ROP_LOADK] = "LOADK",
+    [ROP_LOAD_NONE] = "LOAD_NONE",
+    [ROP_LOAD_TRUE] = "LOAD_TRUE",
+    [ROP_LOAD_FALSE] = "LOAD_FALSE",
+    [ROP_ADD] = "ADD",
+    [ROP_ADDK] = "ADDK",
+    [ROP_SUB] = "SUB",
+    [ROP_SUBK] = "SUBK",
+    [ROP_MUL] = "MUL",
+    [ROP_MULK] = "MULK",
+    [ROP_DIV] = "DIV",
+    [ROP_DIVK] = "DIVK",
+    [ROP_MOD] = "MOD",
+    [ROP_MODK] = "MODK",
+    [ROP_BIT_AND] = "BIT_AND",
+    [ROP_BIT_ANDK] = "BIT_ANDK",
+    [ROP_BIT_OR] = "BIT_OR",
+    [ROP_BIT_ORK] = "BIT_ORK",
+    [ROP_BIT_XOR] = "BIT_XOR",
+    [ROP_BIT_XORK] = "BIT_XORK",
+    [ROP_SHIFT_LEFT] = "SHIFT_LEFT",
+    [ROP_SHIFT_LEFTK] = "SHIFT_LEFTK",
+    [ROP_SHIFT_RIGHT] = "SHIFT_RIGHT",
+    [ROP_SHIFT_RIGHTK] = "SHIFT_RIGHTK",
+    [ROP_EQUAL] = "EQUAL",
+    [ROP_EQUALK] = "EQUALK",
+    [ROP_NOT_EQUAL] = "NOT_EQUAL",
+    [ROP_NOT_EQUALK] = "NOT_EQUALK",
+    [ROP_LESS] = "LESS",
+    [ROP_LESSK] = "LESSK",
+    [ROP_LESS_EQUAL] = "LESS_EQUAL",
+    [ROP_LESS_EQUALK] = "LESS_EQUALK",
+    [ROP_GREATER] = "GREATER",
+    [ROP_GREATERK] = "GREATERK",
+    [ROP_GREATER_EQUAL] = "GREATER_EQUAL",
+    [ROP_GREATER_EQUALK] = "GREATER_EQUALK",
+    [ROP_NOT] = "NOT",
+    [ROP_NEGATE] = "NEGATE",
+    [ROP_JUMP] = "JUMP",
+    [ROP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+    [ROP_LESS_JUMP] = "LESS_JUMP",
+    [ROP_LESSK_JUMP] = "LESSK_JUMP",
+    [ROP_LESS_EQUAL_JUMP] = "LESS_EQUAL_JUMP",
+    [ROP_LESS_EQUALK_JUMP] = "LESS_EQUALK_JUMP",
+    [ROP_GREATER_JUMP] = "GREATER_JUMP",
+    [ROP_GREATERK_JUMP] = "GREATERK_JUMP",
+    [ROP_GREATER_EQUAL_JUMP] = "GREATER_EQUAL_JUMP",
+    [ROP_GREATER_EQUALK_JUMP] = "GREATER_EQUALK_JUMP",
+    [ROP_PRINT] = "PRINT",
+    [ROP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+    [ROP_GET_GLOBAL] = "GET_GLOBAL",
+    [ROP_SET_GLOBAL] = "SET_GLOBAL",
+    [ROP_GET_UPVALUE] = "GET_UPVALUE",
+    [ROP_SET_UPVALUE] = "SET_UPVALUE",
+    [ROP_CLOSE_UPVALUE] = "CLOSE_UPVALUE",
+    [ROP_GET_ENCLOSING] = "GET_ENCLOSING",
+    [ROP_SET_ENCLOSING] = "SET_ENCLOSING",
+    [ROP_CALL] = "CALL",
+    [ROP_INVOKE] = "INVOKE",
+    [ROP_SUPER_INVOKE] = "SUPER_INVOKE",
+    [ROP_RETURN] = "RETURN",
+    [ROP_CLOSURE] = "CLOSURE",
+    [ROP_STACK_CLOSURE] = "STACK_CLOSURE",
+    [ROP_CLASS] = "CLASS",
+    [ROP_GET_PROPERTY] = "GET_PROPERTY",
+    [ROP_SET_PROPERTY] = "SET_PROPERTY",
+    [ROP_METHOD] = "METHOD",
+    [ROP_INHERIT] = "INHERIT",
+    [ROP_GET_SUPER] = "GET_SUPER",
+    [ROP_BUILD_LIST] = "BUILD_LIST",
+    [ROP_INDEX_GET] = "INDEX_GET",
+    [ROP_INDEX_SET] = "INDEX_SET",
+};
+
+void disassemble_reg_chunk(RegChunk_t *reg_chunk, ValueArray_t *constants, const char *name) {
+    printf("== %s (registers: %d) ==\n", name, reg_chunk->reg_cnt);
+
+    int pc = 0;
+    while (pc < reg_chunk->count) {
+        pc = disassemble_reg_instruction(reg_chunk, constants, pc);
+    }
+}
+
+int disassemble_reg_instruction(RegChunk_t *reg_chunk, ValueArray_t *constants, int pc) {
+    printf("%04d ", pc);
+    if (pc > 0 && reg_chunk->lines[pc] == reg_chunk->lines[pc - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", reg_chunk->lines[pc]);
+    }
+
+    uint32_t word = reg_chunk->code[pc];
+    RegOpCode_t op = (RegOpCode_t)REG_OP(word);
+    printf("%-20s", reg_op_names[op]);
+    switch (op) {
+        case ROP_LOADK:
+        case ROP_DEFINE_GLOBAL:
+        case ROP_GET_GLOBAL:
+        case ROP_SET_GLOBAL:
+        case ROP_STACK_CLOSURE:
+        case ROP_CLASS:
+            printf(" r%d '", REG_A(word));
+            print_value(constants->values[REG_BX(word)]);
+            printf("'\n");
+            return pc + 1;
+        case ROP_LOAD_NONE:
+        case ROP_LOAD_TRUE:
+        case ROP_LOAD_FALSE:
+        case ROP_PRINT:
+        case ROP_CLOSE_UPVALUE:
+        case ROP_RETURN:
+            printf(" r%d\n", REG_A(word));
+            return pc + 1;
+        case ROP_MOVE:
+        case ROP_NOT:
+        case ROP_NEGATE:
+        case ROP_INHERIT:
+            printf(" r%d r%d\n", REG_A(word), REG_B(word));
+            return pc + 1;
+        case ROP_GET_UPVALUE:
+        case ROP_SET_UPVALUE:
+            printf(" r%d up%d\n", REG_A(word), REG_B(word));
+            return pc + 1;
+        case ROP_GET_ENCLOSING:
+        case ROP_SET_ENCLOSING:
+            printf(" r%d caller r%d\n", REG_A(word), REG_B(word));
+            return pc + 1;
+        case ROP_CALL:
+        case ROP_BUILD_LIST:
+            printf(" r%d (%d)\n", REG_A(word), REG_B(word));
+            return pc + 1;
+        case ROP_ADDK:
+        case ROP_SUBK:
+        case ROP_MULK:
+        case ROP_DIVK:
+        case ROP_MODK:
+        case ROP_BIT_ANDK:
+        case ROP_BIT_ORK:
+        case ROP_BIT_XORK:
+        case ROP_SHIFT_LEFTK:
+        case ROP_SHIFT_RIGHTK:
+        case ROP_EQUALK:
+        case ROP_NOT_EQUALK:
+        case ROP_LESSK:
+        case ROP_LESS_EQUALK:
+        case ROP_GREATERK:
+        case ROP_GREATER_EQUALK:
+            printf(" r%d r%d '", REG_A(word), REG_B(word));
+            print_value(constants->values[REG_C(word)]);
+            printf("'\n");
+            return pc + 1;
+        case ROP_JUMP:
+            printf(" -> %d\n", pc + 2 + (int32_t)reg_chunk->code[pc + 1]);
+            return pc + 2;
+        case ROP_JUMP_IF_FALSE:
+            printf(" r%d -> %d\n", REG_A(word), pc + 2 + (int32_t)reg_chunk->code[pc + 1]);
+            return pc + 2;
+        case ROP_LESS_JUMP:
+        case ROP_LESS_EQUAL_JUMP:
+        case ROP_GREATER_JUMP:
+        case ROP_GREATER_EQUAL_JUMP:
+            printf(" r%d r%d else -> %d\n", REG_A(word), REG_B(word),
+                   pc + 2 + (int32_t)reg_chunk->code[pc + 1]);
+            return pc + 2;
+        case ROP_LESSK_JUMP:
+        case ROP_LESS_EQUALK_JUMP:
+        case ROP_GREATERK_JUMP:
+        case ROP_GREATER_EQUALK_JUMP:
+            printf(" r%d '", REG_A(word));
+            print_value(constants->values[REG_B(word)]);
+            printf("' else -> %d\n", pc + 2 + (int32_t)reg_chunk->code[pc + 1]);
+            return pc + 2;
+        case ROP_INVOKE:
+        case ROP_SUPER_INVOKE:
+            printf(" r%d (%d) '", REG_A(word), REG_B(word));
+            print_value(constants->values[reg_chunk->code[pc + 1]]);
+            printf("'\n");
+            return pc + 2;
+        case ROP_GET_PROPERTY:
+        case ROP_SET_PROPERTY:
+        case ROP_METHOD:
+            printf(" r%d r%d '", REG_A(word), REG_B(word));
+            print_value(constants->values[reg_chunk->code[pc + 1]]);
+            printf("'\n");
+            return pc + 2;
+        case ROP_GET_SUPER:
+            printf(" r%d r%d r%d '", REG_A(word), REG_B(word), REG_C(word));
+            print_value(constants->values[reg_chunk->code[pc + 1]]);
+            printf("'\n");
+            return pc + 2;
+        case ROP_CLOSURE: {
+            ObjectFunc_t *func = GET_FUNC(constants->values[REG_BX(word)]);
+            printf(" r%d '", REG_A(word));
+            print_value(constants->values[REG_BX(word)]);
+            printf("'\n");
+            for (int i = 0; i < func->upvalue_cnt; i++) {
+                uint32_t upvalue = reg_chunk->code[pc + 1 + i];
+                printf("%04d    |   %s %d\n", pc + 1 + i, REG_OP(upvalue) ? "local" : "upvalue",
+                       REG_A(upvalue));
+            }
+            return pc + 1 + func->upvalue_cnt;
+        }
+        default:
+            printf(" r%d r%d r%d\n", REG_A(word), REG_B(word), REG_C(word));
+            return pc + 1;
+    }
+}
+
+static const char *opcode_names[OP_CODE_CNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NONE] = "OP_NONE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUB] = "OP_SUB",
+    [OP_MUL] = "OP_MUL",
+    [OP_DIV] = "OP_DIV",
+    [OP_MOD] = "OP_MOD",
+    [OP_BIT_AND] = "OP_BIT_AND",
+    [OP_BIT_OR] = "OP_BIT_OR",
+    [OP_BIT_XOR] = "OP_BIT_XOR",
+    [OP_SHIFT_LEFT] = "OP_SHIFT_LEFT",
+    [OP_SHIFT_RIGHT] = "OP_SHIFT_RIGHT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER_THAN] = "OP_GREATER_THAN",
+    [OP_LESS_THAN] = "OP_LESS_THAN",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_BRANCH_IF_FALSE] = "OP_BRANCH_IF_FALSE",
+    [OP_BRANCH] = "OP_BRANCH",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+    [OP_BUILD_LIST] = "OP_BUILD_LIST",
+    [OP_INDEX_GET] = "OP_INDEX_GET",
+    [OP_INDEX_SET] = "OP_INDEX_SET",
+    [OP_STACK_CLOSURE] = "OP_STACK_CLOSURE",
+    [OP_GET_ENCLOSING] = "OP_GET_ENCLOSING",
+    [OP_SET_ENCLOSING] = "OP_SET_ENCLOSING",
+    [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+    [OP_LESS_LOCAL_CONST_JUMP] = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_INC_LOCAL] = "OP_INC_LOCAL",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_ADD_NN] = "OP_ADD_NN",
+    [OP_SUB_NN] = "OP_SUB_NN",
+    [OP_MUL_NN] = "OP_MUL_NN",
+    [OP_DIV_NN] = "OP_DIV_NN",
+    [OP_LESS_NN] = "OP_LESS_NN",
+    [OP_GREATER_NN] = "OP_GREATER_NN",
+    [OP_LESS_EQUAL_NN] = "OP_LESS_EQUAL_NN",
+    [OP_GREATER_EQUAL_NN] = "OP_GREATER_EQUAL_NN",
+};
+
+const char *opcode_name(int op) {
+    return op >= 0 && op < OP_CODE_CNT && opcode_names[op] != NULL ? opcode_names[op] : "OP_UNKNOWN";
+}
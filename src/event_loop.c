@@ -0,0 +1,580 @@
+#define _GNU_SOURCE
+
+#include "../includes/event_loop.h"
+#include "../includes/fiber.h"
+#include "../includes/isolate.h"
+#include "../includes/memory.h"
+#include "../includes/native.h"
+#include "../includes/vm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Tasks are fibers run by run_loop(). When a task's read, write, accept or
+ * sleep would block, the task is parked on the descriptor or a timer and the
+ * loop switches straight to the next ready task, so waits overlap instead of
+ * blocking the thread. Outside of a task the same natives simply block.
+ * Descriptors are ints and every one the natives hand out is non-blocking.
+ * Operations that fail at the OS level return none.
+ */
+
+#define MAX_EVENTS 64
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void *grow(void *ptr, size_t size) {
+    void *res = realloc(ptr, size);
+    if (res == NULL) {
+        exit(1);
+    }
+    return res;
+}
+
+void init_event_loop(EventLoop_t *loop) {
+    loop->epoll_fd = -1;
+    loop->ready = NULL;
+    loop->ready_head = 0;
+    loop->ready_cnt = 0;
+    loop->ready_capacity = 0;
+    loop->waiters = NULL;
+    loop->waiter_capacity = 0;
+    loop->waiter_cnt = 0;
+    loop->timers = NULL;
+    loop->timer_cnt = 0;
+    loop->timer_capacity = 0;
+    loop->running = false;
+}
+
+void free_event_loop(EventLoop_t *loop) {
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+    free(loop->ready);
+    free(loop->waiters);
+    free(loop->timers);
+    init_event_loop(loop);
+}
+
+void mark_event_loop(EventLoop_t *loop) {
+    for (int i = 0; i < loop->ready_cnt; i++) {
+        Task_t *task = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+        mark_object((Object_t *)task->fiber);
+        mark_value(task->value);
+    }
+    for (int fd = 0; fd < loop->waiter_capacity; fd++) {
+        mark_object((Object_t *)loop->waiters[fd].fiber);
+        mark_object((Object_t *)loop->waiters[fd].data);
+    }
+    for (int i = 0; i < loop->timer_cnt; i++) {
+        mark_object((Object_t *)loop->timers[i].fiber);
+    }
+}
+
+static void enqueue(EventLoop_t *loop, ObjectFiber_t *fiber, Value_t value, int arg_cnt) {
+    if (loop->ready_cnt == loop->ready_capacity) {
+        int capacity = grow_capacity(loop->ready_capacity);
+        Task_t *ready = (Task_t *)grow(NULL, sizeof(Task_t) * capacity);
+        for (int i = 0; i < loop->ready_cnt; i++) {
+            ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+        }
+        free(loop->ready);
+        loop->ready = ready;
+        loop->ready_head = 0;
+        loop->ready_capacity = capacity;
+    }
+    int tail = (loop->ready_head + loop->ready_cnt++) % loop->ready_capacity;
+    loop->ready[tail] = (Task_t){fiber, value, arg_cnt};
+}
+
+static Task_t dequeue(EventLoop_t *loop) {
+    Task_t task = loop->ready[loop->ready_head];
+    loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+    loop->ready_cnt--;
+    return task;
+}
+
+static void push_timer(EventLoop_t *loop, double deadline, ObjectFiber_t *fiber) {
+    if (loop->timer_cnt == loop->timer_capacity) {
+        loop->timer_capacity = grow_capacity(loop->timer_capacity);
+        loop->timers = (Timer_t *)grow(loop->timers, sizeof(Timer_t) * loop->timer_capacity);
+    }
+    int idx = loop->timer_cnt++;
+    while (idx > 0 && loop->timers[(idx - 1) / 2].deadline > deadline) {
+        loop->timers[idx] = loop->timers[(idx - 1) / 2];
+        idx = (idx - 1) / 2;
+    }
+    loop->timers[idx] = (Timer_t){deadline, fiber};
+}
+
+static ObjectFiber_t *pop_timer(EventLoop_t *loop) {
+    ObjectFiber_t *fiber = loop->timers[0].fiber;
+    Timer_t last = loop->timers[--loop->timer_cnt];
+    int idx = 0;
+    while (true) {
+        int child = idx * 2 + 1;
+        if (child >= loop->timer_cnt) {
+            break;
+        }
+        if (child + 1 < loop->timer_cnt &&
+            loop->timers[child + 1].deadline < loop->timers[child].deadline) {
+            child++;
+        }
+        if (loop->timers[child].deadline >= last.deadline) {
+            break;
+        }
+        loop->timers[idx] = loop->timers[child];
+        idx = child;
+    }
+    loop->timers[idx] = last;
+    return fiber;
+}
+
+static Waiter_t *waiter_of(EventLoop_t *loop, int fd) {
+    if (fd >= loop->waiter_capacity) {
+        int capacity = loop->waiter_capacity;
+        while (capacity <= fd) {
+            capacity = grow_capacity(capacity);
+        }
+        loop->waiters = (Waiter_t *)grow(loop->waiters, sizeof(Waiter_t) * capacity);
+        memset(loop->waiters + loop->waiter_capacity, 0,
+               sizeof(Waiter_t) * (capacity - loop->waiter_capacity));
+        loop->waiter_capacity = capacity;
+    }
+    return &loop->waiters[fd];
+}
+
+static bool arm(EventLoop_t *loop, int fd, WaitKind_t kind) {
+    struct epoll_event event;
+    event.events = (kind == WAIT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+        return true;
+    }
+    return errno == ENOENT && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// tries the operation once, false while it would still block
+static bool attempt(int fd, Waiter_t *waiter, Value_t *result) {
+    switch (waiter->kind) {
+        case WAIT_READ: {
+            char *buffer = (char *)malloc(waiter->max > 0 ? waiter->max : 1);
+            ssize_t n = read(fd, buffer, waiter->max);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                free(buffer);
+                return false;
+            }
+            *result = n < 0 ? DECL_NONE_VAL : DECL_OBJ_VAL(allocate_str(buffer, (int)n));
+            free(buffer);
+            return true;
+        }
+        case WAIT_WRITE: {
+            ObjectStr_t *data = waiter->data;
+            while (waiter->written < data->length) {
+                ssize_t n = write(fd, data->chars + waiter->written, data->length - waiter->written);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    return false;
+                }
+                if (n < 0) {
+                    *result = DECL_NONE_VAL;
+                    return true;
+                }
+                waiter->written += (int)n;
+            }
+            *result = DECL_INT_VAL(data->length);
+            return true;
+        }
+        case WAIT_ACCEPT: {
+            int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return false;
+            }
+            *result = client < 0 ? DECL_NONE_VAL : DECL_INT_VAL(client);
+            return true;
+        }
+        case WAIT_RECEIVE: {
+            // reset the send counter first, a send after this wakes us again
+            uint64_t sends;
+            if (read(fd, &sends, sizeof(sends)) < 0 && errno != EAGAIN) {
+                *result = DECL_NONE_VAL;
+                return true;
+            }
+            return receive_message(result);
+        }
+    }
+    return true;
+}
+
+// waits for descriptors or the earliest timer and queues the tasks they free
+static bool poll_events(EventLoop_t *loop) {
+    int timeout = -1;
+    if (loop->timer_cnt > 0) {
+        double wait = loop->timers[0].deadline - now_ms();
+        timeout = wait <= 0 ? 0 : (int)wait + 1;
+    }
+    if (loop->waiter_cnt > 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            throw_runtime_error("Event loop wait failed: %s", strerror(errno));
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            Waiter_t *waiter = &loop->waiters[fd];
+            if (waiter->fiber == NULL) {
+                continue;
+            }
+            Value_t result;
+            if (!attempt(fd, waiter, &result)) {
+                arm(loop, fd, waiter->kind);
+                continue;
+            }
+            ObjectFiber_t *fiber = waiter->fiber;
+            waiter->fiber = NULL;
+            waiter->data = NULL;
+            loop->waiter_cnt--;
+            enqueue(loop, fiber, result, 1);
+        }
+    } else if (timeout > 0) {
+        struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    double now = now_ms();
+    while (loop->timer_cnt > 0 && loop->timers[0].deadline <= now) {
+        enqueue(loop, pop_timer(loop), DECL_NONE_VAL, 1);
+    }
+    return true;
+}
+
+bool run_next_task(Value_t *callee) {
+    EventLoop_t *loop = &cur_vm->loop;
+    cur_vm->stack_top = callee + 1;
+    while (loop->ready_cnt == 0) {
+        if (loop->waiter_cnt == 0 && loop->timer_cnt == 0) {
+            *callee = DECL_NONE_VAL;
+            loop->running = false;
+            return true;
+        }
+        if (!poll_events(loop)) {
+            return false;
+        }
+    }
+    Task_t task = dequeue(loop);
+    *callee = DECL_OBJ_VAL(task.fiber);
+    if (task.arg_cnt == 1) {
+        push(task.value);
+    }
+    return resume_fiber(task.fiber, task.arg_cnt);
+}
+
+static bool in_task() {
+    return cur_vm->fiber != NULL && cur_vm->fiber->is_task;
+}
+
+// suspends the running task, the native's result comes from the loop later
+static bool park(Value_t *callee, int arg_cnt) {
+    if (!yield_fiber(DECL_NONE_VAL, callee, arg_cnt)) {
+        return false;
+    }
+    // yield_fiber left run_loop()'s slot right below the task's segment
+    if (!run_next_task(cur_vm->stack_top - arg_cnt - 1)) {
+        return false;
+    }
+    cur_vm->stack_top += arg_cnt; // call_value drops the native's arguments
+    return true;
+}
+
+bool perform_io(int fd, Waiter_t waiter, Value_t *args, int arg_cnt) {
+    Value_t result;
+    while (!attempt(fd, &waiter, &result)) {
+        if (in_task()) {
+            EventLoop_t *loop = &cur_vm->loop;
+            if (loop->epoll_fd < 0) {
+                loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            }
+            Waiter_t *slot = waiter_of(loop, fd);
+            if (slot->fiber != NULL) {
+                throw_runtime_error("Another task already waits on descriptor %d", fd);
+                return false;
+            }
+            if (!arm(loop, fd, waiter.kind)) {
+                throw_runtime_error("Cannot wait on descriptor %d: %s", fd, strerror(errno));
+                return false;
+            }
+            waiter.fiber = cur_vm->fiber;
+            waiter.child = slot->child;
+            *slot = waiter;
+            loop->waiter_cnt++;
+            return park(args - 1, arg_cnt);
+        }
+        struct pollfd pfd = {fd, waiter.kind == WAIT_WRITE ? POLLOUT : POLLIN, 0};
+        poll(&pfd, 1, -1);
+    }
+    args[-1] = result;
+    return true;
+}
+
+static bool check_fd(const char *name, Value_t value) {
+    if (!IS_INT_VAL(value) || GET_INT_VAL(value) < 0 || GET_INT_VAL(value) > INT32_MAX) {
+        throw_runtime_error("%s() expects a descriptor", name);
+        return false;
+    }
+    return true;
+}
+
+static bool check_str(const char *name, Value_t value) {
+    if (!IS_STR(value)) {
+        throw_runtime_error("%s() expects a string", name);
+        return false;
+    }
+    return true;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static Value_t fd_pair(int fds[2]) {
+    ObjectList_t *pair = create_list();
+    push(DECL_OBJ_VAL(pair)); // GC bug
+    write_value_array(&pair->items, DECL_INT_VAL(fds[0]));
+    write_value_array(&pair->items, DECL_INT_VAL(fds[1]));
+    pop(); // GC bug
+    return DECL_OBJ_VAL(pair);
+}
+
+bool go_native(int arg_cnt, Value_t *args) {
+    if (arg_cnt < 1 || arg_cnt > 2) {
+        throw_runtime_error("go() expects 1 or 2 arguments but got %d", arg_cnt);
+        return false;
+    }
+    if (!IS_CLOSURE(args[0])) {
+        throw_runtime_error("go() expects a function");
+        return false;
+    }
+    ObjectFiber_t *fiber = create_fiber(GET_CLOSURE(args[0]));
+    fiber->is_task = true;
+    enqueue(&cur_vm->loop, fiber, arg_cnt == 2 ? args[1] : DECL_NONE_VAL, arg_cnt - 1);
+    args[-1] = DECL_OBJ_VAL(fiber);
+    return true;
+}
+
+bool run_loop_native(int arg_cnt, Value_t *args) {
+    if (cur_vm->loop.running) {
+        throw_runtime_error("run_loop() is already running");
+        return false;
+    }
+    cur_vm->loop.running = true;
+    return run_next_task(args - 1);
+}
+
+bool sleep_native(int arg_cnt, Value_t *args) {
+    if (!IS_NUMERIC_VAL(args[0])) {
+        throw_runtime_error("sleep() expects a number of milliseconds");
+        return false;
+    }
+    double ms = GET_DOUBLE_VAL(args[0]);
+    if (in_task()) {
+        push_timer(&cur_vm->loop, now_ms() + ms, cur_vm->fiber);
+        return park(args - 1, arg_cnt);
+    }
+    if (ms > 0) {
+        struct timespec ts = {(time_t)(ms / 1000), (long)((ms - (time_t)(ms / 1000) * 1000) * 1e6)};
+        nanosleep(&ts, NULL);
+    }
+    args[-1] = DECL_NONE_VAL;
+    return true;
+}
+
+bool read_native(int arg_cnt, Value_t *args) {
+    if (!check_fd("read", args[0])) {
+        return false;
+    }
+    if (!IS_INT_VAL(args[1]) || GET_INT_VAL(args[1]) < 1 || GET_INT_VAL(args[1]) > INT32_MAX) {
+        throw_runtime_error("read() expects a positive byte count");
+        return false;
+    }
+    Waiter_t waiter = {NULL, WAIT_READ, (int)GET_INT_VAL(args[1]), NULL, 0};
+    return perform_io((int)GET_INT_VAL(args[0]), waiter, args, arg_cnt);
+}
+
+bool write_native(int arg_cnt, Value_t *args) {
+    if (!check_fd("write", args[0]) || !check_str("write", args[1])) {
+        return false;
+    }
+    Waiter_t waiter = {NULL, WAIT_WRITE, 0, GET_STR_VAL(args[1]), 0};
+    return perform_io((int)GET_INT_VAL(args[0]), waiter, args, arg_cnt);
+}
+
+bool accept_native(int arg_cnt, Value_t *args) {
+    if (!check_fd("accept", args[0])) {
+        return false;
+    }
+    Waiter_t waiter = {NULL, WAIT_ACCEPT, 0, NULL, 0};
+    return perform_io((int)GET_INT_VAL(args[0]), waiter, args, arg_cnt);
+}
+
+bool open_native(int arg_cnt, Value_t *args) {
+    if (!check_str("open", args[0]) || !check_str("open", args[1])) {
+        return false;
+    }
+    const char *mode = GET_CSTR_VAL(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        throw_runtime_error("open() expects mode \"r\", \"w\" or \"a\"");
+        return false;
+    }
+    int fd = open(GET_CSTR_VAL(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    args[-1] = fd < 0 ? DECL_NONE_VAL : DECL_INT_VAL(fd);
+    return true;
+}
+
+bool close_native(int arg_cnt, Value_t *args) {
+    if (!check_fd("close", args[0])) {
+        return false;
+    }
+    int fd = (int)GET_INT_VAL(args[0]);
+    EventLoop_t *loop = &cur_vm->loop;
+    pid_t child = 0;
+    if (fd < loop->waiter_capacity) {
+        Waiter_t *waiter = &loop->waiters[fd];
+        // a task still waiting on the descriptor would never wake up
+        if (waiter->fiber != NULL) {
+            enqueue(loop, waiter->fiber, DECL_NONE_VAL, 1);
+            waiter->fiber = NULL;
+            waiter->data = NULL;
+            loop->waiter_cnt--;
+        }
+        child = waiter->child;
+        waiter->child = 0;
+    }
+    args[-1] = DECL_BOOL_VAL(close(fd) == 0);
+    if (child > 0) {
+        waitpid(child, NULL, 0);
+    }
+    return true;
+}
+
+bool pipe_native(int arg_cnt, Value_t *args) {
+    int fds[2];
+    args[-1] = pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0 ? DECL_NONE_VAL : fd_pair(fds);
+    return true;
+}
+
+bool socketpair_native(int arg_cnt, Value_t *args) {
+    int fds[2];
+    int type = SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC;
+    args[-1] = socketpair(AF_UNIX, type, 0, fds) < 0 ? DECL_NONE_VAL : fd_pair(fds);
+    return true;
+}
+
+static bool unix_address(const char *name, Value_t path, struct sockaddr_un *addr) {
+    if (!check_str(name, path)) {
+        return false;
+    }
+    if (GET_STR_VAL(path)->length >= (int)sizeof(addr->sun_path)) {
+        throw_runtime_error("%s() path is too long", name);
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, GET_CSTR_VAL(path));
+    return true;
+}
+
+bool unix_listen_native(int arg_cnt, Value_t *args) {
+    struct sockaddr_un addr;
+    if (!unix_address("unix_listen", args[0], &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(addr.sun_path); // a socket file left by an earlier run
+    if (fd >= 0 && (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    args[-1] = fd < 0 ? DECL_NONE_VAL : DECL_INT_VAL(fd);
+    return true;
+}
+
+bool unix_connect_native(int arg_cnt, Value_t *args) {
+    struct sockaddr_un addr;
+    if (!unix_address("unix_connect", args[0], &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        set_nonblocking(fd);
+    }
+    args[-1] = fd < 0 ? DECL_NONE_VAL : DECL_INT_VAL(fd);
+    return true;
+}
+
+// runs command with sh and returns a descriptor reading its stdout, closing
+// the descriptor waits for the command to exit
+bool spawn_native(int arg_cnt, Value_t *args) {
+    if (!check_str("spawn", args[0])) {
+        return false;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        args[-1] = DECL_NONE_VAL;
+        return true;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", GET_CSTR_VAL(args[0]), (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        args[-1] = DECL_NONE_VAL;
+        return true;
+    }
+    set_nonblocking(fds[0]);
+    waiter_of(&cur_vm->loop, fds[0])->child = pid;
+    args[-1] = DECL_INT_VAL(fds[0]);
+    return true;
+}
+
+void define_io_natives() {
+    define_native("go", go_native, -1);
+    define_native("run_loop", run_loop_native, 0);
+    define_native("sleep", sleep_native, 1);
+    define_native("read", read_native, 2);
+    define_native("write", write_native, 2);
+    define_native("accept", accept_native, 1);
+    define_native("open", open_native, 2);
+    define_native("close", close_native, 1);
+    define_native("pipe", pipe_native, 0);
+    define_native("socketpair", socketpair_native, 0);
+    define_native("unix_listen", unix_listen_native, 1);
+    define_native("unix_connect", unix_connect_native, 1);
+    define_native("spawn", spawn_native, 1);
+}
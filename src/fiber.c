@@ -0,0 +1,184 @@
+#include "../includes/fiber.h"
+#include "../includes/event_loop.h"
+#include "../includes/memory.h"
+#include "../includes/register.h"
+#include "../includes/vm.h"
+
+/*
+ * Fibers run on the vm stack. Resuming one copies its saved values and frames
+ * onto the stack right above the resume call, yielding copies them back out.
+ * A suspended fiber therefore costs only what it actually has live, rather
+ * than a stack and frame array of its own, and switching never has to touch
+ * the pointers the execution loops keep into the stack.
+ */
+
+#define STACK_SLOTS (int)(sizeof(cur_vm->stack) / sizeof(Value_t))
+#define FRAME_MAX (int)(sizeof(cur_vm->frames) / sizeof(CallFrame_t))
+
+bool resume_fiber(ObjectFiber_t *fiber, int arg_cnt) {
+    if (fiber->state == FIBER_RUNNING) {
+        throw_runtime_error("Cannot resume a running fiber");
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        throw_runtime_error("Cannot resume a finished fiber");
+        return false;
+    }
+
+    Value_t *base = cur_vm->stack_top - arg_cnt;
+    int frame_base = cur_vm->frame_cnt;
+    if (fiber->state == FIBER_NEW) {
+        // the closure goes where call_closure expects its callee, shifting the
+        // arguments up over the fiber's slot
+        for (int i = arg_cnt; i > 0; i--) {
+            base[i] = base[i - 1];
+        }
+        base[0] = DECL_OBJ_VAL(fiber->closure);
+        cur_vm->stack_top++;
+        if (!call_closure(fiber->closure, arg_cnt)) {
+            return false;
+        }
+    } else {
+        if (arg_cnt > 1) {
+            throw_runtime_error("A suspended fiber expects 0 or 1 arguments but got %d", arg_cnt);
+            return false;
+        }
+        Value_t value = arg_cnt == 1 ? base[0] : DECL_NONE_VAL;
+        if (cur_vm->frame_cnt + fiber->frame_cnt > FRAME_MAX ||
+            base - cur_vm->stack + fiber->stack_cnt + 256 > STACK_SLOTS) {
+            throw_runtime_error("Stack overflow");
+            return false;
+        }
+
+        memcpy(base, fiber->stack, sizeof(Value_t) * fiber->stack_cnt);
+        for (int i = 0; i < fiber->frame_cnt; i++) {
+            CallFrame_t *frame = &cur_vm->frames[cur_vm->frame_cnt + i];
+            *frame = fiber->frames[i];
+            frame->slots = base + (frame->slots - fiber->stack);
+        }
+        for (int i = 0; i < fiber->upvalue_cnt; i++) {
+            ObjectUpvalue_t *upvalue = fiber->upvalues[i];
+            int slot = (int)(base - cur_vm->stack) + (int)(upvalue->location - fiber->stack);
+            upvalue->location = cur_vm->stack + slot;
+            upvalue->closed = DECL_NONE_VAL;
+            cur_vm->open_upvalues[slot] = upvalue;
+            if (slot >= cur_vm->open_top) {
+                cur_vm->open_top = slot + 1;
+            }
+        }
+        __atomic_signal_fence(__ATOMIC_SEQ_CST); // see call_closure
+        cur_vm->frame_cnt += fiber->frame_cnt;
+        cur_vm->stack_top = base + fiber->stack_cnt;
+        cur_vm->stack_top[-1] = value; // the result of its pending yield
+
+        // register code treats everything up to the frame's registers as
+        // live, and the slots past what was saved hold whatever was there
+        CallFrame_t *top = &cur_vm->frames[cur_vm->frame_cnt - 1];
+        if (top->reg_pc != NULL) {
+            Value_t *end = top->slots + top->closure->func->reg_chunk->reg_cnt;
+            for (Value_t *slot = cur_vm->stack_top; slot < end; slot++) {
+                *slot = DECL_NONE_VAL;
+            }
+        }
+        fiber->stack_cnt = 0;
+        fiber->frame_cnt = 0;
+        fiber->upvalue_cnt = 0;
+    }
+
+    fiber->state = FIBER_RUNNING;
+    fiber->stack_base = (int)(base - cur_vm->stack);
+    fiber->frame_base = frame_base;
+    fiber->caller = cur_vm->fiber;
+    cur_vm->fiber = fiber;
+    return true;
+}
+
+bool yield_fiber(Value_t value, Value_t *callee, int arg_cnt) {
+    ObjectFiber_t *fiber = cur_vm->fiber;
+    if (fiber == NULL) {
+        throw_runtime_error("Cannot yield outside of a fiber");
+        return false;
+    }
+
+    // the yield's own slot is saved too, resuming writes its result there
+    Value_t *base = cur_vm->stack + fiber->stack_base;
+    int stack_cnt = (int)(callee - base) + 1;
+    int frame_cnt = cur_vm->frame_cnt - fiber->frame_base;
+    int upvalue_cnt = 0;
+    for (int slot = fiber->stack_base; slot < cur_vm->open_top; slot++) {
+        if (cur_vm->open_upvalues[slot] != NULL) {
+            upvalue_cnt++;
+        }
+    }
+
+    // grow the buffers first, a collection here still finds everything on the stack
+    if (stack_cnt > fiber->stack_capacity) {
+        fiber->stack = (Value_t *)resize(fiber->stack, sizeof(Value_t),
+                                         fiber->stack_capacity, stack_cnt);
+        fiber->stack_capacity = stack_cnt;
+    }
+    if (frame_cnt > fiber->frame_capacity) {
+        fiber->frames = (CallFrame_t *)resize(fiber->frames, sizeof(CallFrame_t),
+                                              fiber->frame_capacity, frame_cnt);
+        fiber->frame_capacity = frame_cnt;
+    }
+    if (upvalue_cnt > fiber->upvalue_capacity) {
+        fiber->upvalues = (ObjectUpvalue_t **)resize(
+            fiber->upvalues, sizeof(ObjectUpvalue_t *), fiber->upvalue_capacity, upvalue_cnt);
+        fiber->upvalue_capacity = upvalue_cnt;
+    }
+
+    memcpy(fiber->stack, base, sizeof(Value_t) * stack_cnt);
+    for (int i = 0; i < frame_cnt; i++) {
+        fiber->frames[i] = cur_vm->frames[fiber->frame_base + i];
+        fiber->frames[i].slots = fiber->stack + (fiber->frames[i].slots - base);
+    }
+    fiber->upvalue_cnt = 0;
+    for (int slot = fiber->stack_base; slot < cur_vm->open_top; slot++) {
+        ObjectUpvalue_t *upvalue = cur_vm->open_upvalues[slot];
+        if (upvalue != NULL) {
+            upvalue->location = fiber->stack + (slot - fiber->stack_base);
+            upvalue->closed = DECL_OBJ_VAL(fiber);
+            fiber->upvalues[fiber->upvalue_cnt++] = upvalue;
+            cur_vm->open_upvalues[slot] = NULL;
+        }
+    }
+    if (cur_vm->open_top > fiber->stack_base) {
+        cur_vm->open_top = fiber->stack_base;
+    }
+    fiber->stack_cnt = stack_cnt;
+    fiber->frame_cnt = frame_cnt;
+
+    cur_vm->frame_cnt = fiber->frame_base;
+    cur_vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    fiber->state = FIBER_SUSPENDED;
+
+    // the resume call gets value, and call_value drops the native's
+    // arguments off whatever stack_top is on return
+    base[-1] = value;
+    cur_vm->stack_top = base + arg_cnt;
+    return true;
+}
+
+bool finish_fiber() {
+    ObjectFiber_t *fiber = cur_vm->fiber;
+    fiber->state = FIBER_DONE;
+    cur_vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    if (fiber->is_task) {
+        // a task's result is dropped, run_loop() carries on with the next one
+        return run_next_task(cur_vm->stack_top - 1);
+    }
+    return true;
+}
+
+void abandon_fibers() {
+    while (cur_vm->fiber != NULL) {
+        ObjectFiber_t *fiber = cur_vm->fiber;
+        fiber->state = FIBER_DONE;
+        cur_vm->fiber = fiber->caller;
+        fiber->caller = NULL;
+    }
+    free_event_loop(&cur_vm->loop);
+}
@@ -1,7 +1,9 @@
 #include "../includes/hash_table.h"
 #include "../includes/memory.h"
+#include "../includes/object.h"
 #include "../includes/value.h"
 
+#include <math.h>
 #include <stdint.h>
 
 void init_hash_table(HashTable_t *hash_table) {
@@ -11,112 +13,141 @@ void init_hash_table(HashTable_t *hash_table) {
 }
 
 void free_hash_table(HashTable_t *hash_table) {
-    free(hash_table->table);
+    FREE_ARRAY(Node_t, hash_table->table, hash_table->capacity);
     init_hash_table(hash_table);
 }
 
-Node_t *find_insertion_slot(Node_t *table, ObjectStr_t *key, int capacity) {
-    uint32_t idx = key->hash & (capacity - 1);
-    Node_t *tombstone = NULL;
-    for (;;) {
-        Node_t *potential_slot = &table[idx];
-        if (potential_slot->key == key) {
-            return potential_slot;
-        } else if (potential_slot->key == NULL) {
-            // if already found tombstone earlier we want to return that instead
-            if (IS_NONE_VAL(potential_slot->value)) {
-                return tombstone ? tombstone : potential_slot;
-            } else if (tombstone == NULL) {
-                tombstone = potential_slot;
-            }
-        }
-        idx = (idx + 1) & (capacity - 1);
+/*
+ * The open-addressing engine both tables are generated from: linear probing
+ * over a power of two capacity, deleted entries left as tombstones (an unused
+ * slot holding true) and growth past TABLE_MAX_LOAD, which drops them. A
+ * table named NAME supplies NAME_hash(key), NAME_matches(slot, key) (false
+ * for unused slots), NAME_is_used(slot), NAME_set_key(slot, key) and
+ * NAME_clear(slot), and the macro defines NAME_find_slot, NAME_resize,
+ * NAME_claim, NAME_lookup and NAME_remove over them. num_elems counts used
+ * slots and tombstones.
+ */
+#define DEFINE_OPEN_TABLE(NAME, Table_t, Slot_t, Key_t)                                 \
+    /* the slot holding key, else the first tombstone or empty slot it could go */     \
+    static Slot_t *NAME##_find_slot(Slot_t *slots, Key_t key, int capacity) {           \
+        uint32_t idx = NAME##_hash(key) & (capacity - 1);                               \
+        Slot_t *tombstone = NULL;                                                       \
+        for (;;) {                                                                      \
+            Slot_t *slot = &slots[idx];                                                 \
+            if (NAME##_matches(slot, key)) {                                            \
+                return slot;                                                            \
+            } else if (!NAME##_is_used(slot)) {                                         \
+                if (IS_NONE_VAL(slot->value)) {                                         \
+                    return tombstone ? tombstone : slot;                                \
+                } else if (tombstone == NULL) {                                         \
+                    tombstone = slot;                                                   \
+                }                                                                       \
+            }                                                                           \
+            idx = (idx + 1) & (capacity - 1);                                           \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    static void NAME##_resize(Table_t *table, int new_capacity) {                       \
+        /* counted like every other array, so it may collect before anything moves */ \
+        Slot_t *slots = resize(NULL, sizeof(Slot_t), 0, new_capacity);                  \
+        for (int i = 0; i < new_capacity; i++) {                                        \
+            NAME##_clear(&slots[i]);                                                    \
+            slots[i].value = DECL_NONE_VAL;                                             \
+        }                                                                               \
+        table->num_elems = 0;                                                           \
+        for (int i = 0; i < table->capacity; i++) {                                     \
+            Slot_t *slot = &table->table[i];                                            \
+            if (NAME##_is_used(slot)) {                                                 \
+                *NAME##_find_slot(slots, slot->key, new_capacity) = *slot;              \
+                table->num_elems++;                                                     \
+            }                                                                           \
+        }                                                                               \
+        FREE_ARRAY(Slot_t, table->table, table->capacity);                              \
+        table->table = slots;                                                           \
+        table->capacity = new_capacity;                                                 \
+    }                                                                                   \
+                                                                                        \
+    /* the slot key is stored in, growing the table first if it is full */             \
+    static Slot_t *NAME##_claim(Table_t *table, Key_t key, bool *is_new) {              \
+        if (table->num_elems + 1 > table->capacity * TABLE_MAX_LOAD) {                  \
+            NAME##_resize(table, grow_capacity(table->capacity));                       \
+        }                                                                               \
+        Slot_t *slot = NAME##_find_slot(table->table, key, table->capacity);            \
+        *is_new = !NAME##_is_used(slot);                                                \
+        if (*is_new && IS_NONE_VAL(slot->value)) {                                      \
+            table->num_elems++; /* reusing a tombstone doesn't add load */              \
+        }                                                                               \
+        NAME##_set_key(slot, key);                                                      \
+        return slot;                                                                    \
+    }                                                                                   \
+                                                                                        \
+    static Slot_t *NAME##_lookup(Table_t *table, Key_t key) {                           \
+        if (table->capacity == 0) {                                                     \
+            return NULL;                                                                \
+        }                                                                               \
+        Slot_t *slot = NAME##_find_slot(table->table, key, table->capacity);            \
+        return NAME##_is_used(slot) ? slot : NULL;                                      \
+    }                                                                                   \
+                                                                                        \
+    /* leaves a tombstone so probes for keys past it keep going */                      \
+    static bool NAME##_remove(Table_t *table, Key_t key) {                              \
+        Slot_t *slot = NAME##_lookup(table, key);                                       \
+        if (slot == NULL) {                                                             \
+            return false;                                                               \
+        }                                                                               \
+        NAME##_clear(slot);                                                             \
+        slot->value = DECL_BOOL_VAL(true);                                              \
+        return true;                                                                    \
     }
-    return NULL;
-}
 
-void resize_table(HashTable_t *hash_table, int new_capacity) {
-    // Node_t *new_table = (Node_t *)malloc(sizeof(Node_t) * new_capacity);
-    Node_t *new_table = ALLOCATE(Node_t, new_capacity);
-    if (new_table == NULL) {
-        fprintf(stderr, "Error: not enough memory avaialable");
-        return;
-    }
+// strings are interned, so the same text is always the same key pointer
+static inline uint32_t str_hash(ObjectStr_t *key) {
+    return key->hash;
+}
 
-    for (int i = 0; i < new_capacity; i++) {
-        new_table[i].key = NULL;
-        new_table[i].value = DECL_NONE_VAL;
-    }
+static inline bool str_matches(Node_t *slot, ObjectStr_t *key) {
+    return slot->key == key; // never NULL, so unused slots never match
+}
 
-    hash_table->num_elems = 0;
+static inline bool str_is_used(Node_t *slot) {
+    return slot->key != NULL;
+}
 
-    for (int i = 0; i < hash_table->capacity; i++) {
-        Node_t *cur_slot = &hash_table->table[i];
-        if (cur_slot->key == NULL) {
-            continue;
-        }
-        Node_t *new_slot =
-            find_insertion_slot(new_table, cur_slot->key, new_capacity);
-        new_slot->key = cur_slot->key;
-        new_slot->value = cur_slot->value;
-        hash_table->num_elems++;
-    }
+static inline void str_set_key(Node_t *slot, ObjectStr_t *key) {
+    slot->key = key;
+}
 
-    free(hash_table->table);
-    hash_table->table = new_table;
-    hash_table->capacity = new_capacity;
+static inline void str_clear(Node_t *slot) {
+    slot->key = NULL;
 }
 
-bool insert(HashTable_t *hash_table, ObjectStr_t *key, Value_t value) {
-    if (hash_table->num_elems + 1 > (hash_table->capacity) * TABLE_MAX_LOAD) {
-        int new_capacity = grow_capacity(hash_table->capacity);
-        resize_table(hash_table, new_capacity);
-    }
+DEFINE_OPEN_TABLE(str, HashTable_t, Node_t, ObjectStr_t *)
 
-    Node_t *new_slot =
-        find_insertion_slot(hash_table->table, key, hash_table->capacity);
-    if (new_slot == NULL) {
-        fprintf(stderr, "Error: hash table insertion failed");
-        return false;
+// sizes an empty table so count keys fit without growing it
+void reserve_table(HashTable_t *hash_table, int count) {
+    if (count == 0) {
+        return;
     }
-    // if key already exist don't increase the element count
-    bool res = new_slot->key == NULL;
-    if (res && IS_NONE_VAL(new_slot->value)) {
-        hash_table->num_elems++;
+    int capacity = grow_capacity(0);
+    while (count > capacity * TABLE_MAX_LOAD) {
+        capacity = grow_capacity(capacity);
     }
+    str_resize(hash_table, capacity);
+}
 
-    new_slot->key = key;
-    new_slot->value = value;
-    return res;
+bool insert(HashTable_t *hash_table, ObjectStr_t *key, Value_t value) {
+    bool is_new;
+    str_claim(hash_table, key, &is_new)->value = value;
+    return is_new;
 }
 
 Value_t *get(HashTable_t *hash_table, ObjectStr_t *key) {
-    if (hash_table->table == NULL) {
-        return NULL;
-    }
-
-    Node_t *node =
-        find_insertion_slot(hash_table->table, key, hash_table->capacity);
-    if (node->key == NULL) {
-        return NULL;
-    }
-    return &node->value;
+    Node_t *node = str_lookup(hash_table, key);
+    return node == NULL ? NULL : &node->value;
 }
 
 bool drop(HashTable_t *hash_table, ObjectStr_t *key) {
-    if (hash_table->table == NULL) {
-        return false;
-    }
-
-    Node_t *node =
-        find_insertion_slot(hash_table->table, key, hash_table->capacity);
-    if (node->key == NULL) {
-        return false;
-    }
-
-    node->key = NULL;
-    node->value = DECL_BOOL_VAL(true);
-    return true;
+    return str_remove(hash_table, key);
 }
 
 ObjectStr_t *find_str(HashTable_t *hash_table, const char *chars, int length,
@@ -132,7 +163,8 @@ ObjectStr_t *find_str(HashTable_t *hash_table, const char *chars, int length,
                 return NULL;
             }
         } else if (node->key->length == length && node->key->hash == hash &&
-                   memcmp(node->key->chars, chars, length) == 0) {
+                   (node->key->chars == chars ||
+                    memcmp(node->key->chars, chars, length) == 0)) {
             return node->key;
         }
         idx = (idx + 1) & (hash_table->capacity - 1);
@@ -165,3 +197,132 @@ void remove_table_whites(HashTable_t *table) {
         }
     }
 }
+
+// ------------------------- Value-Keyed Tables ------------------------- //
+
+static uint32_t mix_bits(uint64_t bits) {
+    // murmur3 finalizer so neighbouring numbers / pointers spread across slots
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb93fe53cd34dULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// -0 hashes like 0 and every NaN like one canonical NaN
+static double normalize_num(double num) {
+    if (num == 0) {
+        return 0;
+    }
+    if (num != num) {
+        return NAN;
+    }
+    return num;
+}
+
+uint32_t hash_value(Value_t key) {
+    switch (key.type) {
+        case VAL_BOOL:
+            return GET_BOOL_VAL(key) ? 3 : 5;
+        case VAL_NONE:
+            return 7;
+        case VAL_NUM:
+        case VAL_INT: {
+            // ints hash as the double they equal so 1 and 1.0 find the same entry
+            double num = normalize_num(GET_DOUBLE_VAL(key));
+            uint64_t bits;
+            memcpy(&bits, &num, sizeof(bits));
+            return mix_bits(bits);
+        }
+        case VAL_OBJ:
+            if (IS_STR(key)) {
+                return GET_STR_VAL(key)->hash;
+            }
+            if (IS_BOUND_METHOD(key)) {
+                // like equals(), by receiver and method rather than identity
+                ObjectBoundMethod_t *bound = GET_BOUND_METHOD(key);
+                return hash_value(bound->receiver) ^
+                       mix_bits((uint64_t)(uintptr_t)bound->method);
+            }
+            // everything else hashes by identity
+            return mix_bits((uint64_t)(uintptr_t)GET_OBJ_VAL(key));
+    }
+    return 0;
+}
+
+static bool keys_equal(Value_t a, Value_t b) {
+    if (IS_NUM_VAL(a) && IS_NUM_VAL(b) && GET_NUM_VAL(a) != GET_NUM_VAL(a)) {
+        return GET_NUM_VAL(b) != GET_NUM_VAL(b); // NaN keys match each other
+    }
+    return equals(a, b);
+}
+
+void init_value_table(ValueTable_t *table) {
+    table->num_elems = 0;
+    table->count = 0;
+    table->capacity = 0;
+    table->table = NULL;
+}
+
+void free_value_table(ValueTable_t *table) {
+    FREE_ARRAY(ValueNode_t, table->table, table->capacity);
+    init_value_table(table);
+}
+
+static inline uint32_t value_hash(Value_t key) {
+    return hash_value(key);
+}
+
+static inline bool value_matches(ValueNode_t *slot, Value_t key) {
+    return slot->is_used && keys_equal(slot->key, key);
+}
+
+static inline bool value_is_used(ValueNode_t *slot) {
+    return slot->is_used;
+}
+
+static inline void value_set_key(ValueNode_t *slot, Value_t key) {
+    slot->key = key;
+    slot->is_used = true;
+}
+
+static inline void value_clear(ValueNode_t *slot) {
+    slot->key = DECL_NONE_VAL;
+    slot->is_used = false;
+}
+
+DEFINE_OPEN_TABLE(value, ValueTable_t, ValueNode_t, Value_t)
+
+bool value_table_insert(ValueTable_t *table, Value_t key, Value_t value) {
+    bool is_new;
+    value_claim(table, key, &is_new)->value = value;
+    table->count += is_new;
+    return is_new;
+}
+
+Value_t *value_table_get(ValueTable_t *table, Value_t key) {
+    if (table->count == 0) {
+        return NULL;
+    }
+    ValueNode_t *node = value_lookup(table, key);
+    return node == NULL ? NULL : &node->value;
+}
+
+bool value_table_drop(ValueTable_t *table, Value_t key) {
+    if (table->count == 0 || !value_remove(table, key)) {
+        return false;
+    }
+    table->count--;
+    return true;
+}
+
+void mark_value_table(ValueTable_t *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        ValueNode_t *node = &table->table[i];
+        if (node->is_used) {
+            mark_value(node->key);
+            mark_value(node->value);
+        }
+    }
+}
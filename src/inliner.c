@@ -0,0 +1,521 @@
+#include "../includes/memory.h"
+#include "../includes/optimizer.h"
+#include "../includes/vm.h"
+
+/*
+ * Inlining pass run once a whole program has compiled (never for REPL lines,
+ * which later lines could rebind). A global that a func declaration defines
+ * once and nothing ever assigns holds the same func for the whole run, so a
+ * call to it can be replaced by the func's body when that body is a small
+ * leaf: no upvalues, no calls and a single return that ends its code.
+ *
+ * The GET_GLOBAL and the arguments of the call stay as they are, which leaves
+ * the callee and its parameters in the slots its frame would have given them
+ * (and still reports an undefined global). The body is copied in with its
+ * locals shifted onto those slots and its constants added to the caller's
+ * pool, and the return becomes SET_LOCAL of the callee slot followed by POPs
+ * so the result ends up where the call would have left it. Copied code keeps
+ * the callee's lines for error reports.
+ */
+
+#define MAX_INLINE_BODY 32     // bytes of callee code before its return
+#define MAX_INLINE_GROWTH 1024 // bytes a caller may grow by
+
+typedef struct {
+    ObjectStr_t *name;
+    ObjectFunc_t *func; // declared by OP_CLOSURE, OP_DEFINE_GLOBAL in the script
+    int defines;        // DEFINE_GLOBALs of the name in the whole program
+    bool assigned;      // the name is the target of some SET_GLOBAL
+    bool inlinable;
+    int body_len;     // offset of the return
+    int return_depth; // stack depth at the return, result included
+    int max_depth;    // deepest the body takes the stack
+} Global_t;
+
+typedef struct {
+    ObjectFunc_t **funcs; // every func of the program, the script first
+    int func_cnt;
+    int func_capacity;
+    HashTable_t names; // global name -> index into globals
+    Global_t *globals;
+    int global_cnt;
+    int global_capacity;
+} Inliner_t;
+
+static void add_func(Inliner_t *inliner, ObjectFunc_t *func) {
+    if (inliner->func_cnt == inliner->func_capacity) {
+        inliner->func_capacity = grow_capacity(inliner->func_capacity);
+        inliner->funcs =
+            realloc(inliner->funcs, sizeof(ObjectFunc_t *) * inliner->func_capacity);
+    }
+    inliner->funcs[inliner->func_cnt++] = func;
+}
+
+static Global_t *find_global(Inliner_t *inliner, ObjectStr_t *name) {
+    Value_t *idx = get(&inliner->names, name);
+    if (idx != NULL) {
+        return &inliner->globals[GET_INT_VAL(*idx)];
+    }
+    if (inliner->global_cnt == inliner->global_capacity) {
+        inliner->global_capacity = grow_capacity(inliner->global_capacity);
+        inliner->globals = realloc(inliner->globals, sizeof(Global_t) * inliner->global_capacity);
+    }
+    insert(&inliner->names, name, DECL_INT_VAL(inliner->global_cnt));
+    Global_t *global = &inliner->globals[inliner->global_cnt++];
+    *global = (Global_t){.name = name, .func = NULL, .defines = 0, .assigned = false,
+                         .inlinable = false};
+    return global;
+}
+
+static int long_operand(uint8_t *code) {
+    return code[0] | (code[1] << 8) | (code[2] << 16);
+}
+
+static ObjectStr_t *global_name(Chunk_t *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+            return GET_STR_VAL(chunk->constants.values[code[1]]);
+        default:
+            return GET_STR_VAL(chunk->constants.values[long_operand(code + 1)]);
+    }
+}
+
+// ops a body may contain, anything that calls, captures or defines stays out
+static bool inlinable_op(uint8_t op) {
+    switch ((OpCode_t)op) {
+        case OP_CONSTANT:
+        case OP_NONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_EQUAL:
+        case OP_GREATER_THAN:
+        case OP_LESS_THAN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_BRANCH_IF_FALSE:
+        case OP_BRANCH:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_BUILD_LIST:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_ADD_LOCALS:
+        case OP_LESS_LOCAL_CONST_JUMP:
+        case OP_INC_LOCAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_ADD_NN:
+        case OP_SUB_NN:
+        case OP_MUL_NN:
+        case OP_DIV_NN:
+        case OP_LESS_NN:
+        case OP_GREATER_NN:
+        case OP_LESS_EQUAL_NN:
+        case OP_GREATER_EQUAL_NN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// fills in the body fields, returns false if func cannot be inlined
+static bool measure_body(Global_t *global) {
+    ObjectFunc_t *func = global->func;
+    Chunk_t *chunk = &func->chunk;
+    if (func->upvalue_cnt != 0) {
+        return false;
+    }
+    int *depth_at = ALLOCATE(int, chunk->count + 1);
+    bool ok = stack_depths(chunk, func->num_params, depth_at);
+
+    int offset = 0;
+    global->max_depth = 0;
+    while (ok && offset < chunk->count && chunk->code[offset] != OP_RETURN) {
+        uint8_t op = chunk->code[offset];
+        // forward branches only, landing at most on the return
+        ok = offset < MAX_INLINE_BODY && inlinable_op(op) &&
+             (!is_branch(op) || branch_target(chunk, offset) > offset);
+        if (depth_at[offset] > global->max_depth) {
+            global->max_depth = depth_at[offset];
+        }
+        offset += instruction_length(chunk, offset);
+    }
+    ok = ok && offset < chunk->count && depth_at[offset] >= 2;
+    if (ok) {
+        global->body_len = offset;
+        global->return_depth = depth_at[offset];
+        if (global->return_depth > global->max_depth) {
+            global->max_depth = global->return_depth;
+        }
+        // a branch past the return would leave the inlined code
+        for (int at = 0; at < offset; at += instruction_length(chunk, at)) {
+            if (is_branch(chunk->code[at]) && branch_target(chunk, at) > offset) {
+                ok = false;
+            }
+        }
+    }
+    free(depth_at);
+    return ok;
+}
+
+// identical constants, unlike equals() 1 and 1.0 or 0.0 and -0.0 differ
+static bool same_constant(Value_t a, Value_t b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    switch (a.type) {
+        case VAL_NUM:
+            return memcmp(&a.data.num, &b.data.num, sizeof(double)) == 0;
+        case VAL_INT:
+            return GET_INT_VAL(a) == GET_INT_VAL(b);
+        case VAL_OBJ:
+            return GET_OBJ_VAL(a) == GET_OBJ_VAL(b);
+        default:
+            return equals(a, b);
+    }
+}
+
+// index of value in the caller's pool, added if missing, -1 if it needs a long operand
+static int map_constant(Chunk_t *caller, Value_t value) {
+    ValueArray_t *constants = &caller->constants;
+    for (int i = 0; i < constants->count && i <= 255; i++) {
+        if (same_constant(constants->values[i], value)) {
+            return i;
+        }
+    }
+    if (constants->count > 255) {
+        return -1;
+    }
+    return add_constant(caller, value);
+}
+
+// the callee's constant operands rewritten for the caller, false if one does not fit
+static bool map_constants(Chunk_t *caller, Global_t *global, int *const_map) {
+    Chunk_t *chunk = &global->func->chunk;
+    for (int offset = 0; offset < global->body_len; offset += instruction_length(chunk, offset)) {
+        uint8_t *code = chunk->code + offset;
+        int operand = -1;
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                operand = code[1];
+                break;
+            case OP_INC_LOCAL:
+            case OP_LESS_LOCAL_CONST_JUMP:
+                operand = code[2];
+                break;
+        }
+        if (operand != -1 && const_map[operand] == -1) {
+            const_map[operand] = map_constant(caller, chunk->constants.values[operand]);
+            if (const_map[operand] == -1) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// copies the body with its slots moved up by base, then the return sequence
+static int emit_body(Global_t *global, int base, int *const_map, uint8_t *out, int *out_lines) {
+    Chunk_t *chunk = &global->func->chunk;
+    int len = 0;
+    for (int offset = 0; offset < global->body_len;) {
+        int size = instruction_length(chunk, offset);
+        uint8_t *code = out + len;
+        memcpy(code, chunk->code + offset, size);
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                code[1] = const_map[code[1]];
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                code[1] += base;
+                break;
+            case OP_ADD_LOCALS:
+                code[1] += base;
+                code[2] += base;
+                break;
+            case OP_INC_LOCAL:
+            case OP_LESS_LOCAL_CONST_JUMP:
+                code[1] += base;
+                code[2] = const_map[code[2]];
+                break;
+        }
+        for (int i = 0; i < size; i++) {
+            out_lines[len + i] = get_line(chunk->line_runs, offset);
+        }
+        len += size;
+        offset += size;
+    }
+
+    int line = get_line(chunk->line_runs, global->body_len);
+    out[len] = OP_SET_LOCAL;
+    out[len + 1] = base;
+    out_lines[len] = out_lines[len + 1] = line;
+    len += 2;
+    for (int i = 1; i < global->return_depth; i++) {
+        out_lines[len] = line;
+        out[len++] = OP_POP;
+    }
+    return len;
+}
+
+static int inlined_size(Global_t *global) {
+    return global->body_len + 2 + global->return_depth - 1;
+}
+
+// the global an OP_CALL at offset can be inlined from, or NULL
+static Global_t *call_site(Inliner_t *inliner, Chunk_t *chunk, int *starts, int idx,
+                           int *depth_at, int *base) {
+    int call = starts[idx];
+    int arg_cnt = chunk->code[call + 1];
+    if (depth_at[call] == -1) {
+        return NULL;
+    }
+    int callee_slot = depth_at[call] - arg_cnt - 1;
+
+    // walk back over the arguments to the instruction that pushed the callee, none
+    // of them may dip to the callee slot or they could have replaced its value
+    int load = -1;
+    for (int i = idx - 1; i >= 0; i--) {
+        int depth = depth_at[starts[i]];
+        if (depth == callee_slot) {
+            load = starts[i];
+            break;
+        }
+        if (depth < callee_slot + 1 || depth_at[starts[i + 1]] < callee_slot + 2) {
+            return NULL;
+        }
+    }
+    if (load == -1 || chunk->code[load] != OP_GET_GLOBAL) {
+        return NULL;
+    }
+    Value_t *global_idx = get(&inliner->names, global_name(chunk, load));
+    if (global_idx == NULL) {
+        return NULL;
+    }
+    Global_t *global = &inliner->globals[GET_INT_VAL(*global_idx)];
+    if (!global->inlinable || global->func->num_params != arg_cnt ||
+        callee_slot + global->max_depth > 255) {
+        return NULL;
+    }
+
+    // the arguments must be entered only through the GET_GLOBAL and left only by the call
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        if (!is_branch(chunk->code[offset])) {
+            continue;
+        }
+        bool inside = offset > load && offset < call;
+        int target = branch_target(chunk, offset);
+        if (inside != (target > load && target <= call)) {
+            return NULL;
+        }
+    }
+    *base = callee_slot;
+    return global;
+}
+
+// inlines every call it can into func, returns true if its code changed
+static bool inline_into(Inliner_t *inliner, ObjectFunc_t *func) {
+    Chunk_t *chunk = &func->chunk;
+    int n = chunk->count;
+    if (n == 0) {
+        return false;
+    }
+    int *depth_at = ALLOCATE(int, n + 1);
+    int *starts = ALLOCATE(int, n);
+    int start_cnt = 0;
+    for (int offset = 0; offset < n; offset += instruction_length(chunk, offset)) {
+        starts[start_cnt++] = offset;
+    }
+    if (!stack_depths(chunk, func->num_params, depth_at)) {
+        free(depth_at);
+        free(starts);
+        return false;
+    }
+
+    // pick the sites first so the new code can be sized
+    Global_t **site_global = calloc(start_cnt, sizeof(Global_t *));
+    int *site_base = ALLOCATE(int, start_cnt);
+    int growth = 0;
+    for (int i = 0; i < start_cnt; i++) {
+        if (chunk->code[starts[i]] != OP_CALL) {
+            continue;
+        }
+        Global_t *global = call_site(inliner, chunk, starts, i, depth_at, &site_base[i]);
+        if (global != NULL && growth + inlined_size(global) - 2 <= MAX_INLINE_GROWTH) {
+            site_global[i] = global;
+            growth += inlined_size(global) - 2;
+        }
+    }
+
+    int *lines = ALLOCATE(int, n);
+    for (int offset = 0; offset < n; offset++) {
+        lines[offset] = get_line(chunk->line_runs, offset);
+    }
+    int capacity = n + growth;
+    uint8_t *out = ALLOCATE(uint8_t, capacity);
+    int *out_lines = ALLOCATE(int, capacity);
+    int *new_offset = ALLOCATE(int, n + 1);
+    int *const_map = ALLOCATE(int, 256);
+    InlineSite_t *sites = ALLOCATE(InlineSite_t, start_cnt);
+    int site_cnt = 0;
+    int out_len = 0;
+    bool changed = false;
+
+    for (int i = 0; i < start_cnt; i++) {
+        int offset = starts[i];
+        new_offset[offset] = out_len;
+        Global_t *global = site_global[i];
+        if (global != NULL) {
+            for (int k = 0; k < 256; k++) {
+                const_map[k] = -1;
+            }
+            if (map_constants(chunk, global, const_map)) {
+                InlineSite_t *site = &sites[site_cnt++];
+                site->start = out_len;
+                out_len += emit_body(global, site_base[i], const_map, out + out_len,
+                                     out_lines + out_len);
+                site->end = out_len;
+                site->call_line = lines[offset];
+                site->name = global->name;
+                changed = true;
+                continue;
+            }
+        }
+        int len = instruction_length(chunk, offset);
+        memcpy(out + out_len, chunk->code + offset, len);
+        for (int k = 0; k < len; k++) {
+            out_lines[out_len + k] = lines[offset];
+        }
+        out_len += len;
+    }
+    new_offset[n] = out_len;
+
+    // the caller's own branches now span the inlined code
+    bool fits = true;
+    for (int i = 0; i < start_cnt && changed; i++) {
+        int offset = starts[i];
+        if (!is_branch(chunk->code[offset])) {
+            continue;
+        }
+        int at = new_offset[offset];
+        int end = at + instruction_length(chunk, offset);
+        int target = new_offset[branch_target(chunk, offset)];
+        int jump = out[at] == OP_LOOP ? end - target : target - end;
+        if (jump > UINT16_MAX) {
+            fits = false;
+            break;
+        }
+        out[end - 2] = (jump >> 8) & 0xff;
+        out[end - 1] = jump & 0xff;
+    }
+
+    if (changed && fits) {
+        chunk->count = 0;
+        chunk->line_runs.count = 0;
+        for (int i = 0; i < out_len; i++) {
+            write_chunk(chunk, out[i], out_lines[i]);
+        }
+        free(chunk->inline_sites);
+        chunk->inline_sites = sites;
+        chunk->inline_site_cnt = site_cnt;
+    } else {
+        free(sites);
+    }
+
+    free(depth_at);
+    free(starts);
+    free(site_global);
+    free(site_base);
+    free(lines);
+    free(out);
+    free(out_lines);
+    free(new_offset);
+    free(const_map);
+    return changed && fits;
+}
+
+void inline_calls(ObjectFunc_t *script) {
+    Inliner_t inliner = {0};
+    init_hash_table(&inliner.names);
+
+    add_func(&inliner, script);
+    for (int i = 0; i < inliner.func_cnt; i++) {
+        Chunk_t *chunk = &inliner.funcs[i]->chunk;
+        for (int k = 0; k < chunk->constants.count; k++) {
+            if (IS_FUNC(chunk->constants.values[k])) {
+                add_func(&inliner, GET_FUNC(chunk->constants.values[k]));
+            }
+        }
+        int prev = -1;
+        for (int offset = 0; offset < chunk->count;
+             prev = offset, offset += instruction_length(chunk, offset)) {
+            switch (chunk->code[offset]) {
+                case OP_DEFINE_GLOBAL:
+                case OP_DEFINE_GLOBAL_LONG: {
+                    Global_t *global = find_global(&inliner, global_name(chunk, offset));
+                    global->defines++;
+                    if (i == 0 && prev != -1 && chunk->code[prev] == OP_CLOSURE) {
+                        global->func = GET_FUNC(chunk->constants.values[chunk->code[prev + 1]]);
+                    }
+                    break;
+                }
+                case OP_SET_GLOBAL:
+                case OP_SET_GLOBAL_LONG:
+                    find_global(&inliner, global_name(chunk, offset))->assigned = true;
+                    break;
+            }
+        }
+    }
+
+    for (int i = 0; i < inliner.global_cnt; i++) {
+        Global_t *global = &inliner.globals[i];
+        global->inlinable = global->func != NULL && global->defines == 1 && !global->assigned &&
+                            measure_body(global);
+    }
+    // natives already own their names, a call before the declaration must still reach them
+    for (int i = 0; i < inliner.names.capacity; i++) {
+        Node_t *node = &inliner.names.table[i];
+        if (node->key != NULL && get(&cur_vm->globals, node->key) != NULL) {
+            inliner.globals[GET_INT_VAL(node->value)].inlinable = false;
+        }
+    }
+
+    for (int i = 0; i < inliner.func_cnt; i++) {
+        ObjectFunc_t *func = inliner.funcs[i];
+        if (inline_into(&inliner, func)) {
+#ifndef DISABLE_TYPE_INFERENCE
+            infer_types(&func->chunk, func->num_params);
+#endif
+        }
+    }
+
+    free_hash_table(&inliner.names);
+    free(inliner.funcs);
+    free(inliner.globals);
+}
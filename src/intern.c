@@ -0,0 +1,186 @@
+#include "../includes/intern.h"
+#include "../includes/memory.h"
+#include "../includes/vm.h"
+
+#include <pthread.h>
+
+/*
+ * With share_strings on, every string payload goes through one table shared
+ * by all vms in the process, so isolates and batch workers running the same
+ * code keep a single copy of each identifier and constant and equal strings
+ * in different vms point at the same bytes. Each vm still has its own
+ * ObjectStr_t over the payload since its gc marks and frees those.
+ *
+ * Slots never move, which is what lets lookups go without a lock: a reader
+ * probes at most MAX_PROBES slots and an insert claims an empty or dead slot
+ * with a CAS. Payloads are reference counted and the one that drops the last
+ * reference swaps its slot to a tombstone. Another vm may still be comparing
+ * its bytes at that point, so it is only freed two epochs later, once every
+ * vm has been seen outside the table (epoch-based reclamation). Vms move the
+ * epoch along after each gc.
+ */
+
+#define INTERN_CAPACITY (1 << 16)
+#define MAX_PROBES 64
+
+static SharedStr_t *slots[INTERN_CAPACITY];
+static SharedStr_t tombstone;
+#define TOMBSTONE (&tombstone)
+
+bool share_strings = false;
+
+typedef struct {
+    SharedStr_t *shared;
+    unsigned long epoch; // when it was unlinked
+} Retired_t;
+
+static unsigned long global_epoch = 1;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER; // guards the rest
+static InternReader_t *readers = NULL;
+static Retired_t *retired = NULL;
+static int retired_cnt = 0;
+static int retired_capacity = 0;
+
+void register_intern_reader(InternReader_t *reader) {
+    reader->epoch = 0;
+    pthread_mutex_lock(&reclaim_lock);
+    reader->next = readers;
+    readers = reader;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+void unregister_intern_reader(InternReader_t *reader) {
+    pthread_mutex_lock(&reclaim_lock);
+    InternReader_t **link = &readers;
+    while (*link != reader) {
+        link = &(*link)->next;
+    }
+    *link = reader->next;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+static void enter_table(InternReader_t *reader) {
+    // sequentially consistent so a reclaimer either sees the epoch or the
+    // reader sees the tombstone
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+static void leave_table(InternReader_t *reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static bool try_retain(SharedStr_t *shared) {
+    int refs = __atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&shared->refs, &refs, refs + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false; // already on its way out
+}
+
+static SharedStr_t *probe(const char *chars, int length, uint32_t hash, int *free_slot) {
+    *free_slot = -1;
+    uint32_t idx = hash & (INTERN_CAPACITY - 1);
+    for (int i = 0; i < MAX_PROBES; i++) {
+        SharedStr_t *entry = __atomic_load_n(&slots[idx], __ATOMIC_ACQUIRE);
+        if (entry == NULL) {
+            if (*free_slot < 0) {
+                *free_slot = (int)idx;
+            }
+            return NULL;
+        }
+        if (entry == TOMBSTONE) {
+            if (*free_slot < 0) {
+                *free_slot = (int)idx;
+            }
+        } else if (entry->hash == hash && entry->length == length &&
+                   memcmp(entry->chars, chars, length) == 0 && try_retain(entry)) {
+            return entry;
+        }
+        idx = (idx + 1) & (INTERN_CAPACITY - 1);
+    }
+    return NULL;
+}
+
+SharedStr_t *intern_shared_str(const char *chars, int length, uint32_t hash) {
+    InternReader_t *reader = &cur_vm->intern_reader;
+    SharedStr_t *created = NULL;
+    SharedStr_t *found = NULL;
+    enter_table(reader);
+    for (;;) {
+        int free_slot;
+        found = probe(chars, length, hash, &free_slot);
+        if (found != NULL || free_slot < 0) {
+            break;
+        }
+        if (created == NULL) {
+            created = create_shared_str(chars, length, hash);
+        }
+        created->slot = free_slot;
+        SharedStr_t *expected = __atomic_load_n(&slots[free_slot], __ATOMIC_ACQUIRE);
+        // a slot reused while another vm probes past it may leave two equal
+        // payloads, which only costs the duplicate's bytes
+        if ((expected == NULL || expected == TOMBSTONE) &&
+            __atomic_compare_exchange_n(&slots[free_slot], &expected, created, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            leave_table(reader);
+            return created;
+        }
+        // another vm claimed the slot first, it may have inserted this string
+    }
+    leave_table(reader);
+    free(created); // never published
+    return found;
+}
+
+void retire_shared_str(SharedStr_t *shared) {
+    SharedStr_t *expected = shared;
+    __atomic_compare_exchange_n(&slots[shared->slot], &expected, TOMBSTONE, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&reclaim_lock);
+    if (retired_cnt == retired_capacity) {
+        retired_capacity = grow_capacity(retired_capacity);
+        retired = (Retired_t *)realloc(retired, sizeof(Retired_t) * retired_capacity);
+        if (retired == NULL) {
+            exit(1);
+        }
+    }
+    retired[retired_cnt++] =
+        (Retired_t){shared, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST)};
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+void reclaim_shared_strs() {
+    pthread_mutex_lock(&reclaim_lock);
+    if (retired_cnt == 0) {
+        pthread_mutex_unlock(&reclaim_lock);
+        return;
+    }
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    bool can_advance = true;
+    for (InternReader_t *reader = readers; reader != NULL; reader = reader->next) {
+        unsigned long seen = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch) {
+            can_advance = false;
+            break;
+        }
+    }
+    if (can_advance) {
+        epoch++;
+        __atomic_store_n(&global_epoch, epoch, __ATOMIC_SEQ_CST);
+    }
+
+    int kept = 0;
+    for (int i = 0; i < retired_cnt; i++) {
+        if (retired[i].epoch + 2 <= epoch) {
+            free(retired[i].shared);
+        } else {
+            retired[kept++] = retired[i];
+        }
+    }
+    retired_cnt = kept;
+    pthread_mutex_unlock(&reclaim_lock);
+}
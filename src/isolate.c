@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+
+#include "../includes/isolate.h"
+#include "../includes/batch.h"
+#include "../includes/event_loop.h"
+#include "../includes/memory.h"
+#include "../includes/native.h"
+#include "../includes/vm.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * An isolate is a script running in its own vm on its own thread. Isolates
+ * share no objects, they talk by sending messages: send() packs the value
+ * into a tree outside of any vm and receive() rebuilds it in the receiving
+ * vm's heap. Strings of SHARED_STR_MIN bytes or more already keep their bytes
+ * outside of the vm, so packing one only takes a reference and a large text
+ * blob crosses in O(1) no matter its size.
+ *
+ * Every isolate has an inbox that any thread may push to and only its own vm
+ * pops from, plus an eventfd counting sends so a receiver can sleep in poll
+ * or, inside a task, in the event loop alongside its other descriptors.
+ */
+
+// also what stops a list that contains itself
+#define MAX_MESSAGE_DEPTH 64
+
+typedef enum {
+    MSG_NONE,
+    MSG_BOOL,
+    MSG_NUM,
+    MSG_INT,
+    MSG_STR,
+    MSG_LIST,
+    MSG_MAP,
+    MSG_F64_ARRAY,
+    MSG_ISOLATE
+} MessageType_t;
+
+typedef struct MessageValue_t {
+    MessageType_t type;
+    int count; // items of a list, entries of a map, numbers of a Float64Array
+    union {
+        bool boolean;
+        double num;
+        int64_t integer;
+        SharedStr_t *str;
+        struct MessageValue_t *items; // keys and values alternate for a map
+        double *numbers;
+        Isolate_t *isolate;
+    } as;
+} MessageValue_t;
+
+typedef struct Message_t {
+    struct Message_t *next;
+    MessageValue_t value;
+} Message_t;
+
+struct Isolate_t {
+    int refs; // updated atomically, every vm holding a handle owns one
+    // Vyukov's MPSC queue: senders swap their message into head and link the
+    // previous one to it, the owning vm pops from tail
+    Message_t *head;
+    Message_t *tail;
+    Message_t stub;
+    int event_fd;
+    Isolate_t *parent; // who started it, NULL if it was not started by Isolate()
+    char *path;
+    bool use_registers;
+    pthread_mutex_t lock; // guards is_finished and status
+    pthread_cond_t finished;
+    bool is_finished;
+    int status; // exit status ./main would have for the script alone
+};
+
+static Isolate_t *create_isolate(Isolate_t *parent, const char *path) {
+    Isolate_t *isolate = (Isolate_t *)malloc(sizeof(Isolate_t));
+    if (isolate == NULL) {
+        exit(1);
+    }
+    isolate->refs = 1;
+    isolate->stub.next = NULL;
+    isolate->head = &isolate->stub;
+    isolate->tail = &isolate->stub;
+    isolate->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    isolate->parent = parent;
+    isolate->path = path == NULL ? NULL : strdup(path);
+    isolate->use_registers = false;
+    pthread_mutex_init(&isolate->lock, NULL);
+    pthread_cond_init(&isolate->finished, NULL);
+    isolate->is_finished = false;
+    isolate->status = 0;
+    return isolate;
+}
+
+static Isolate_t *retain_isolate(Isolate_t *isolate) {
+    __atomic_fetch_add(&isolate->refs, 1, __ATOMIC_RELAXED);
+    return isolate;
+}
+
+static void push_message(Isolate_t *isolate, Message_t *message) {
+    message->next = NULL;
+    Message_t *prev = __atomic_exchange_n(&isolate->head, message, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+// only ever called by the isolate's own vm
+static Message_t *pop_message(Isolate_t *isolate) {
+    Message_t *tail = isolate->tail;
+    Message_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &isolate->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        isolate->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        isolate->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&isolate->head, __ATOMIC_ACQUIRE)) {
+        // a sender swapped head but has not linked tail yet, its eventfd
+        // write comes after the link and wakes the receiver again
+        return NULL;
+    }
+    push_message(isolate, &isolate->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        isolate->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void free_packed(MessageValue_t *value) {
+    switch (value->type) {
+        case MSG_STR:
+            release_shared_str(value->as.str);
+            break;
+        case MSG_LIST:
+        case MSG_MAP: {
+            int item_cnt = value->type == MSG_MAP ? value->count * 2 : value->count;
+            for (int i = 0; i < item_cnt; i++) {
+                free_packed(&value->as.items[i]);
+            }
+            free(value->as.items);
+            break;
+        }
+        case MSG_F64_ARRAY:
+            free(value->as.numbers);
+            break;
+        case MSG_ISOLATE:
+            release_isolate(value->as.isolate);
+            break;
+        default:
+            break;
+    }
+}
+
+void release_isolate(Isolate_t *isolate) {
+    if (__atomic_sub_fetch(&isolate->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    // nobody is left to send, so whatever is still queued is never received
+    Message_t *message;
+    while ((message = pop_message(isolate)) != NULL) {
+        free_packed(&message->value);
+        free(message);
+    }
+    close(isolate->event_fd);
+    if (isolate->parent != NULL) {
+        release_isolate(isolate->parent);
+    }
+    pthread_mutex_destroy(&isolate->lock);
+    pthread_cond_destroy(&isolate->finished);
+    free(isolate->path);
+    free(isolate);
+}
+
+Isolate_t *current_isolate() {
+    if (cur_vm->isolate == NULL) {
+        cur_vm->isolate = create_isolate(NULL, NULL);
+    }
+    return cur_vm->isolate;
+}
+
+static void *grow_items(int count) {
+    void *items = malloc(sizeof(MessageValue_t) * (count > 0 ? count : 1));
+    if (items == NULL) {
+        exit(1);
+    }
+    return items;
+}
+
+// copies value out of the vm into out, only strings are shared instead
+static bool pack(Value_t value, MessageValue_t *out, int depth) {
+    if (depth > MAX_MESSAGE_DEPTH) {
+        throw_runtime_error("send() message is nested more than %d deep", MAX_MESSAGE_DEPTH);
+        return false;
+    }
+    switch (value.type) {
+        case VAL_NONE:
+            out->type = MSG_NONE;
+            return true;
+        case VAL_BOOL:
+            out->type = MSG_BOOL;
+            out->as.boolean = GET_BOOL_VAL(value);
+            return true;
+        case VAL_NUM:
+            out->type = MSG_NUM;
+            out->as.num = GET_NUM_VAL(value);
+            return true;
+        case VAL_INT:
+            out->type = MSG_INT;
+            out->as.integer = GET_INT_VAL(value);
+            return true;
+        default:
+            break;
+    }
+
+    Object_t *object = GET_OBJ_VAL(value);
+    switch (object->type) {
+        case OBJ_STR: {
+            ObjectStr_t *str = (ObjectStr_t *)object;
+            out->type = MSG_STR;
+            out->as.str = str->shared != NULL
+                              ? retain_shared_str(str->shared)
+                              : create_shared_str(str->chars, str->length, str->hash);
+            return true;
+        }
+        case OBJ_LIST: {
+            ValueArray_t *items = &((ObjectList_t *)object)->items;
+            out->type = MSG_LIST;
+            out->count = 0;
+            out->as.items = (MessageValue_t *)grow_items(items->count);
+            for (int i = 0; i < items->count; i++) {
+                if (!pack(items->values[i], &out->as.items[i], depth + 1)) {
+                    free_packed(out);
+                    return false;
+                }
+                out->count++;
+            }
+            return true;
+        }
+        case OBJ_MAP: {
+            ValueTable_t *entries = &((ObjectMap_t *)object)->entries;
+            out->type = MSG_MAP;
+            out->count = 0;
+            out->as.items = (MessageValue_t *)grow_items(entries->count * 2);
+            for (int i = 0; i < entries->capacity; i++) {
+                ValueNode_t *node = &entries->table[i];
+                if (!node->is_used) {
+                    continue;
+                }
+                MessageValue_t *key = &out->as.items[out->count * 2];
+                if (!pack(node->key, key, depth + 1)) {
+                    free_packed(out);
+                    return false;
+                }
+                if (!pack(node->value, key + 1, depth + 1)) {
+                    free_packed(key);
+                    free_packed(out);
+                    return false;
+                }
+                out->count++;
+            }
+            return true;
+        }
+        case OBJ_F64_ARRAY: {
+            ObjectFloat64Array_t *array = (ObjectFloat64Array_t *)object;
+            out->type = MSG_F64_ARRAY;
+            out->count = array->length;
+            out->as.numbers = (double *)malloc(sizeof(double) * (array->length > 0 ? array->length : 1));
+            memcpy(out->as.numbers, array->data, sizeof(double) * array->length);
+            return true;
+        }
+        case OBJ_ISOLATE:
+            out->type = MSG_ISOLATE;
+            out->as.isolate = retain_isolate(((ObjectIsolate_t *)object)->isolate);
+            return true;
+        default:
+            throw_runtime_error("send() only sends none, booleans, numbers, strings, "
+                                "lists, maps, Float64Arrays and isolates");
+            return false;
+    }
+}
+
+// rebuilds value in the current vm, taking over everything it owns
+static Value_t unpack(MessageValue_t *value) {
+    switch (value->type) {
+        case MSG_NONE:
+            return DECL_NONE_VAL;
+        case MSG_BOOL:
+            return DECL_BOOL_VAL(value->as.boolean);
+        case MSG_NUM:
+            return DECL_NUM_VAL(value->as.num);
+        case MSG_INT:
+            return DECL_INT_VAL(value->as.integer);
+        case MSG_STR:
+            return DECL_OBJ_VAL(adopt_shared_str(value->as.str));
+        case MSG_LIST: {
+            ObjectList_t *list = create_list();
+            push(DECL_OBJ_VAL(list)); // GC bug
+            for (int i = 0; i < value->count; i++) {
+                push(unpack(&value->as.items[i]));
+                write_value_array(&list->items, cur_vm->stack_top[-1]);
+                pop();
+            }
+            pop(); // GC bug
+            free(value->as.items);
+            return DECL_OBJ_VAL(list);
+        }
+        case MSG_MAP: {
+            ObjectMap_t *map = create_map();
+            push(DECL_OBJ_VAL(map)); // GC bug
+            for (int i = 0; i < value->count; i++) {
+                push(unpack(&value->as.items[i * 2]));
+                push(unpack(&value->as.items[i * 2 + 1]));
+                value_table_insert(&map->entries, cur_vm->stack_top[-2], cur_vm->stack_top[-1]);
+                pop();
+                pop();
+            }
+            pop(); // GC bug
+            free(value->as.items);
+            return DECL_OBJ_VAL(map);
+        }
+        case MSG_F64_ARRAY: {
+            ObjectFloat64Array_t *array = create_f64_array(value->count);
+            memcpy(array->data, value->as.numbers, sizeof(double) * value->count);
+            free(value->as.numbers);
+            return DECL_OBJ_VAL(array);
+        }
+        case MSG_ISOLATE:
+            return DECL_OBJ_VAL(create_isolate_handle(value->as.isolate));
+    }
+    return DECL_NONE_VAL;
+}
+
+bool receive_message(Value_t *out) {
+    Message_t *message = pop_message(current_isolate());
+    if (message == NULL) {
+        return false;
+    }
+    *out = unpack(&message->value);
+    free(message);
+    return true;
+}
+
+static void *run_isolate(void *arg) {
+    Isolate_t *isolate = (Isolate_t *)arg;
+    vm_t *vm = create_vm();
+    vm->isolate = isolate; // takes over the reference Isolate() made for it
+    vm->use_registers = isolate->use_registers;
+    vm->whole_program = true;
+
+    int status = 74;
+    char *code = read_script(isolate->path);
+    if (code == NULL) {
+        fprintf(stderr, "Error: invalid path \"%s\"\n", isolate->path);
+    } else {
+        InterpretResult_t result = interpret(vm, code);
+        status = result == INTERPRET_COMPILE_ERROR   ? 65
+                 : result == INTERPRET_RUNTIME_ERROR ? 70
+                                                     : 0;
+        free(code);
+    }
+
+    retain_isolate(isolate); // outlive the vm long enough to report
+    free_vm(vm);
+    pthread_mutex_lock(&isolate->lock);
+    isolate->status = status;
+    isolate->is_finished = true;
+    pthread_cond_broadcast(&isolate->finished);
+    pthread_mutex_unlock(&isolate->lock);
+    release_isolate(isolate);
+    return NULL;
+}
+
+static bool check_isolate(const char *name, Value_t value) {
+    if (!IS_ISOLATE(value)) {
+        throw_runtime_error("%s() expects an isolate", name);
+        return false;
+    }
+    return true;
+}
+
+static Value_t isolate_handle(Isolate_t *isolate) {
+    if (isolate == NULL) {
+        return DECL_NONE_VAL;
+    }
+    return DECL_OBJ_VAL(create_isolate_handle(retain_isolate(isolate)));
+}
+
+// starts the script at path in a new isolate on its own thread
+bool isolate_native(int arg_cnt, Value_t *args) {
+    if (!IS_STR(args[0])) {
+        throw_runtime_error("Isolate() expects a script path");
+        return false;
+    }
+    Isolate_t *isolate = create_isolate(retain_isolate(current_isolate()), GET_CSTR_VAL(args[0]));
+    isolate->use_registers = cur_vm->use_registers;
+    retain_isolate(isolate); // the new thread's
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, run_isolate, isolate);
+    if (error != 0) {
+        release_isolate(isolate);
+        release_isolate(isolate);
+        throw_runtime_error("Cannot start isolate: %s", strerror(error));
+        return false;
+    }
+    pthread_detach(thread);
+    args[-1] = DECL_OBJ_VAL(create_isolate_handle(isolate));
+    return true;
+}
+
+bool send_native(int arg_cnt, Value_t *args) {
+    if (!check_isolate("send", args[0])) {
+        return false;
+    }
+    Message_t *message = (Message_t *)malloc(sizeof(Message_t));
+    if (!pack(args[1], &message->value, 0)) {
+        free(message);
+        return false;
+    }
+    Isolate_t *isolate = GET_ISOLATE(args[0]);
+    push_message(isolate, message);
+    uint64_t one = 1;
+    if (write(isolate->event_fd, &one, sizeof(one)) < 0) {
+        // the counter is saturated, the receiver has plenty of wakeups pending
+    }
+    args[-1] = DECL_NONE_VAL;
+    return true;
+}
+
+// waits for the next message, parking only the calling task inside run_loop()
+bool receive_native(int arg_cnt, Value_t *args) {
+    Waiter_t waiter = {NULL, WAIT_RECEIVE, 0, NULL, 0};
+    return perform_io(current_isolate()->event_fd, waiter, args, arg_cnt);
+}
+
+bool self_native(int arg_cnt, Value_t *args) {
+    args[-1] = isolate_handle(current_isolate());
+    return true;
+}
+
+bool parent_native(int arg_cnt, Value_t *args) {
+    args[-1] = isolate_handle(current_isolate()->parent);
+    return true;
+}
+
+// blocks the whole thread until the isolate's script ends, returns its exit status
+bool join_native(int arg_cnt, Value_t *args) {
+    if (!check_isolate("join", args[0])) {
+        return false;
+    }
+    Isolate_t *isolate = GET_ISOLATE(args[0]);
+    if (isolate == cur_vm->isolate) {
+        throw_runtime_error("join() cannot wait for the calling isolate");
+        return false;
+    }
+    pthread_mutex_lock(&isolate->lock);
+    while (!isolate->is_finished) {
+        pthread_cond_wait(&isolate->finished, &isolate->lock);
+    }
+    int status = isolate->status;
+    pthread_mutex_unlock(&isolate->lock);
+    args[-1] = DECL_INT_VAL(status);
+    return true;
+}
+
+void define_isolate_natives() {
+    define_native("Isolate", isolate_native, 1);
+    define_native("send", send_native, 2);
+    define_native("receive", receive_native, 0);
+    define_native("self", self_native, 0);
+    define_native("parent", parent_native, 0);
+    define_native("join", join_native, 1);
+}
@@ -24,7 +24,7 @@ void write_line_array(LineRunArray_t *array, LineRun_t line_run) {
 }
 
 void free_line_array(LineRunArray_t *array) {
-    free(array->line_runs);
+    FREE_ARRAY(LineRun_t, array->line_runs, array->capacity);
     init_line_run_array(array);
 }
 
@@ -1,27 +1,149 @@
+#include "../includes/batch.h"
+#include "../includes/server.h"
 #include "../includes/vm.h"
 #include <stdio.h>
 
 // TODO: 391
 
-void read_lines();
-void run_file(const char *path);
+void read_lines(vm_t *vm);
+void run_file(vm_t *vm, const char *path, bool gc_stats);
 
 int main(int argc, const char *argv[]) {
-    init_vm();
-    if (argc == 1) {
-        read_lines();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    // --vm=register runs the program on the register VM
+    // --batch runs every path given, or read from stdin, on --jobs=N threads
+    // --shared-strings lets every vm in the process share equal strings
+    // --serve=SOCKET [prelude] forks --workers=N copies of the vm warmed by the
+    // prelude that run jobs sent by --connect=SOCKET <file>, see server.h
+    // --profile[=FILE] reports what the stack VM executed, as JSON into FILE too
+    // --gc-stats prints how many collections the script took and the peak rss
+    // to stderr
+    // --sample=FILE writes the script's call stacks sampled --sample-hz=N times
+    // a second of CPU time to FILE, folded for flamegraph.pl
+    bool use_registers = false;
+    bool batch = false;
+    int worker_cnt = 0;
+    const char *serve_path = NULL;
+    const char *connect_path = NULL;
+    double timeout_ms = 0;
+    bool profile = false;
+    const char *profile_path = NULL;
+    const char *sample_path = NULL;
+    bool gc_stats = false;
+    int sample_hz = 997; // off the round rates periodic work tends to run at
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strncmp(argv[arg], "--vm=", 5) == 0) {
+            if (strcmp(argv[arg] + 5, "register") == 0) {
+                use_registers = true;
+            } else if (strcmp(argv[arg] + 5, "stack") != 0) {
+                fprintf(stderr, "Error: unknown vm \"%s\", expected stack or register\n", argv[arg] + 5);
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch = true;
+        } else if (strncmp(argv[arg], "--serve=", 8) == 0) {
+            serve_path = argv[arg] + 8;
+        } else if (strncmp(argv[arg], "--connect=", 10) == 0) {
+            connect_path = argv[arg] + 10;
+        } else if (strncmp(argv[arg], "--workers=", 10) == 0) {
+            worker_cnt = atoi(argv[arg] + 10);
+            if (worker_cnt < 1) {
+                fprintf(stderr, "Error: invalid worker count \"%s\"\n", argv[arg] + 10);
+                exit(64);
+            }
+        } else if (strncmp(argv[arg], "--timeout=", 10) == 0) {
+            timeout_ms = atof(argv[arg] + 10);
+            if (timeout_ms <= 0) {
+                fprintf(stderr, "Error: invalid timeout \"%s\"\n", argv[arg] + 10);
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile = true;
+        } else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+            profile = true;
+            profile_path = argv[arg] + 10;
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strncmp(argv[arg], "--sample=", 9) == 0) {
+            sample_path = argv[arg] + 9;
+        } else if (strncmp(argv[arg], "--sample-hz=", 12) == 0) {
+            sample_hz = atoi(argv[arg] + 12);
+            if (sample_hz < 1 || sample_hz > 100000) {
+                fprintf(stderr, "Error: invalid sample rate \"%s\"\n", argv[arg] + 12);
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--shared-strings") == 0) {
+            share_strings = true;
+        } else if (strncmp(argv[arg], "--jobs=", 7) == 0) {
+            worker_cnt = atoi(argv[arg] + 7);
+            if (worker_cnt < 1) {
+                fprintf(stderr, "Error: invalid job count \"%s\"\n", argv[arg] + 7);
+                exit(64);
+            }
+        } else {
+            fprintf(stderr, "Error: unknown option \"%s\"\n", argv[arg]);
+            exit(64);
+        }
+    }
+
+    if (batch) {
+        return run_batch(argv + arg, argc - arg, worker_cnt, use_registers);
+    }
+    if (serve_path != NULL) {
+        if (argc > arg + 1) {
+            fprintf(stderr, "Error: expected at most one prelude path\n");
+            exit(64);
+        }
+        return run_server(serve_path, argc == arg ? NULL : argv[arg], worker_cnt, timeout_ms,
+                          use_registers);
+    }
+    if (connect_path != NULL) {
+        if (argc != arg + 1) {
+            fprintf(stderr, "Error: no path specified\n");
+            exit(64);
+        }
+        return run_client(connect_path, argv[arg]);
+    }
+
+    vm_t *vm = create_vm();
+    vm->use_registers = use_registers;
+    if (profile) {
+        vm->profile = create_profile(profile_path);
+    }
+    if (sample_path != NULL) {
+        vm->sampler = create_sampler(sample_path, sample_hz);
+    }
+    if (argc == arg) {
+        read_lines(vm);
+    } else if (argc == arg + 1) {
+        run_file(vm, argv[arg], gc_stats);
     } else {
         fprintf(stderr, "Error: no path specified\n");
         exit(64);
     }
 
-    free_vm();
+    free_vm(vm);
     return 0;
 }
 
-void run_file(const char *path) {
+// the process's resident set high-water mark, -1 where /proc can't tell it
+static long peak_rss_kb() {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[256];
+    long peak_kb = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak_kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return peak_kb;
+}
+
+void run_file(vm_t *vm, const char *path, bool gc_stats) {
     FILE *fp = fopen(path, "r");
     if (!fp) {
         fprintf(stderr, "Error: invalid path \"%s\"\n", path);
@@ -45,7 +167,24 @@ void run_file(const char *path) {
 
     fclose(fp);
 
-    InterpretResult_t result = interpret(code);
+    vm->whole_program = true;
+    if (vm->sampler != NULL && !start_sampler(vm->sampler)) {
+        exit(74);
+    }
+    InterpretResult_t result = interpret(vm, code);
+    if (vm->sampler != NULL) {
+        report_sampler(vm->sampler, stderr);
+    }
+    if (vm->profile != NULL) {
+        report_profile(vm->profile, stderr);
+    }
+    if (gc_stats) {
+        fprintf(stderr, "gc collections: %zu\n", vm->gc_cnt);
+        long peak_kb = peak_rss_kb();
+        if (peak_kb >= 0) {
+            fprintf(stderr, "peak rss: %ld kB\n", peak_kb);
+        }
+    }
     if (result == INTERPRET_COMPILE_ERROR) {
         exit(65);
     }
@@ -56,7 +195,7 @@ void run_file(const char *path) {
     code = NULL;
 }
 
-void read_lines() {
+void read_lines(vm_t *vm) {
     char line[1024];
     while (true) {
         printf("> ");
@@ -64,6 +203,6 @@ void read_lines() {
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(vm, line);
     }
 }
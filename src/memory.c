@@ -1,5 +1,8 @@
 #include "../includes/memory.h"
+#include "../includes/intern.h"
+#include "../includes/isolate.h"
 #include "../includes/object.h"
+#include "../includes/register.h"
 #include "../includes/vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -16,7 +19,7 @@ int grow_capacity(int old_capacity) {
 void *resize(void *ptr, size_t type_size, int old_capacity, int new_capacity) {
     int new_size = type_size * new_capacity;
     int old_size = type_size * old_capacity;
-    vm.bytes_allocated += new_size - old_size;
+    cur_vm->bytes_allocated += new_size - old_size;
 
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
@@ -24,7 +27,7 @@ void *resize(void *ptr, size_t type_size, int old_capacity, int new_capacity) {
 #endif
     }
 
-    if (vm.bytes_allocated > vm.next_GC) {
+    if (cur_vm->bytes_allocated > cur_vm->next_GC) {
         collect_garbage();
     }
 
@@ -40,6 +43,12 @@ void *resize(void *ptr, size_t type_size, int old_capacity, int new_capacity) {
     return res;
 }
 
+// frees memory that resize() counted, so bytes_allocated follows what is live
+void release(void *ptr, size_t size) {
+    cur_vm->bytes_allocated -= size;
+    free(ptr);
+}
+
 void free_object(Object_t *object) {
 #ifdef DEBUG_LOG_GC
     printf("%p freed type %d\n", (void *)object, object->type);
@@ -47,46 +56,84 @@ void free_object(Object_t *object) {
     switch (object->type) {
         case OBJ_STR: {
             ObjectStr_t *str = (ObjectStr_t *)object;
-            free(str);
+            size_t size = sizeof(ObjectStr_t);
+            if (str->shared != NULL) {
+                release_shared_str(str->shared);
+            } else {
+                size += str->length + 1;
+            }
+            release(str, size);
             break;
         }
         case OBJ_FUNC: {
             ObjectFunc_t *func = (ObjectFunc_t *)object;
             free_chunk(&func->chunk);
-            free(func);
+            free_reg_chunk(func->reg_chunk);
+            release(func, sizeof(ObjectFunc_t));
             break;
         }
         case OBJ_NATIVE: {
             ObjectNative_t *native = (ObjectNative_t *)object;
-            free(native);
+            release(native, sizeof(ObjectNative_t));
             break;
         }
         case OBJ_CLOSURE: {
             ObjectClosure_t *closure = (ObjectClosure_t *)object;
-            free(closure->upvalues);
-            free(closure);
+            release(closure, sizeof(ObjectClosure_t) +
+                                 sizeof(ObjectUpvalue_t *) * closure->upvalue_cnt);
             break;
         }
         case OBJ_UPVALUE: {
             ObjectUpvalue_t *upvalue = (ObjectUpvalue_t *)object;
-            free(upvalue);
+            release(upvalue, sizeof(ObjectUpvalue_t));
             break;
         }
         case OBJ_CLASS: {
             ObjectClass_t *class_ = (ObjectClass_t *)object;
             free_hash_table(&class_->methods);
-            free(class_);
+            release(class_, sizeof(ObjectClass_t));
             break;
         }
         case OBJ_INSTANCE: {
             ObjectInstance_t *instance = (ObjectInstance_t *)object;
             free_hash_table(&instance->fields);
-            free(instance);
+            release(instance, sizeof(ObjectInstance_t));
             break;
         }
         case OBJ_BOUND_METHOD: {
             ObjectBoundMethod_t *bound = (ObjectBoundMethod_t *)object;
-            free(bound);
+            release(bound, sizeof(ObjectBoundMethod_t));
+            break;
+        }
+        case OBJ_LIST: {
+            ObjectList_t *list = (ObjectList_t *)object;
+            release(list->items.values, sizeof(Value_t) * list->items.capacity);
+            init_value_array(&list->items);
+            release(list, sizeof(ObjectList_t));
+            break;
+        }
+        case OBJ_F64_ARRAY: {
+            ObjectFloat64Array_t *array = (ObjectFloat64Array_t *)object;
+            release(array, sizeof(ObjectFloat64Array_t) + sizeof(double) * array->length);
+            break;
+        }
+        case OBJ_MAP: {
+            ObjectMap_t *map = (ObjectMap_t *)object;
+            free_value_table(&map->entries);
+            release(map, sizeof(ObjectMap_t));
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjectFiber_t *fiber = (ObjectFiber_t *)object;
+            release(fiber->stack, sizeof(Value_t) * fiber->stack_capacity);
+            release(fiber->frames, sizeof(CallFrame_t) * fiber->frame_capacity);
+            release(fiber->upvalues, sizeof(ObjectUpvalue_t *) * fiber->upvalue_capacity);
+            release(fiber, sizeof(ObjectFiber_t));
+            break;
+        }
+        case OBJ_ISOLATE: {
+            release_isolate(((ObjectIsolate_t *)object)->isolate);
+            release(object, sizeof(ObjectIsolate_t));
             break;
         }
     }
@@ -104,16 +151,16 @@ void mark_object(Object_t *object) {
 #endif
 
     object->is_marked = true;
-    if (vm.grey_capacity < vm.grey_cnt + 1) {
-        vm.grey_capacity = grow_capacity(vm.grey_capacity);
-        vm.grey_stack =
-            realloc(vm.grey_stack, sizeof(Object_t *) * vm.grey_capacity);
-        if (vm.grey_stack == NULL) {
+    if (cur_vm->grey_capacity < cur_vm->grey_cnt + 1) {
+        cur_vm->grey_capacity = grow_capacity(cur_vm->grey_capacity);
+        cur_vm->grey_stack =
+            realloc(cur_vm->grey_stack, sizeof(Object_t *) * cur_vm->grey_capacity);
+        if (cur_vm->grey_stack == NULL) {
             // unlikely but just in case
             exit(1);
         }
     }
-    vm.grey_stack[vm.grey_cnt++] = object;
+    cur_vm->grey_stack[cur_vm->grey_cnt++] = object;
 }
 
 void mark_value(Value_t value) {
@@ -125,19 +172,19 @@ void mark_value(Value_t value) {
 
 // mark anything that the VM can reach so we don't accidetally deallocate it
 void mark_roots() {
-    for (Value_t *idx = vm.stack; idx < vm.stack_top; idx++) {
+    for (Value_t *idx = cur_vm->stack; idx < cur_vm->stack_top; idx++) {
         mark_value(*idx); // mark local variables on stack as needed
     }
-    for (int i = 0; i < vm.frame_cnt; i++) {
-        mark_object((Object_t *)vm.frames[i].closure); // mark closures too
+    for (int i = 0; i < cur_vm->frame_cnt; i++) {
+        mark_object((Object_t *)cur_vm->frames[i].closure); // mark closures too
     }
-    for (ObjectUpvalue_t *upvalue = vm.open_upvalues; upvalue != NULL;
-         upvalue = upvalue->next) {
-        mark_object((Object_t *)upvalue); // upvalues are reachable too
+    for (int slot = 0; slot < cur_vm->open_top; slot++) {
+        mark_object((Object_t *)cur_vm->open_upvalues[slot]); // upvalues are reachable too
     }
-    mark_table(&vm.globals); // mark globals
+    mark_table(&cur_vm->globals); // mark globals
     mark_compiler_roots();
-    mark_object((Object_t *)vm.init_str);
+    mark_event_loop(&cur_vm->loop);
+    mark_object((Object_t *)cur_vm->init_str);
 }
 
 void mark_array(ValueArray_t *array) {
@@ -157,6 +204,10 @@ void mark_black(Object_t *object) {
             break;
         case OBJ_STR:
             break;
+        case OBJ_F64_ARRAY:
+            break;
+        case OBJ_ISOLATE:
+            break;
         case OBJ_UPVALUE: {
             mark_value(((ObjectUpvalue_t *)object)->closed);
             break;
@@ -164,6 +215,7 @@ void mark_black(Object_t *object) {
         case OBJ_FUNC: {
             ObjectFunc_t *func = (ObjectFunc_t *)object;
             mark_object((Object_t *)func->name);
+            mark_object((Object_t *)func->shared_closure);
             mark_array(&func->chunk.constants);
             break;
         }
@@ -179,6 +231,7 @@ void mark_black(Object_t *object) {
             ObjectClass_t *class_ = (ObjectClass_t *)object;
             mark_object((Object_t *)class_->name);
             mark_table(&class_->methods);
+            mark_object((Object_t *)class_->initializer);
             break;
         }
         case OBJ_INSTANCE: {
@@ -191,21 +244,45 @@ void mark_black(Object_t *object) {
             ObjectBoundMethod_t *bound = (ObjectBoundMethod_t *)object;
             mark_value(bound->receiver);
             mark_object((Object_t *)bound->method);
+            break;
+        }
+        case OBJ_LIST: {
+            mark_array(&((ObjectList_t *)object)->items);
+            break;
+        }
+        case OBJ_MAP: {
+            mark_value_table(&((ObjectMap_t *)object)->entries);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjectFiber_t *fiber = (ObjectFiber_t *)object;
+            mark_object((Object_t *)fiber->closure);
+            mark_object((Object_t *)fiber->caller);
+            for (int i = 0; i < fiber->stack_cnt; i++) {
+                mark_value(fiber->stack[i]);
+            }
+            for (int i = 0; i < fiber->frame_cnt; i++) {
+                mark_object((Object_t *)fiber->frames[i].closure);
+            }
+            for (int i = 0; i < fiber->upvalue_cnt; i++) {
+                mark_object((Object_t *)fiber->upvalues[i]);
+            }
+            break;
         }
     }
 }
 
 void trace_references() {
     // greys are "marked grey" if they are in the grey stack
-    while (vm.grey_cnt > 0) {
-        Object_t *object = vm.grey_stack[--vm.grey_cnt];
+    while (cur_vm->grey_cnt > 0) {
+        Object_t *object = cur_vm->grey_stack[--cur_vm->grey_cnt];
         mark_black(object);
     }
 }
 
 void sweep() {
     Object_t *prev = NULL;
-    Object_t *object = vm.objects;
+    Object_t *object = cur_vm->objects;
     while (object) {
         if (object->is_marked) {
             object->is_marked = false; // mark everything white for next cycle
@@ -218,7 +295,7 @@ void sweep() {
             if (prev) {
                 prev->next = object;
             } else {
-                vm.objects = object;
+                cur_vm->objects = object;
             }
 
             free_object(to_del);
@@ -229,30 +306,41 @@ void sweep() {
 void collect_garbage() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    size_t before = cur_vm->bytes_allocated;
 #endif
 
+    if (cur_vm->sampler != NULL) {
+        drain_samples(cur_vm->sampler);
+    }
     mark_roots();
     trace_references();
-    remove_table_whites(&vm.strings);
+    remove_table_whites(&cur_vm->strings);
     sweep();
+    // freed classes and names may come back at the same address
+    flush_method_cache(NULL);
+    flush_bound_cache();
+    reclaim_shared_strs();
 
-    vm.next_GC = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    cur_vm->next_GC = cur_vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (cur_vm->next_GC < GC_MIN_HEAP) {
+        cur_vm->next_GC = GC_MIN_HEAP;
+    }
+    cur_vm->gc_cnt++;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc done\n");
     printf(" collected %ld bytes (from %ld to %ld) next at %ld\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_GC);
+           before - cur_vm->bytes_allocated, before, cur_vm->bytes_allocated, cur_vm->next_GC);
 #endif
 }
 
 void free_objects() {
-    Object_t *cur = vm.objects;
+    Object_t *cur = cur_vm->objects;
     while (cur != NULL) {
         Object_t *next = cur->next;
         free_object(cur);
         cur = next;
     }
-    free(vm.grey_stack);
+    free(cur_vm->grey_stack);
     cur = NULL;
 }
@@ -0,0 +1,411 @@
+#include "../includes/native.h"
+#include "../includes/event_loop.h"
+#include "../includes/fiber.h"
+#include "../includes/isolate.h"
+#include "../includes/memory.h"
+#include "../includes/object.h"
+#include "../includes/simd.h"
+#include "../includes/vm.h"
+
+#include <time.h>
+
+void define_native(const char *name, NativeFunc_t func, int arity) {
+    push(DECL_OBJ_VAL(allocate_str(name, (int)strlen(name))));
+    push(DECL_OBJ_VAL(create_native(func, arity)));
+    insert(&cur_vm->globals, GET_STR_VAL(cur_vm->stack[0]), cur_vm->stack[1]);
+    pop();
+    pop();
+}
+
+// numbers used as indices/lengths must be whole
+static bool is_whole(Value_t value) {
+    if (IS_INT_VAL(value)) {
+        return GET_INT_VAL(value) >= INT32_MIN && GET_INT_VAL(value) <= INT32_MAX;
+    }
+    if (!IS_NUM_VAL(value)) {
+        return false;
+    }
+    double num = GET_NUM_VAL(value);
+    return num >= -2147483648.0 && num <= 2147483647.0 && num == (int)num;
+}
+
+bool clock_native(int arg_cnt, Value_t *args) {
+    args[-1] = DECL_NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// ------------------------------ Lists ------------------------------ //
+
+bool len_native(int arg_cnt, Value_t *args) {
+    if (IS_LIST(args[0])) {
+        args[-1] = DECL_INT_VAL(GET_LIST(args[0])->items.count);
+    } else if (IS_MAP(args[0])) {
+        args[-1] = DECL_INT_VAL(GET_MAP(args[0])->entries.count);
+    } else if (IS_STR(args[0])) {
+        args[-1] = DECL_INT_VAL(GET_STR_VAL(args[0])->length);
+    } else if (IS_F64_ARRAY(args[0])) {
+        args[-1] = DECL_INT_VAL(GET_F64_ARRAY(args[0])->length);
+    } else {
+        throw_runtime_error("len() expects a list, array, map or string");
+        return false;
+    }
+    return true;
+}
+
+bool push_native(int arg_cnt, Value_t *args) {
+    if (!IS_LIST(args[0])) {
+        throw_runtime_error("push() expects a list as its first argument");
+        return false;
+    }
+    write_value_array(&GET_LIST(args[0])->items, args[1]);
+    args[-1] = DECL_NONE_VAL;
+    return true;
+}
+
+bool pop_native(int arg_cnt, Value_t *args) {
+    if (!IS_LIST(args[0])) {
+        throw_runtime_error("pop() expects a list");
+        return false;
+    }
+    ValueArray_t *items = &GET_LIST(args[0])->items;
+    if (items->count == 0) {
+        throw_runtime_error("pop() called on an empty list");
+        return false;
+    }
+    args[-1] = items->values[--items->count];
+    return true;
+}
+
+// slice(list, start) or slice(list, start, end) -> bounds are clamped to the list
+bool slice_native(int arg_cnt, Value_t *args) {
+    if (arg_cnt != 2 && arg_cnt != 3) {
+        throw_runtime_error("slice() expects 2 or 3 arguments but got %d", arg_cnt);
+        return false;
+    }
+    if (!IS_LIST(args[0])) {
+        throw_runtime_error("slice() expects a list as its first argument");
+        return false;
+    }
+    ValueArray_t *items = &GET_LIST(args[0])->items;
+    if (!is_whole(args[1]) || (arg_cnt == 3 && !is_whole(args[2]))) {
+        throw_runtime_error("slice() bounds must be whole numbers");
+        return false;
+    }
+    int start = (int)GET_DOUBLE_VAL(args[1]);
+    int end = arg_cnt == 3 ? (int)GET_DOUBLE_VAL(args[2]) : items->count;
+    start = start < 0 ? 0 : (start > items->count ? items->count : start);
+    end = end < start ? start : (end > items->count ? items->count : end);
+
+    ObjectList_t *res = create_list();
+    push(DECL_OBJ_VAL(res)); // GC bug
+    int len = end - start;
+    if (len > 0) {
+        res->items.values = resize(NULL, sizeof(Value_t), 0, len);
+        res->items.capacity = len;
+        // source list could not have moved, it's still rooted in args
+        memcpy(res->items.values, items->values + start, sizeof(Value_t) * len);
+        res->items.count = len;
+    }
+    pop(); // GC bug
+    args[-1] = DECL_OBJ_VAL(res);
+    return true;
+}
+
+// -------------------------- Float64Array --------------------------- //
+
+// Float64Array(length) -> zero filled, Float64Array(list) -> copy of numbers
+bool f64_array_native(int arg_cnt, Value_t *args) {
+    if (is_whole(args[0])) {
+        int length = (int)GET_DOUBLE_VAL(args[0]);
+        if (length < 0) {
+            throw_runtime_error("Float64Array() length cannot be negative");
+            return false;
+        }
+        args[-1] = DECL_OBJ_VAL(create_f64_array(length));
+        return true;
+    }
+    if (!IS_LIST(args[0])) {
+        throw_runtime_error("Float64Array() expects a length or a list of numbers");
+        return false;
+    }
+    ValueArray_t *items = &GET_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMERIC_VAL(items->values[i])) {
+            throw_runtime_error("Float64Array() list element %d is not a number", i);
+            return false;
+        }
+    }
+    ObjectFloat64Array_t *array = create_f64_array(items->count);
+    for (int i = 0; i < items->count; i++) {
+        array->data[i] = GET_DOUBLE_VAL(items->values[i]);
+    }
+    args[-1] = DECL_OBJ_VAL(array);
+    return true;
+}
+
+static bool check_f64_args(const char *name, int arg_cnt, Value_t *args, int array_cnt) {
+    for (int i = 0; i < array_cnt; i++) {
+        if (!IS_F64_ARRAY(args[i])) {
+            throw_runtime_error("%s() expects a Float64Array as argument %d", name, i + 1);
+            return false;
+        }
+    }
+    if (array_cnt == 2 && GET_F64_ARRAY(args[0])->length != GET_F64_ARRAY(args[1])->length) {
+        throw_runtime_error("%s() arrays have different lengths (%d and %d)", name,
+                            GET_F64_ARRAY(args[0])->length, GET_F64_ARRAY(args[1])->length);
+        return false;
+    }
+    if (arg_cnt > array_cnt && !IS_NUMERIC_VAL(args[array_cnt])) {
+        throw_runtime_error("%s() expects a number as argument %d", name, array_cnt + 1);
+        return false;
+    }
+    return true;
+}
+
+bool f64_sum_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_sum", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    args[-1] = DECL_NUM_VAL(f64_kernels.sum(a->data, a->length));
+    return true;
+}
+
+bool f64_min_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_min", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    if (a->length == 0) {
+        throw_runtime_error("f64_min() called on an empty array");
+        return false;
+    }
+    args[-1] = DECL_NUM_VAL(f64_kernels.min(a->data, a->length));
+    return true;
+}
+
+bool f64_max_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_max", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    if (a->length == 0) {
+        throw_runtime_error("f64_max() called on an empty array");
+        return false;
+    }
+    args[-1] = DECL_NUM_VAL(f64_kernels.max(a->data, a->length));
+    return true;
+}
+
+bool f64_dot_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_dot", arg_cnt, args, 2)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    ObjectFloat64Array_t *b = GET_F64_ARRAY(args[1]);
+    args[-1] = DECL_NUM_VAL(f64_kernels.dot(a->data, b->data, a->length));
+    return true;
+}
+
+// the in-place kernels below return the array they modified
+bool f64_scale_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_scale", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    f64_kernels.scale(a->data, GET_DOUBLE_VAL(args[1]), a->length);
+    args[-1] = args[0];
+    return true;
+}
+
+bool f64_add_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_add", arg_cnt, args, 2)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    f64_kernels.add(a->data, GET_F64_ARRAY(args[1])->data, a->length);
+    args[-1] = args[0];
+    return true;
+}
+
+bool f64_fill_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_fill", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    f64_kernels.fill(a->data, GET_DOUBLE_VAL(args[1]), a->length);
+    args[-1] = args[0];
+    return true;
+}
+
+bool f64_prefix_sum_native(int arg_cnt, Value_t *args) {
+    if (!check_f64_args("f64_prefix_sum", arg_cnt, args, 1)) {
+        return false;
+    }
+    ObjectFloat64Array_t *a = GET_F64_ARRAY(args[0]);
+    f64_kernels.prefix_sum(a->data, a->length);
+    args[-1] = args[0];
+    return true;
+}
+
+bool simd_level_native(int arg_cnt, Value_t *args) {
+    args[-1] = DECL_OBJ_VAL(allocate_str(f64_kernels.name, (int)strlen(f64_kernels.name)));
+    return true;
+}
+
+// ------------------------------- Maps ------------------------------- //
+
+bool map_native(int arg_cnt, Value_t *args) {
+    args[-1] = DECL_OBJ_VAL(create_map());
+    return true;
+}
+
+static bool check_map(const char *name, Value_t value) {
+    if (!IS_MAP(value)) {
+        throw_runtime_error("%s() expects a map as its first argument", name);
+        return false;
+    }
+    return true;
+}
+
+// map_get(map, key) or map_get(map, key, default) -> default is none if omitted
+bool map_get_native(int arg_cnt, Value_t *args) {
+    if (arg_cnt != 2 && arg_cnt != 3) {
+        throw_runtime_error("map_get() expects 2 or 3 arguments but got %d", arg_cnt);
+        return false;
+    }
+    if (!check_map("map_get", args[0])) {
+        return false;
+    }
+    Value_t *value = value_table_get(&GET_MAP(args[0])->entries, args[1]);
+    args[-1] = value ? *value : (arg_cnt == 3 ? args[2] : DECL_NONE_VAL);
+    return true;
+}
+
+bool map_set_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_set", args[0])) {
+        return false;
+    }
+    value_table_insert(&GET_MAP(args[0])->entries, args[1], args[2]);
+    args[-1] = args[2];
+    return true;
+}
+
+bool map_has_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_has", args[0])) {
+        return false;
+    }
+    args[-1] = DECL_BOOL_VAL(value_table_get(&GET_MAP(args[0])->entries, args[1]) != NULL);
+    return true;
+}
+
+bool map_delete_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_delete", args[0])) {
+        return false;
+    }
+    args[-1] = DECL_BOOL_VAL(value_table_drop(&GET_MAP(args[0])->entries, args[1]));
+    return true;
+}
+
+bool map_size_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_size", args[0])) {
+        return false;
+    }
+    args[-1] = DECL_INT_VAL(GET_MAP(args[0])->entries.count);
+    return true;
+}
+
+// collects either the keys or the values of a map into a new list in slot order
+static void map_collect(ObjectMap_t *map, bool keys, Value_t *out) {
+    ObjectList_t *res = create_list();
+    push(DECL_OBJ_VAL(res)); // GC bug
+    ValueTable_t *entries = &map->entries;
+    if (entries->count > 0) {
+        res->items.values = resize(NULL, sizeof(Value_t), 0, entries->count);
+        res->items.capacity = entries->count;
+        for (int i = 0; i < entries->capacity; i++) {
+            ValueNode_t *node = &entries->table[i];
+            if (node->is_used) {
+                res->items.values[res->items.count++] = keys ? node->key : node->value;
+            }
+        }
+    }
+    pop(); // GC bug
+    *out = DECL_OBJ_VAL(res);
+}
+
+bool map_keys_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_keys", args[0])) {
+        return false;
+    }
+    map_collect(GET_MAP(args[0]), true, &args[-1]);
+    return true;
+}
+
+bool map_values_native(int arg_cnt, Value_t *args) {
+    if (!check_map("map_values", args[0])) {
+        return false;
+    }
+    map_collect(GET_MAP(args[0]), false, &args[-1]);
+    return true;
+}
+
+bool fiber_native(int arg_cnt, Value_t *args) {
+    if (!IS_CLOSURE(args[0])) {
+        throw_runtime_error("Fiber() expects a function");
+        return false;
+    }
+    args[-1] = DECL_OBJ_VAL(create_fiber(GET_CLOSURE(args[0])));
+    return true;
+}
+
+bool yield_native(int arg_cnt, Value_t *args) {
+    if (arg_cnt > 1) {
+        throw_runtime_error("yield() expects 0 or 1 arguments but got %d", arg_cnt);
+        return false;
+    }
+    return yield_fiber(arg_cnt == 1 ? args[0] : DECL_NONE_VAL, args - 1, arg_cnt);
+}
+
+bool fiber_done_native(int arg_cnt, Value_t *args) {
+    if (!IS_FIBER(args[0])) {
+        throw_runtime_error("fiber_done() expects a fiber");
+        return false;
+    }
+    args[-1] = DECL_BOOL_VAL(GET_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+void define_natives() {
+    define_native("clock", clock_native, 0);
+    define_native("len", len_native, 1);
+    define_native("push", push_native, 2);
+    define_native("pop", pop_native, 1);
+    define_native("slice", slice_native, -1);
+
+    define_native("Float64Array", f64_array_native, 1);
+    define_native("f64_sum", f64_sum_native, 1);
+    define_native("f64_min", f64_min_native, 1);
+    define_native("f64_max", f64_max_native, 1);
+    define_native("f64_dot", f64_dot_native, 2);
+    define_native("f64_scale", f64_scale_native, 2);
+    define_native("f64_add", f64_add_native, 2);
+    define_native("f64_fill", f64_fill_native, 2);
+    define_native("f64_prefix_sum", f64_prefix_sum_native, 1);
+    define_native("simd_level", simd_level_native, 0);
+
+    define_native("Map", map_native, 0);
+    define_native("map_get", map_get_native, -1);
+    define_native("map_set", map_set_native, 3);
+    define_native("map_has", map_has_native, 2);
+    define_native("map_delete", map_delete_native, 2);
+    define_native("map_size", map_size_native, 1);
+    define_native("map_keys", map_keys_native, 1);
+    define_native("map_values", map_values_native, 1);
+
+    define_native("Fiber", fiber_native, 1);
+    define_native("yield", yield_native, -1);
+    define_native("fiber_done", fiber_done_native, 1);
+    define_io_natives();
+    define_isolate_natives();
+}
@@ -1,14 +1,17 @@
 #include "../includes/object.h"
+#include "../includes/intern.h"
 #include "../includes/memory.h"
 #include "../includes/value.h"
 #include "../includes/vm.h"
 
 Object_t *allocate_object(size_t size, ObjectType_t type) {
-    Object_t *new_object = (Object_t *)(malloc(size));
+    // through resize() so objects count towards bytes_allocated and can
+    // trigger a collection, as growing an array does
+    Object_t *new_object = (Object_t *)resize(NULL, size, 0, 1);
     new_object->type = type;
-    new_object->next = vm.objects;
+    new_object->next = cur_vm->objects;
     new_object->is_marked = false;
-    vm.objects = new_object;
+    cur_vm->objects = new_object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void *)new_object, size, type);
@@ -25,27 +28,94 @@ uint32_t hash_string(const char *key, int length) {
     return hash;
 }
 
+// wraps chars in a new interned string, shared may be NULL
+static ObjectStr_t *intern_str(const char *chars, int length, uint32_t hash,
+                               SharedStr_t *shared) {
+    size_t inline_size = shared == NULL ? sizeof(char) * (length + 1) : 0;
+    ObjectStr_t *new_str =
+        (ObjectStr_t *)allocate_object(sizeof(ObjectStr_t) + inline_size, OBJ_STR);
+    new_str->length = length;
+    new_str->hash = hash;
+    new_str->shared = shared;
+    if (shared == NULL) {
+        new_str->chars = new_str->inline_chars;
+        memcpy(new_str->chars, chars, length);
+        new_str->chars[length] = '\0';
+    } else {
+        new_str->chars = shared->chars;
+    }
+
+    push(DECL_OBJ_VAL(new_str)); // fix GC bug
+    insert(&cur_vm->strings, new_str, DECL_NONE_VAL);
+    pop(); // fix GC bug
+
+    return new_str;
+}
+
 ObjectStr_t *allocate_str(const char *chars, int length) {
     uint32_t hash = hash_string(chars, length);
     // string object already exists in memory check
-    ObjectStr_t *interned = find_str(&vm.strings, chars, length, hash);
+    ObjectStr_t *interned = find_str(&cur_vm->strings, chars, length, hash);
     if (interned != NULL) {
         return interned;
     }
+    SharedStr_t *shared = share_strings ? intern_shared_str(chars, length, hash) : NULL;
+    if (shared == NULL && length >= SHARED_STR_MIN) {
+        shared = create_shared_str(chars, length, hash);
+    }
+    return intern_str(chars, length, hash, shared);
+}
 
-    ObjectStr_t *new_str = (ObjectStr_t *)allocate_object(
-        sizeof(ObjectStr_t) + sizeof(char) * (length + 1), OBJ_STR);
-    new_str->length = length;
-    memcpy(new_str->chars, chars, length);
-    new_str->chars[length] = '\0';
+SharedStr_t *create_shared_str(const char *chars, int length, uint32_t hash) {
+    SharedStr_t *shared = (SharedStr_t *)malloc(sizeof(SharedStr_t) + length + 1);
+    if (shared == NULL) {
+        exit(1);
+    }
+    shared->refs = 1;
+    shared->length = length;
+    shared->hash = hash;
+    shared->slot = -1;
+    memcpy(shared->chars, chars, length);
+    shared->chars[length] = '\0';
+    return shared;
+}
 
-    new_str->hash = hash_string(chars, length);
+SharedStr_t *retain_shared_str(SharedStr_t *shared) {
+    __atomic_fetch_add(&shared->refs, 1, __ATOMIC_RELAXED);
+    return shared;
+}
 
-    push(DECL_OBJ_VAL(new_str)); // fix GC bug
-    insert(&vm.strings, new_str, DECL_NONE_VAL);
-    pop(); // fix GC bug
+void release_shared_str(SharedStr_t *shared) {
+    if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (shared->slot >= 0) {
+            retire_shared_str(shared);
+        } else {
+            free(shared);
+        }
+    }
+}
 
-    return new_str;
+ObjectStr_t *adopt_shared_str(SharedStr_t *shared) {
+    ObjectStr_t *interned =
+        find_str(&cur_vm->strings, shared->chars, shared->length, shared->hash);
+    if (interned != NULL) {
+        release_shared_str(shared);
+        return interned;
+    }
+    if (share_strings && shared->slot < 0) {
+        SharedStr_t *common = intern_shared_str(shared->chars, shared->length, shared->hash);
+        if (common != NULL) {
+            release_shared_str(shared);
+            shared = common;
+        }
+    }
+    if (shared->slot < 0 && shared->length < SHARED_STR_MIN) {
+        // short strings outside of the process-wide table stay inline
+        ObjectStr_t *str = intern_str(shared->chars, shared->length, shared->hash, NULL);
+        release_shared_str(shared);
+        return str;
+    }
+    return intern_str(shared->chars, shared->length, shared->hash, shared);
 }
 
 ObjectFunc_t *create_func() {
@@ -53,33 +123,34 @@ ObjectFunc_t *create_func() {
     new_func->num_params = 0;
     new_func->name = NULL;
     init_chunk(&new_func->chunk);
+    new_func->reg_chunk = NULL;
+    new_func->profile_idx = -1;
+    new_func->shared_closure = NULL;
     new_func->upvalue_cnt = 0;
     return new_func;
 }
 
-ObjectNative_t *create_native(NativeFunc_t func) {
+ObjectNative_t *create_native(NativeFunc_t func, int arity) {
     ObjectNative_t *native = ALLOCATE_OBJ(ObjectNative_t, OBJ_NATIVE);
     native->func = func;
+    native->arity = arity;
     return native;
 }
 
 ObjectClosure_t *create_closure(ObjectFunc_t *func) {
-    ObjectUpvalue_t **upvalues = ALLOCATE(ObjectUpvalue_t *, func->upvalue_cnt);
-    for (int i = 0; i < func->upvalue_cnt; i++) {
-        upvalues[i] = NULL;
-    }
-
-    ObjectClosure_t *closure = ALLOCATE_OBJ(ObjectClosure_t, OBJ_CLOSURE);
+    ObjectClosure_t *closure = (ObjectClosure_t *)allocate_object(
+        sizeof(ObjectClosure_t) + sizeof(ObjectUpvalue_t *) * func->upvalue_cnt, OBJ_CLOSURE);
     closure->func = func;
-    closure->upvalues = upvalues;
     closure->upvalue_cnt = func->upvalue_cnt;
+    for (int i = 0; i < func->upvalue_cnt; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
 ObjectUpvalue_t *create_upvalue(Value_t *slot) {
     ObjectUpvalue_t *upvalue = ALLOCATE_OBJ(ObjectUpvalue_t, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
     upvalue->closed = DECL_NONE_VAL;
     return upvalue;
 }
@@ -88,6 +159,8 @@ ObjectClass_t *create_class(ObjectStr_t *name) {
     ObjectClass_t *new_class = ALLOCATE_OBJ(ObjectClass_t, OBJ_CLASS);
     new_class->name = name;
     init_hash_table(&new_class->methods);
+    new_class->initializer = NULL;
+    new_class->field_cnt = 0;
     return new_class;
 }
 
@@ -96,6 +169,9 @@ ObjectInstance_t *create_instance(ObjectClass_t *class_) {
         ALLOCATE_OBJ(ObjectInstance_t, OBJ_INSTANCE);
     new_instance->class_ = class_;
     init_hash_table(&new_instance->fields);
+    push(DECL_OBJ_VAL(new_instance)); // reserving fields can collect
+    reserve_table(&new_instance->fields, class_->field_cnt);
+    pop();
     return new_instance;
 }
 
@@ -107,3 +183,49 @@ ObjectBoundMethod_t *create_bound_method(Value_t receiver,
     new_bound->method = method;
     return new_bound;
 }
+
+ObjectList_t *create_list() {
+    ObjectList_t *new_list = ALLOCATE_OBJ(ObjectList_t, OBJ_LIST);
+    init_value_array(&new_list->items);
+    return new_list;
+}
+
+ObjectFloat64Array_t *create_f64_array(int length) {
+    ObjectFloat64Array_t *new_array = (ObjectFloat64Array_t *)allocate_object(
+        sizeof(ObjectFloat64Array_t) + sizeof(double) * length, OBJ_F64_ARRAY);
+    new_array->length = length;
+    memset(new_array->data, 0, sizeof(double) * length);
+    return new_array;
+}
+
+ObjectMap_t *create_map() {
+    ObjectMap_t *new_map = ALLOCATE_OBJ(ObjectMap_t, OBJ_MAP);
+    init_value_table(&new_map->entries);
+    return new_map;
+}
+
+ObjectFiber_t *create_fiber(ObjectClosure_t *closure) {
+    ObjectFiber_t *new_fiber = ALLOCATE_OBJ(ObjectFiber_t, OBJ_FIBER);
+    new_fiber->closure = closure;
+    new_fiber->state = FIBER_NEW;
+    new_fiber->is_task = false;
+    new_fiber->caller = NULL;
+    new_fiber->stack_base = 0;
+    new_fiber->frame_base = 0;
+    new_fiber->stack = NULL;
+    new_fiber->stack_cnt = 0;
+    new_fiber->stack_capacity = 0;
+    new_fiber->frames = NULL;
+    new_fiber->frame_cnt = 0;
+    new_fiber->frame_capacity = 0;
+    new_fiber->upvalues = NULL;
+    new_fiber->upvalue_cnt = 0;
+    new_fiber->upvalue_capacity = 0;
+    return new_fiber;
+}
+
+ObjectIsolate_t *create_isolate_handle(Isolate_t *isolate) {
+    ObjectIsolate_t *handle = ALLOCATE_OBJ(ObjectIsolate_t, OBJ_ISOLATE);
+    handle->isolate = isolate;
+    return handle;
+}
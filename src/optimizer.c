@@ -0,0 +1,526 @@
+#include "../includes/optimizer.h"
+#include "../includes/memory.h"
+
+/*
+ * Peephole pass run on every finished chunk. Short opcode sequences are
+ * rewritten into superinstructions, then branch offsets and line runs are
+ * rebuilt for the shorter code. A sequence is only fused when no branch lands
+ * inside it (landing on its first instruction is fine).
+ */
+
+typedef struct {
+    Chunk_t *chunk;
+    int *starts; // offsets of the next few instructions from the cursor
+    int count;   // how many of them were decoded
+} Window_t;
+
+// opcodes at window positions 0..n-1 match and nothing jumps into positions 1..n-1
+static bool window_matches(Window_t *window, bool *is_target, const uint8_t *ops, int n) {
+    if (window->count < n) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        int offset = window->starts[i];
+        if (window->chunk->code[offset] != ops[i] || (i > 0 && is_target[offset])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void optimize_chunk(Chunk_t *chunk) {
+    int n = chunk->count;
+    if (n == 0) {
+        return;
+    }
+    uint8_t *code = chunk->code;
+
+    // expand line runs so each byte knows its own line
+    int *lines = ALLOCATE(int, n);
+    int byte = 0;
+    for (int i = 0; i < chunk->line_runs.count; i++) {
+        for (int j = 0; j < chunk->line_runs.line_runs[i].count && byte < n; j++) {
+            lines[byte++] = chunk->line_runs.line_runs[i].line;
+        }
+    }
+
+    bool *is_target = calloc(n + 1, sizeof(bool));
+    for (int offset = 0; offset < n; offset += instruction_length(chunk, offset)) {
+        if (is_branch(code[offset])) {
+            is_target[branch_target(chunk, offset)] = true;
+        }
+    }
+
+    uint8_t *out = ALLOCATE(uint8_t, n);
+    int *out_lines = ALLOCATE(int, n);
+    int *new_offset = ALLOCATE(int, n + 1);
+    int *old_branches = ALLOCATE(int, n); // old offsets of branches in emitted order
+    int *new_branches = ALLOCATE(int, n);
+    int branch_cnt = 0;
+    int out_len = 0;
+
+    int starts[5];
+    Window_t window = {chunk, starts, 0};
+
+    static const uint8_t inc_local[] = {OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP};
+    static const uint8_t less_jump[] = {OP_GET_LOCAL, OP_CONSTANT, OP_LESS_THAN,
+                                        OP_BRANCH_IF_FALSE, OP_POP};
+    static const uint8_t add_locals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+    static const uint8_t not_equal[] = {OP_EQUAL, OP_NOT};
+    static const uint8_t less_equal[] = {OP_GREATER_THAN, OP_NOT};
+    static const uint8_t greater_equal[] = {OP_LESS_THAN, OP_NOT};
+
+    int offset = 0;
+    while (offset < n) {
+        window.count = 0;
+        for (int at = offset; at < n && window.count < 5; at += instruction_length(chunk, at)) {
+            starts[window.count++] = at;
+        }
+
+        int consumed = 1; // number of original instructions replaced
+        int start = out_len;
+        new_offset[offset] = out_len;
+
+        if (window_matches(&window, is_target, inc_local, 5) &&
+            code[starts[0] + 1] == code[starts[3] + 1]) {
+            out[out_len++] = OP_INC_LOCAL;
+            out[out_len++] = code[starts[0] + 1];
+            out[out_len++] = code[starts[1] + 1];
+            consumed = 5;
+        } else if (window_matches(&window, is_target, less_jump, 5)) {
+            out[out_len++] = OP_LESS_LOCAL_CONST_JUMP;
+            out[out_len++] = code[starts[0] + 1];
+            out[out_len++] = code[starts[1] + 1];
+            old_branches[branch_cnt] = starts[3];
+            new_branches[branch_cnt++] = start;
+            out[out_len++] = 0xff; // patched below
+            out[out_len++] = 0xff;
+            consumed = 5;
+        } else if (window_matches(&window, is_target, add_locals, 3)) {
+            out[out_len++] = OP_ADD_LOCALS;
+            out[out_len++] = code[starts[0] + 1];
+            out[out_len++] = code[starts[1] + 1];
+            consumed = 3;
+        } else if (window_matches(&window, is_target, not_equal, 2)) {
+            out[out_len++] = OP_NOT_EQUAL;
+            consumed = 2;
+        } else if (window_matches(&window, is_target, less_equal, 2)) {
+            out[out_len++] = OP_LESS_EQUAL;
+            consumed = 2;
+        } else if (window_matches(&window, is_target, greater_equal, 2)) {
+            out[out_len++] = OP_GREATER_EQUAL;
+            consumed = 2;
+        } else {
+            int len = instruction_length(chunk, offset);
+            if (is_branch(code[offset])) {
+                old_branches[branch_cnt] = offset;
+                new_branches[branch_cnt++] = start;
+            }
+            memcpy(out + out_len, code + offset, len);
+            out_len += len;
+        }
+
+        // fused code reports the line of the first instruction it replaced
+        for (int i = start; i < out_len; i++) {
+            out_lines[i] = lines[offset];
+        }
+        offset = consumed < window.count ? starts[consumed]
+                                         : starts[window.count - 1] +
+                                               instruction_length(chunk, starts[window.count - 1]);
+    }
+    new_offset[n] = out_len;
+
+    // code only ever shrinks so every rewritten offset still fits in 16 bits
+    for (int i = 0; i < branch_cnt; i++) {
+        int old_target = branch_target(chunk, old_branches[i]);
+        int at = new_branches[i];
+        int end = at + (out[at] == OP_LESS_LOCAL_CONST_JUMP ? 5 : 3);
+        int jump = out[at] == OP_LOOP ? end - new_offset[old_target] : new_offset[old_target] - end;
+        out[end - 2] = (jump >> 8) & 0xff;
+        out[end - 1] = jump & 0xff;
+    }
+
+    memcpy(chunk->code, out, out_len);
+    chunk->count = out_len;
+    chunk->line_runs.count = 0;
+    for (int i = 0; i < out_len; i++) {
+        write_line_array(&chunk->line_runs, (LineRun_t){.line = out_lines[i], .count = 1});
+    }
+
+    free(lines);
+    free(is_target);
+    free(out);
+    free(out_lines);
+    free(new_offset);
+    free(old_branches);
+    free(new_branches);
+}
+
+/*
+ * Type inference pass run after the peephole pass. It walks the code as a
+ * stack machine over types: every frame slot, locals and temporaries alike,
+ * either provably holds a number or is unknown. States meeting at a branch
+ * target are merged and the walk repeats until no loop widens its header
+ * again, then arithmetic and comparisons whose operands are both proven
+ * numbers are rewritten in place into their unchecked _NN forms.
+ *
+ * A slot captured by a closure can be written behind the function's back (an
+ * upvalue or an enclosing-slot write from a local func), so it is never proven,
+ * whatever it is declared or assigned with.
+ */
+
+#define MAX_TYPED_SLOTS 1024
+
+typedef enum { TYPE_UNKNOWN, TYPE_NUMBER } SlotType_t;
+
+typedef struct {
+    int depth; // -1 until some path reaches it
+    uint8_t types[MAX_TYPED_SLOTS];
+} TypeState_t;
+
+typedef struct {
+    Chunk_t *chunk;
+    bool captured[MAX_TYPED_SLOTS];
+    int *state_of;       // branch target offset -> its entry in states, -1 elsewhere
+    TypeState_t *states; // merged state on arrival at each branch target
+    TypeState_t cur;
+    bool rewrite;  // the final walk swaps in unchecked ops
+    int *depth_at; // if set the final walk records the depth before each instruction
+    bool widened;  // a backward branch changed its target, walk again
+    bool failed;   // the model broke down, nothing gets rewritten
+} Inference_t;
+
+// true if into changed
+static bool merge_state(Inference_t *inf, TypeState_t *into, TypeState_t *from) {
+    if (from->depth == -1) {
+        return false;
+    }
+    if (into->depth == -1) {
+        into->depth = from->depth;
+        memcpy(into->types, from->types, from->depth);
+        return true;
+    }
+    if (into->depth != from->depth) {
+        inf->failed = true;
+        return false;
+    }
+    bool changed = false;
+    for (int i = 0; i < into->depth; i++) {
+        if (into->types[i] == TYPE_NUMBER && from->types[i] != TYPE_NUMBER) {
+            into->types[i] = TYPE_UNKNOWN;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void push_type(Inference_t *inf, SlotType_t type) {
+    if (inf->cur.depth >= MAX_TYPED_SLOTS) {
+        inf->failed = true;
+        return;
+    }
+    // a captured local is pushed by its declaration, so it starts out unknown
+    int slot = inf->cur.depth++;
+    inf->cur.types[slot] = inf->captured[slot] ? TYPE_UNKNOWN : type;
+}
+
+static void pop_types(Inference_t *inf, int count) {
+    inf->cur.depth -= count;
+    if (inf->cur.depth < 0) {
+        inf->failed = true;
+        inf->cur.depth = 0;
+    }
+}
+
+static SlotType_t top_type(Inference_t *inf, int distance) {
+    int slot = inf->cur.depth - 1 - distance;
+    return slot >= 0 ? inf->cur.types[slot] : TYPE_UNKNOWN;
+}
+
+static SlotType_t slot_type(Inference_t *inf, int slot) {
+    if (slot >= inf->cur.depth) {
+        inf->failed = true;
+        return TYPE_UNKNOWN;
+    }
+    return inf->captured[slot] ? TYPE_UNKNOWN : inf->cur.types[slot];
+}
+
+static void set_slot_type(Inference_t *inf, int slot, SlotType_t type) {
+    if (slot >= inf->cur.depth) {
+        inf->failed = true;
+        return;
+    }
+    inf->cur.types[slot] = inf->captured[slot] ? TYPE_UNKNOWN : type;
+}
+
+static SlotType_t constant_type(Inference_t *inf, int idx) {
+    return IS_NUMERIC_VAL(inf->chunk->constants.values[idx]) ? TYPE_NUMBER : TYPE_UNKNOWN;
+}
+
+static void branch_from(Inference_t *inf, int offset) {
+    int target = branch_target(inf->chunk, offset);
+    if (merge_state(inf, &inf->states[inf->state_of[target]], &inf->cur) && target <= offset) {
+        inf->widened = true;
+    }
+}
+
+// rewrites the op at offset into unchecked when both operands are numbers
+static void numeric_binary(Inference_t *inf, int offset, uint8_t unchecked,
+                           SlotType_t if_numbers, SlotType_t otherwise, bool final) {
+    bool numbers = top_type(inf, 0) == TYPE_NUMBER && top_type(inf, 1) == TYPE_NUMBER;
+    if (numbers && final && inf->rewrite) {
+        inf->chunk->code[offset] = unchecked;
+    }
+    pop_types(inf, 2);
+    push_type(inf, numbers ? if_numbers : otherwise);
+}
+
+static int long_operand(uint8_t *code) {
+    return code[0] | (code[1] << 8) | (code[2] << 16);
+}
+
+static void step(Inference_t *inf, int offset, bool final) {
+    uint8_t *code = inf->chunk->code + offset;
+    switch ((OpCode_t)code[0]) {
+        case OP_CONSTANT:
+            push_type(inf, constant_type(inf, code[1]));
+            break;
+        case OP_CONSTANT_LONG:
+            push_type(inf, constant_type(inf, long_operand(code + 1)));
+            break;
+        case OP_NONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_CLOSURE:
+        case OP_STACK_CLOSURE:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_NOT:
+        case OP_GET_PROPERTY:
+            pop_types(inf, 1);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        // these raise an error unless the result is a number
+        case OP_NEGATE:
+            pop_types(inf, 1);
+            push_type(inf, TYPE_NUMBER);
+            break;
+        case OP_MOD:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            pop_types(inf, 2);
+            push_type(inf, TYPE_NUMBER);
+            break;
+        case OP_ADD:
+        case OP_ADD_NN:
+            numeric_binary(inf, offset, OP_ADD_NN, TYPE_NUMBER, TYPE_UNKNOWN, final);
+            break;
+        case OP_SUB:
+        case OP_SUB_NN:
+            numeric_binary(inf, offset, OP_SUB_NN, TYPE_NUMBER, TYPE_NUMBER, final);
+            break;
+        case OP_MUL:
+        case OP_MUL_NN:
+            numeric_binary(inf, offset, OP_MUL_NN, TYPE_NUMBER, TYPE_NUMBER, final);
+            break;
+        case OP_DIV:
+        case OP_DIV_NN:
+            numeric_binary(inf, offset, OP_DIV_NN, TYPE_NUMBER, TYPE_NUMBER, final);
+            break;
+        case OP_LESS_THAN:
+        case OP_LESS_NN:
+            numeric_binary(inf, offset, OP_LESS_NN, TYPE_UNKNOWN, TYPE_UNKNOWN, final);
+            break;
+        case OP_GREATER_THAN:
+        case OP_GREATER_NN:
+            numeric_binary(inf, offset, OP_GREATER_NN, TYPE_UNKNOWN, TYPE_UNKNOWN, final);
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NN:
+            numeric_binary(inf, offset, OP_LESS_EQUAL_NN, TYPE_UNKNOWN, TYPE_UNKNOWN, final);
+            break;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NN:
+            numeric_binary(inf, offset, OP_GREATER_EQUAL_NN, TYPE_UNKNOWN, TYPE_UNKNOWN, final);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_INDEX_GET:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+            pop_types(inf, 2);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_INDEX_SET:
+            pop_types(inf, 3);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_CLOSE_UPVALUE:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_INHERIT:
+            pop_types(inf, 1);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_SET_ENCLOSING:
+            break;
+        case OP_GET_LOCAL:
+            push_type(inf, slot_type(inf, code[1]));
+            break;
+        case OP_GET_LOCAL_LONG:
+            push_type(inf, slot_type(inf, long_operand(code + 1)));
+            break;
+        case OP_SET_LOCAL:
+            set_slot_type(inf, code[1], top_type(inf, 0));
+            break;
+        case OP_SET_LOCAL_LONG:
+            set_slot_type(inf, long_operand(code + 1), top_type(inf, 0));
+            break;
+        case OP_BRANCH_IF_FALSE:
+            branch_from(inf, offset);
+            break;
+        case OP_BRANCH:
+        case OP_LOOP:
+            branch_from(inf, offset);
+            inf->cur.depth = -1;
+            break;
+        case OP_RETURN:
+            inf->cur.depth = -1;
+            break;
+        case OP_CALL:
+            pop_types(inf, code[1] + 1);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_INVOKE:
+            pop_types(inf, code[2] + 1);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_SUPER_INVOKE: // the superclass sits above the arguments
+            pop_types(inf, code[2] + 2);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_SUPER_INVOKE_LONG:
+            pop_types(inf, code[4] + 2);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_BUILD_LIST:
+            pop_types(inf, code[1]);
+            push_type(inf, TYPE_UNKNOWN);
+            break;
+        case OP_ADD_LOCALS: {
+            bool numbers = slot_type(inf, code[1]) == TYPE_NUMBER &&
+                           slot_type(inf, code[2]) == TYPE_NUMBER;
+            push_type(inf, numbers ? TYPE_NUMBER : TYPE_UNKNOWN);
+            break;
+        }
+        case OP_INC_LOCAL: {
+            bool numbers = slot_type(inf, code[1]) == TYPE_NUMBER &&
+                           constant_type(inf, code[2]) == TYPE_NUMBER;
+            set_slot_type(inf, code[1], numbers ? TYPE_NUMBER : TYPE_UNKNOWN);
+            break;
+        }
+        case OP_LESS_LOCAL_CONST_JUMP:
+            // only the taken branch leaves the condition for its target to pop
+            push_type(inf, TYPE_UNKNOWN);
+            branch_from(inf, offset);
+            pop_types(inf, 1);
+            break;
+    }
+}
+
+// one walk over the code, returns true if a loop header was widened
+static bool walk(Inference_t *inf, int num_params, bool final) {
+    Chunk_t *chunk = inf->chunk;
+    inf->widened = false;
+    inf->cur.depth = num_params + 1;
+    memset(inf->cur.types, TYPE_UNKNOWN, inf->cur.depth);
+    for (int offset = 0; offset < chunk->count && !inf->failed;
+         offset += instruction_length(chunk, offset)) {
+        if (inf->state_of[offset] != -1) {
+            TypeState_t *state = &inf->states[inf->state_of[offset]];
+            merge_state(inf, state, &inf->cur);
+            inf->cur.depth = state->depth;
+            memcpy(inf->cur.types, state->types, state->depth == -1 ? 0 : state->depth);
+        }
+        if (final && inf->depth_at != NULL) {
+            inf->depth_at[offset] = inf->cur.depth;
+        }
+        if (inf->cur.depth != -1) {
+            step(inf, offset, final);
+        }
+    }
+    return inf->widened;
+}
+
+static bool infer(Chunk_t *chunk, int num_params, bool rewrite, int *depth_at) {
+    int n = chunk->count;
+    if (n == 0 || num_params + 1 > MAX_TYPED_SLOTS) {
+        return false;
+    }
+    uint8_t *code = chunk->code;
+
+    Inference_t *inf = calloc(1, sizeof(Inference_t));
+    inf->chunk = chunk;
+    inf->rewrite = rewrite;
+    inf->depth_at = depth_at;
+    inf->state_of = ALLOCATE(int, n + 1);
+    for (int i = 0; i <= n; i++) {
+        inf->state_of[i] = -1;
+    }
+    int state_cnt = 0;
+    for (int offset = 0; offset < n; offset += instruction_length(chunk, offset)) {
+        if (is_branch(code[offset]) && inf->state_of[branch_target(chunk, offset)] == -1) {
+            inf->state_of[branch_target(chunk, offset)] = state_cnt++;
+        }
+        if (code[offset] == OP_CLOSURE || code[offset] == OP_STACK_CLOSURE) {
+            int end = offset + instruction_length(chunk, offset);
+            for (int at = offset + 2; at < end; at += 2) {
+                if (code[at]) { // is_local, idx
+                    inf->captured[code[at + 1]] = true;
+                }
+            }
+        }
+    }
+    inf->states = ALLOCATE(TypeState_t, state_cnt);
+    for (int i = 0; i < state_cnt; i++) {
+        inf->states[i].depth = -1;
+    }
+
+    while (walk(inf, num_params, false) && !inf->failed) {
+    }
+    if (!inf->failed) {
+        walk(inf, num_params, true);
+    }
+    bool ok = !inf->failed;
+
+    free(inf->state_of);
+    free(inf->states);
+    free(inf);
+    return ok;
+}
+
+void infer_types(Chunk_t *chunk, int num_params) {
+    infer(chunk, num_params, true, NULL);
+}
+
+// fills depth_at with the stack depth before each instruction of chunk, -1 where
+// it is unreachable, returns false if the depths could not be worked out
+bool stack_depths(Chunk_t *chunk, int num_params, int *depth_at) {
+    return infer(chunk, num_params, false, depth_at);
+}
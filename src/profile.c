@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+
+#include "../includes/profile.h"
+#include "../includes/debug.h"
+#include "../includes/memory.h"
+#include "../includes/register.h"
+#include "../includes/vm.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define CYCLE_UNIT "tsc"
+static inline uint64_t read_cycles() {
+    return __rdtsc();
+}
+#else
+#define CYCLE_UNIT "ns"
+static inline uint64_t read_cycles() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+#define TOP_PAIRS 20
+
+Profile_t *create_profile(const char *json_path) {
+    Profile_t *profile = (Profile_t *)calloc(1, sizeof(Profile_t));
+    if (profile == NULL) {
+        exit(1);
+    }
+    profile->prev_op = -1;
+    profile->countdown = 16;
+    profile->rng = 0x853c49e6748fea9bu;
+    profile->sample_op = -1;
+    profile->json_path = json_path == NULL ? NULL : strdup(json_path);
+    return profile;
+}
+
+void free_profile(Profile_t *profile) {
+    for (int i = 0; i < profile->func_cnt; i++) {
+        free(profile->funcs[i].name);
+    }
+    free(profile->funcs);
+    free(profile->json_path);
+    free(profile);
+}
+
+void add_func_profile(Profile_t *profile, ObjectFunc_t *func) {
+    if (profile->func_cnt == profile->func_capacity) {
+        profile->func_capacity = grow_capacity(profile->func_capacity);
+        profile->funcs = (FuncProfile_t *)realloc(profile->funcs,
+                                                  sizeof(FuncProfile_t) * profile->func_capacity);
+        if (profile->funcs == NULL) {
+            exit(1);
+        }
+    }
+    const char *name = func->name == NULL ? "script" : func->name->chars;
+    profile->funcs[profile->func_cnt] = (FuncProfile_t){strdup(name), 0, 0, 0};
+    func->profile_idx = profile->func_cnt++;
+}
+
+void profile_instruction(Profile_t *profile, uint8_t op, ObjectFunc_t *func) {
+    if (profile->sample_op >= 0) {
+        uint64_t cycles = read_cycles() - profile->sample_start;
+        profile->cycles[profile->sample_op] += cycles;
+        profile->samples[profile->sample_op]++;
+        profile->funcs[profile->sample_func].cycles += cycles;
+        profile->funcs[profile->sample_func].samples++;
+        profile->sample_op = -1;
+    }
+    profile->counts[op]++;
+    if (profile->prev_op >= 0) {
+        profile->pairs[profile->prev_op][op]++;
+    }
+    profile->prev_op = op;
+    if (func->profile_idx < 0) {
+        add_func_profile(profile, func);
+    }
+    profile->funcs[func->profile_idx].instructions++;
+    if (--profile->countdown == 0) {
+        profile->rng = profile->rng * 6364136223846793005u + 1442695040888963407u;
+        profile->countdown = 1 + (uint32_t)(profile->rng >> 59); // 1 to 32
+        profile->sample_op = op;
+        profile->sample_func = func->profile_idx;
+        profile->sample_start = read_cycles();
+    }
+}
+
+// the sampled cost per instruction times how often it ran
+static double estimate(uint64_t cycles, uint64_t samples, uint64_t count) {
+    return samples == 0 ? 0 : (double)cycles / samples * count;
+}
+
+static Profile_t *sorting; // what the comparators below look at
+
+static int by_count(const void *a, const void *b) {
+    uint64_t x = sorting->counts[*(const int *)a];
+    uint64_t y = sorting->counts[*(const int *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int by_pair_count(const void *a, const void *b) {
+    uint64_t x = sorting->pairs[0][*(const int *)a];
+    uint64_t y = sorting->pairs[0][*(const int *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double func_cost(FuncProfile_t *func) {
+    return estimate(func->cycles, func->samples, func->instructions);
+}
+
+static int by_func_cost(const void *a, const void *b) {
+    double x = func_cost(&sorting->funcs[*(const int *)a]);
+    double y = func_cost(&sorting->funcs[*(const int *)b]);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void write_json(Profile_t *profile, FILE *out, uint64_t total) {
+    fprintf(out, "{\n  \"unit\": \"%s\",\n  \"instructions\": %llu,\n  \"opcodes\": [", CYCLE_UNIT,
+            (unsigned long long)total);
+    bool first = true;
+    for (int op = 0; op < OP_CODE_CNT; op++) {
+        if (profile->counts[op] == 0) {
+            continue;
+        }
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"count\": %llu, \"samples\": %llu, "
+                "\"sampled_cycles\": %llu, \"estimated_cycles\": %.0f}",
+                first ? "" : ",", opcode_name(op), (unsigned long long)profile->counts[op],
+                (unsigned long long)profile->samples[op], (unsigned long long)profile->cycles[op],
+                estimate(profile->cycles[op], profile->samples[op], profile->counts[op]));
+        first = false;
+    }
+    fprintf(out, "\n  ],\n  \"pairs\": [");
+    first = true;
+    for (int a = 0; a < OP_CODE_CNT; a++) {
+        for (int b = 0; b < OP_CODE_CNT; b++) {
+            if (profile->pairs[a][b] == 0) {
+                continue;
+            }
+            fprintf(out, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+                    first ? "" : ",", opcode_name(a), opcode_name(b),
+                    (unsigned long long)profile->pairs[a][b]);
+            first = false;
+        }
+    }
+    fprintf(out, "\n  ],\n  \"functions\": [");
+    for (int i = 0; i < profile->func_cnt; i++) {
+        FuncProfile_t *func = &profile->funcs[i];
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"instructions\": %llu, \"samples\": %llu, "
+                "\"sampled_cycles\": %llu, \"estimated_cycles\": %.0f}",
+                i > 0 ? "," : "", func->name, (unsigned long long)func->instructions,
+                (unsigned long long)func->samples, (unsigned long long)func->cycles,
+                func_cost(func));
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void report_profile(Profile_t *profile, FILE *out) {
+    uint64_t total = 0;
+    double total_cost = 0;
+    int ops[OP_CODE_CNT];
+    for (int op = 0; op < OP_CODE_CNT; op++) {
+        ops[op] = op;
+        total += profile->counts[op];
+        total_cost += estimate(profile->cycles[op], profile->samples[op], profile->counts[op]);
+    }
+    if (total == 0) {
+        fprintf(out, "profile: no stack VM instructions ran\n");
+        return;
+    }
+    sorting = profile;
+
+    fprintf(out, "%-26s %14s %7s %10s %7s\n", "opcode", "count", "count%", CYCLE_UNIT "/op",
+            "cost%");
+    qsort(ops, OP_CODE_CNT, sizeof(int), by_count);
+    for (int i = 0; i < OP_CODE_CNT && profile->counts[ops[i]] > 0; i++) {
+        int op = ops[i];
+        double cost = estimate(profile->cycles[op], profile->samples[op], profile->counts[op]);
+        fprintf(out, "%-26s %14llu %6.2f%% %10.1f %6.2f%%\n", opcode_name(op),
+                (unsigned long long)profile->counts[op], 100.0 * profile->counts[op] / total,
+                profile->samples[op] == 0 ? 0 : (double)profile->cycles[op] / profile->samples[op],
+                total_cost == 0 ? 0 : 100.0 * cost / total_cost);
+    }
+
+    // pairs are ranked through a flat index into the [previous][current] table
+    int *pairs = (int *)malloc(sizeof(int) * OP_CODE_CNT * OP_CODE_CNT);
+    for (int i = 0; i < OP_CODE_CNT * OP_CODE_CNT; i++) {
+        pairs[i] = i;
+    }
+    qsort(pairs, OP_CODE_CNT * OP_CODE_CNT, sizeof(int), by_pair_count);
+    fprintf(out, "\n%-53s %14s %7s\n", "opcode pair", "count", "count%");
+    for (int i = 0; i < TOP_PAIRS && profile->pairs[0][pairs[i]] > 0; i++) {
+        int a = pairs[i] / OP_CODE_CNT;
+        int b = pairs[i] % OP_CODE_CNT;
+        fprintf(out, "%-26s %-26s %14llu %6.2f%%\n", opcode_name(a), opcode_name(b),
+                (unsigned long long)profile->pairs[a][b], 100.0 * profile->pairs[a][b] / total);
+    }
+    free(pairs);
+
+    int *funcs = (int *)malloc(sizeof(int) * (profile->func_cnt + 1));
+    for (int i = 0; i < profile->func_cnt; i++) {
+        funcs[i] = i;
+    }
+    qsort(funcs, profile->func_cnt, sizeof(int), by_func_cost);
+    fprintf(out, "\n%-26s %14s %16s %7s\n", "function", "instructions", CYCLE_UNIT " (self)",
+            "cost%");
+    for (int i = 0; i < profile->func_cnt; i++) {
+        FuncProfile_t *func = &profile->funcs[funcs[i]];
+        fprintf(out, "%-26s %14llu %16.0f %6.2f%%\n", func->name,
+                (unsigned long long)func->instructions, func_cost(func),
+                total_cost == 0 ? 0 : 100.0 * func_cost(func) / total_cost);
+    }
+    free(funcs);
+
+    if (profile->json_path != NULL) {
+        FILE *json = fopen(profile->json_path, "w");
+        if (json == NULL) {
+            fprintf(stderr, "Error: cannot write profile \"%s\"\n", profile->json_path);
+            return;
+        }
+        write_json(profile, json, total);
+        fclose(json);
+    }
+}
+
+/*
+ * Sampler: a SIGPROF handler copies every frame of the running vm into a ring,
+ * as the function and the offset of the instruction it is on. The handler
+ * cannot allocate, so turning those into folded stacks waits for
+ * drain_samples(), which the next collection or the report calls. A sample
+ * that does not fit in the ring, or lands while it is drained, is dropped.
+ *
+ * call_closure() and resume_fiber() fill frames in before counting them, so
+ * every frame below frame_cnt is whole whenever the handler looks.
+ */
+
+#define SAMPLE_RING_SIZE (1 << 16)
+#ifndef sigev_notify_thread_id // glibc only names it from 2.41
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define MAX_INLINE_DEPTH 16
+
+typedef struct {
+    ObjectFunc_t *func; // NULL heading a sample, then instruction is its depth
+    int instruction;
+} SampleFrame_t;
+
+typedef struct {
+    char *stack; // NULL if the slot is free
+    uint32_t hash;
+    uint64_t count;
+} FoldedStack_t;
+
+struct Sampler_t {
+    char *path;
+    int hz;
+    timer_t timer;
+    bool is_running;
+    SampleFrame_t *ring;
+    volatile sig_atomic_t ring_cnt;
+    volatile sig_atomic_t is_draining;
+    volatile sig_atomic_t dropped;
+    uint64_t sample_cnt;
+    FoldedStack_t *stacks; // open addressing on the hash of the folded stack
+    int stack_cnt;
+    int stack_capacity;
+    char *folded; // the stack being folded
+    size_t folded_capacity;
+};
+
+Sampler_t *create_sampler(const char *path, int hz) {
+    Sampler_t *sampler = (Sampler_t *)calloc(1, sizeof(Sampler_t));
+    if (sampler == NULL) {
+        exit(1);
+    }
+    sampler->ring = (SampleFrame_t *)malloc(sizeof(SampleFrame_t) * SAMPLE_RING_SIZE);
+    if (sampler->ring == NULL) {
+        exit(1);
+    }
+    sampler->path = strdup(path);
+    sampler->hz = hz;
+    return sampler;
+}
+
+void free_sampler(Sampler_t *sampler) {
+    if (sampler->is_running) {
+        timer_delete(sampler->timer);
+    }
+    for (int i = 0; i < sampler->stack_capacity; i++) {
+        free(sampler->stacks[i].stack);
+    }
+    free(sampler->stacks);
+    free(sampler->folded);
+    free(sampler->ring);
+    free(sampler->path);
+    free(sampler);
+}
+
+static void on_sample(int signal, siginfo_t *info, void *context) {
+    vm_t *vm = cur_vm;
+    if (vm == NULL || vm->sampler == NULL || vm->frame_cnt == 0) {
+        return; // compiling, or between scripts
+    }
+    Sampler_t *sampler = vm->sampler;
+    int depth = vm->frame_cnt;
+    if (sampler->is_draining || sampler->ring_cnt + depth + 1 > SAMPLE_RING_SIZE) {
+        sampler->dropped++;
+        return;
+    }
+
+    SampleFrame_t *sample = &sampler->ring[sampler->ring_cnt];
+    sample[0] = (SampleFrame_t){NULL, depth};
+    for (int i = 0; i < depth; i++) {
+        CallFrame_t *frame = &vm->frames[i];
+        ObjectFunc_t *func = frame->closure->func;
+        // pc may trail the instruction being run, never leave its chunk
+        int instruction;
+        if (frame->reg_pc != NULL) {
+            int word = (int)(frame->reg_pc - func->reg_chunk->code) - 1;
+            instruction = word >= 0 && word < func->reg_chunk->count
+                              ? func->reg_chunk->origins[word]
+                              : 0;
+        } else {
+            instruction = (int)(frame->pc - func->chunk.code) - 1;
+        }
+        if (instruction < 0 || instruction >= func->chunk.count) {
+            instruction = 0;
+        }
+        sample[i + 1] = (SampleFrame_t){func, instruction};
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    sampler->ring_cnt += depth + 1;
+}
+
+bool start_sampler(Sampler_t *sampler) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    // a timer on the thread's own CPU clock, so the signal lands on the
+    // thread running the vm and time spent blocked is never sampled
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler->timer) < 0) {
+        fprintf(stderr, "Error: cannot start the sampler: %s\n", strerror(errno));
+        return false;
+    }
+    long interval = 1000000000L / sampler->hz;
+    struct itimerspec spec = {{interval / 1000000000L, interval % 1000000000L},
+                              {interval / 1000000000L, interval % 1000000000L}};
+    timer_settime(sampler->timer, 0, &spec, NULL);
+    sampler->is_running = true;
+    return true;
+}
+
+static void append_frame(Sampler_t *sampler, size_t *size, const char *name, int line) {
+    size_t needed = *size + strlen(name) + 16;
+    if (needed > sampler->folded_capacity) {
+        sampler->folded_capacity = needed * 2;
+        sampler->folded = (char *)realloc(sampler->folded, sampler->folded_capacity);
+        if (sampler->folded == NULL) {
+            exit(1);
+        }
+    }
+    *size += sprintf(sampler->folded + *size, "%s%s:%d", *size == 0 ? "" : ";", name, line);
+}
+
+// a frame inside inlined code stands for the calls the inliner replaced too,
+// the same ones a stack trace shows
+static void append_func(Sampler_t *sampler, size_t *size, ObjectFunc_t *func, int instruction) {
+    const char *names[MAX_INLINE_DEPTH + 1];
+    int lines[MAX_INLINE_DEPTH + 1];
+    int cnt = 0;
+    int line = get_line(func->chunk.line_runs, instruction);
+    for (int k = 0; k < func->chunk.inline_site_cnt && cnt < MAX_INLINE_DEPTH; k++) {
+        InlineSite_t *site = &func->chunk.inline_sites[k];
+        if (instruction >= site->start && instruction < site->end) {
+            names[cnt] = site->name->chars;
+            lines[cnt++] = line;
+            line = site->call_line;
+        }
+    }
+    names[cnt] = func->name == NULL ? "script" : func->name->chars;
+    lines[cnt++] = line;
+    for (int i = cnt - 1; i >= 0; i--) {
+        append_frame(sampler, size, names[i], lines[i]);
+    }
+}
+
+static uint32_t hash_folded(const char *stack) {
+    uint32_t hash = 2166136261u;
+    for (; *stack != '\0'; stack++) {
+        hash = (hash ^ (uint8_t)*stack) * 16777619u;
+    }
+    return hash;
+}
+
+static FoldedStack_t *find_folded(FoldedStack_t *stacks, int capacity, const char *stack,
+                                  uint32_t hash) {
+    for (uint32_t idx = hash & (capacity - 1);; idx = (idx + 1) & (capacity - 1)) {
+        FoldedStack_t *entry = &stacks[idx];
+        if (entry->stack == NULL || (entry->hash == hash && strcmp(entry->stack, stack) == 0)) {
+            return entry;
+        }
+    }
+}
+
+static void count_folded(Sampler_t *sampler) {
+    if (sampler->stack_cnt + 1 > sampler->stack_capacity * 3 / 4) {
+        int capacity = grow_capacity(sampler->stack_capacity);
+        FoldedStack_t *stacks = (FoldedStack_t *)calloc(capacity, sizeof(FoldedStack_t));
+        if (stacks == NULL) {
+            exit(1);
+        }
+        for (int i = 0; i < sampler->stack_capacity; i++) {
+            FoldedStack_t *entry = &sampler->stacks[i];
+            if (entry->stack != NULL) {
+                *find_folded(stacks, capacity, entry->stack, entry->hash) = *entry;
+            }
+        }
+        free(sampler->stacks);
+        sampler->stacks = stacks;
+        sampler->stack_capacity = capacity;
+    }
+    uint32_t hash = hash_folded(sampler->folded);
+    FoldedStack_t *entry =
+        find_folded(sampler->stacks, sampler->stack_capacity, sampler->folded, hash);
+    if (entry->stack == NULL) {
+        *entry = (FoldedStack_t){strdup(sampler->folded), hash, 0};
+        sampler->stack_cnt++;
+    }
+    entry->count++;
+}
+
+void drain_samples(Sampler_t *sampler) {
+    sampler->is_draining = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < sampler->ring_cnt; i += sampler->ring[i].instruction + 1) {
+        size_t size = 0;
+        for (int k = 1; k <= sampler->ring[i].instruction; k++) {
+            SampleFrame_t *frame = &sampler->ring[i + k];
+            append_func(sampler, &size, frame->func, frame->instruction);
+        }
+        count_folded(sampler);
+        sampler->sample_cnt++;
+    }
+    sampler->ring_cnt = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    sampler->is_draining = 0;
+}
+
+static int by_stack(const void *a, const void *b) {
+    return strcmp((*(FoldedStack_t *const *)a)->stack, (*(FoldedStack_t *const *)b)->stack);
+}
+
+void report_sampler(Sampler_t *sampler, FILE *out) {
+    if (sampler->is_running) {
+        timer_delete(sampler->timer);
+        sampler->is_running = false;
+    }
+    drain_samples(sampler);
+
+    FILE *folded = fopen(sampler->path, "w");
+    if (folded == NULL) {
+        fprintf(stderr, "Error: cannot write samples \"%s\"\n", sampler->path);
+        return;
+    }
+    // sorted so two runs of the same script diff cleanly
+    FoldedStack_t **stacks =
+        (FoldedStack_t **)malloc(sizeof(FoldedStack_t *) * (sampler->stack_cnt + 1));
+    int cnt = 0;
+    for (int i = 0; i < sampler->stack_capacity; i++) {
+        if (sampler->stacks[i].stack != NULL) {
+            stacks[cnt++] = &sampler->stacks[i];
+        }
+    }
+    qsort(stacks, cnt, sizeof(FoldedStack_t *), by_stack);
+    for (int i = 0; i < cnt; i++) {
+        fprintf(folded, "%s %llu\n", stacks[i]->stack, (unsigned long long)stacks[i]->count);
+    }
+    free(stacks);
+    fclose(folded);
+    fprintf(out, "sample: %llu samples in %d stacks written to %s",
+            (unsigned long long)sampler->sample_cnt, cnt, sampler->path);
+    if (sampler->dropped > 0) {
+        fprintf(out, ", %d dropped", (int)sampler->dropped);
+    }
+    fputs("\n", out);
+}
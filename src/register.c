@@ -0,0 +1,749 @@
+#include "../includes/register.h"
+#include "../includes/memory.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "../includes/debug.h"
+#endif
+
+/*
+ * Register code generator. It walks the finished stack bytecode of a function
+ * while modelling the operand stack: stack slot i is register i of the frame.
+ * Loads of locals and constants emit nothing, the slot just records where its
+ * value lives so whichever instruction consumes it can read the local or the
+ * constant directly. A slot is only materialised into its own register when
+ * the value has to be there: before branches, at branch targets, before calls
+ * and for operands that must be registers.
+ *
+ * A slot may alias a lower register (a local) but never a higher one, and no
+ * slot aliases another slot that is itself deferred, so writing a local only
+ * requires flushing the slots that alias it.
+ */
+
+typedef enum { SLOT_REG, SLOT_CONST, SLOT_NONE, SLOT_TRUE, SLOT_FALSE } SlotKind_t;
+
+typedef struct {
+    SlotKind_t kind;
+    int idx; // register holding the value, or constant index for SLOT_CONST
+} Slot_t;
+
+typedef struct {
+    Chunk_t *chunk;
+    RegChunk_t *out;
+    Slot_t slots[MAX_REGISTERS];
+    int depth;
+    bool *is_target;
+    int *target_depth; // stack depth on arrival at each branch target
+    int *label;        // stack code offset -> register code pc
+    int *patches;      // offset words still pointing at a stack code offset
+    int *patch_targets;
+    int patch_cnt;
+    int retarget;     // last instruction whose destination register may be rewritten
+    int retarget_end; // register code count right after it
+    int line;
+    int origin; // stack code offset being translated
+    bool failed;
+} RegGen_t;
+
+void free_reg_chunk(RegChunk_t *reg_chunk) {
+    if (reg_chunk == NULL) {
+        return;
+    }
+    FREE_ARRAY(uint32_t, reg_chunk->code, reg_chunk->capacity);
+    FREE_ARRAY(int, reg_chunk->lines, reg_chunk->capacity);
+    FREE_ARRAY(int, reg_chunk->origins, reg_chunk->capacity);
+    free(reg_chunk);
+}
+
+static int emit(RegGen_t *gen, uint32_t word) {
+    RegChunk_t *out = gen->out;
+    if (out->count + 1 > out->capacity) {
+        int old_capacity = out->capacity;
+        out->capacity = grow_capacity(old_capacity);
+        out->code = resize(out->code, sizeof(uint32_t), old_capacity, out->capacity);
+        out->lines = resize(out->lines, sizeof(int), old_capacity, out->capacity);
+        out->origins = resize(out->origins, sizeof(int), old_capacity, out->capacity);
+    }
+    out->code[out->count] = word;
+    out->lines[out->count] = gen->line;
+    out->origins[out->count] = gen->origin;
+    return out->count++;
+}
+
+static void use_register(RegGen_t *gen, int reg) {
+    if (reg >= MAX_REGISTERS) {
+        gen->failed = true;
+    } else if (reg + 1 > gen->out->reg_cnt) {
+        gen->out->reg_cnt = reg + 1;
+    }
+}
+
+static void push_slot(RegGen_t *gen, SlotKind_t kind, int idx) {
+    use_register(gen, gen->depth);
+    if (gen->failed) {
+        return;
+    }
+    gen->slots[gen->depth++] = (Slot_t){kind, idx};
+}
+
+// writes the value a slot describes into register reg
+static void emit_load(RegGen_t *gen, Slot_t slot, int reg) {
+    switch (slot.kind) {
+        case SLOT_REG:
+            if (slot.idx != reg) {
+                emit(gen, REG_ENCODE(ROP_MOVE, reg, slot.idx, 0));
+            }
+            break;
+        case SLOT_CONST:
+            if (slot.idx > 0xffff) {
+                gen->failed = true;
+                return;
+            }
+            emit(gen, REG_ENCODE_BX(ROP_LOADK, reg, slot.idx));
+            break;
+        case SLOT_NONE:
+            emit(gen, REG_ENCODE(ROP_LOAD_NONE, reg, 0, 0));
+            break;
+        case SLOT_TRUE:
+            emit(gen, REG_ENCODE(ROP_LOAD_TRUE, reg, 0, 0));
+            break;
+        case SLOT_FALSE:
+            emit(gen, REG_ENCODE(ROP_LOAD_FALSE, reg, 0, 0));
+            break;
+    }
+}
+
+static void flush_slot(RegGen_t *gen, int pos) {
+    Slot_t slot = gen->slots[pos];
+    if (slot.kind == SLOT_REG && slot.idx == pos) {
+        return;
+    }
+    emit_load(gen, slot, pos);
+    gen->slots[pos] = (Slot_t){SLOT_REG, pos};
+    gen->retarget = -1;
+}
+
+static void flush_below(RegGen_t *gen, int depth) {
+    for (int pos = 0; pos < depth; pos++) {
+        flush_slot(gen, pos);
+    }
+}
+
+static void flush_all(RegGen_t *gen) {
+    flush_below(gen, gen->depth);
+}
+
+// register holding the value of a slot, materialising it if it is a constant
+static int operand(RegGen_t *gen, int pos) {
+    if (gen->slots[pos].kind != SLOT_REG) {
+        flush_slot(gen, pos);
+    }
+    return gen->slots[pos].idx;
+}
+
+// constant index usable as a C operand, -1 if the slot needs a register
+static int const_operand(RegGen_t *gen, int pos) {
+    Slot_t slot = gen->slots[pos];
+    return slot.kind == SLOT_CONST && slot.idx <= 0xff ? slot.idx : -1;
+}
+
+// a free register just above the stack for values that never become slots
+static int scratch(RegGen_t *gen) {
+    use_register(gen, gen->depth);
+    return gen->depth;
+}
+
+static void emit_result(RegGen_t *gen, uint32_t word) {
+    int pc = emit(gen, word);
+    push_slot(gen, SLOT_REG, gen->depth);
+    gen->retarget = pc;
+    gen->retarget_end = gen->out->count;
+}
+
+// the upcoming write to register reg must not change what other slots read
+static void prepare_write(RegGen_t *gen, int reg) {
+    for (int pos = reg + 1; pos < gen->depth; pos++) {
+        if (gen->slots[pos].kind == SLOT_REG && gen->slots[pos].idx == reg) {
+            flush_slot(gen, pos);
+        }
+    }
+}
+
+static bool is_aliased(RegGen_t *gen, int reg) {
+    for (int pos = reg + 1; pos < gen->depth; pos++) {
+        if (gen->slots[pos].kind == SLOT_REG && gen->slots[pos].idx == reg) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void set_local(RegGen_t *gen, int reg) {
+    int top = gen->depth - 1;
+    if (reg >= top) {
+        gen->failed = true;
+        return;
+    }
+    Slot_t value = gen->slots[top];
+    if (value.kind == SLOT_REG && value.idx == reg) {
+        return;
+    }
+    if (value.kind == SLOT_REG && value.idx == top && gen->retarget != -1 &&
+        gen->retarget_end == gen->out->count && !is_aliased(gen, reg)) {
+        // the value was just computed, have that instruction write the local
+        uint32_t *word = &gen->out->code[gen->retarget];
+        *word = (*word & ~(uint32_t)0xff00) | ((uint32_t)reg << 8);
+    } else {
+        prepare_write(gen, reg);
+        value = gen->slots[top];
+        emit_load(gen, value, reg);
+    }
+    gen->slots[reg] = (Slot_t){SLOT_REG, reg};
+    gen->slots[top] = (Slot_t){SLOT_REG, reg};
+    gen->retarget = -1;
+}
+
+static void jump_to(RegGen_t *gen, uint32_t word, int target) {
+    emit(gen, word);
+    int at = emit(gen, 0);
+    if (gen->label[target] != -1) {
+        gen->out->code[at] = (uint32_t)(gen->label[target] - (at + 1));
+    } else {
+        gen->patches[gen->patch_cnt] = at;
+        gen->patch_targets[gen->patch_cnt++] = target;
+    }
+    if (gen->target_depth[target] == -1) {
+        gen->target_depth[target] = gen->depth;
+    }
+}
+
+static void binary(RegGen_t *gen, RegOpCode_t op, RegOpCode_t op_k) {
+    int lhs = gen->depth - 2;
+    int b = operand(gen, lhs);
+    int c = const_operand(gen, lhs + 1);
+    if (c != -1) {
+        op = op_k;
+    } else {
+        c = operand(gen, lhs + 1);
+    }
+    gen->depth = lhs;
+    emit_result(gen, REG_ENCODE(op, lhs, b, c));
+}
+
+// whether the value left by the instruction ending at offset is popped unread
+static bool is_discarded(RegGen_t *gen, int offset) {
+    return offset < gen->chunk->count && gen->chunk->code[offset] == OP_POP &&
+           !gen->is_target[offset];
+}
+
+// a comparison feeding a branch whose both successors pop the condition is
+// turned into one compare-and-jump; returns the offset after the branch or -1
+static int compare_jump(RegGen_t *gen, int offset, RegOpCode_t op, RegOpCode_t op_k) {
+    Chunk_t *chunk = gen->chunk;
+    int branch = offset + 1;
+    if (branch >= chunk->count || chunk->code[branch] != OP_BRANCH_IF_FALSE ||
+        gen->is_target[branch] || !is_discarded(gen, branch + 3) ||
+        chunk->code[branch_target(chunk, branch)] != OP_POP) {
+        return -1;
+    }
+    int lhs = gen->depth - 2;
+    int a = operand(gen, lhs);
+    int b = const_operand(gen, lhs + 1);
+    if (b != -1) {
+        op = op_k;
+    } else {
+        b = operand(gen, lhs + 1);
+    }
+    gen->depth = lhs;
+    flush_all(gen);
+    gen->depth = lhs + 1; // the condition both successors pop
+    jump_to(gen, REG_ENCODE(op, a, b, 0), branch_target(chunk, branch));
+    return branch + 3;
+}
+
+static void comparison(RegGen_t *gen, int *offset, RegOpCode_t op, RegOpCode_t op_k,
+                       RegOpCode_t jump_op, RegOpCode_t jump_op_k) {
+    int next = compare_jump(gen, *offset, jump_op, jump_op_k);
+    if (next != -1) {
+        *offset = next;
+        return;
+    }
+    binary(gen, op, op_k);
+    *offset += 1;
+}
+
+// names used by property and method ops ride in the word after the instruction
+static void emit_named(RegGen_t *gen, uint32_t word, int name) {
+    emit(gen, word);
+    emit(gen, (uint32_t)name);
+}
+
+// replaces the top count slots by the value an assignment expression leaves,
+// the instruction at next decides whether anyone reads it
+static void leave_value(RegGen_t *gen, int count, Slot_t value, int next) {
+    gen->depth -= count;
+    if (value.kind == SLOT_REG && value.idx >= gen->depth) {
+        if (!is_discarded(gen, next)) {
+            emit(gen, REG_ENCODE(ROP_MOVE, gen->depth, value.idx, 0));
+        }
+        value.idx = gen->depth;
+    }
+    push_slot(gen, value.kind, value.idx);
+}
+
+static void translate(RegGen_t *gen, int num_params) {
+    Chunk_t *chunk = gen->chunk;
+    uint8_t *code = chunk->code;
+
+    for (int pos = 0; pos <= num_params; pos++) {
+        push_slot(gen, SLOT_REG, pos);
+    }
+
+    int offset = 0;
+    while (offset < chunk->count && !gen->failed) {
+        gen->line = get_line(chunk->line_runs, offset);
+        gen->origin = offset;
+        if (gen->is_target[offset]) {
+            flush_all(gen);
+            if (gen->target_depth[offset] == -1) {
+                gen->target_depth[offset] = gen->depth;
+            }
+            gen->depth = gen->target_depth[offset];
+            for (int pos = 0; pos < gen->depth; pos++) {
+                gen->slots[pos] = (Slot_t){SLOT_REG, pos};
+            }
+            gen->retarget = -1;
+        }
+        gen->label[offset] = gen->out->count;
+
+        int top = gen->depth - 1;
+        int next = offset + instruction_length(chunk, offset);
+        switch ((OpCode_t)code[offset]) {
+            case OP_CONSTANT:
+                push_slot(gen, SLOT_CONST, code[offset + 1]);
+                break;
+            case OP_CONSTANT_LONG:
+                push_slot(gen, SLOT_CONST,
+                          code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16));
+                break;
+            case OP_NONE:
+                push_slot(gen, SLOT_NONE, 0);
+                break;
+            case OP_TRUE:
+                push_slot(gen, SLOT_TRUE, 0);
+                break;
+            case OP_FALSE:
+                push_slot(gen, SLOT_FALSE, 0);
+                break;
+            case OP_NOT:
+            case OP_NEGATE: {
+                int b = operand(gen, top);
+                gen->depth--;
+                emit_result(gen, REG_ENCODE(code[offset] == OP_NOT ? ROP_NOT : ROP_NEGATE,
+                                            top, b, 0));
+                break;
+            }
+            case OP_ADD:
+            case OP_ADD_NN:
+                binary(gen, ROP_ADD, ROP_ADDK);
+                break;
+            case OP_SUB:
+            case OP_SUB_NN:
+                binary(gen, ROP_SUB, ROP_SUBK);
+                break;
+            case OP_MUL:
+            case OP_MUL_NN:
+                binary(gen, ROP_MUL, ROP_MULK);
+                break;
+            case OP_DIV:
+            case OP_DIV_NN:
+                binary(gen, ROP_DIV, ROP_DIVK);
+                break;
+            case OP_MOD:
+                binary(gen, ROP_MOD, ROP_MODK);
+                break;
+            case OP_BIT_AND:
+                binary(gen, ROP_BIT_AND, ROP_BIT_ANDK);
+                break;
+            case OP_BIT_OR:
+                binary(gen, ROP_BIT_OR, ROP_BIT_ORK);
+                break;
+            case OP_BIT_XOR:
+                binary(gen, ROP_BIT_XOR, ROP_BIT_XORK);
+                break;
+            case OP_SHIFT_LEFT:
+                binary(gen, ROP_SHIFT_LEFT, ROP_SHIFT_LEFTK);
+                break;
+            case OP_SHIFT_RIGHT:
+                binary(gen, ROP_SHIFT_RIGHT, ROP_SHIFT_RIGHTK);
+                break;
+            case OP_EQUAL:
+                binary(gen, ROP_EQUAL, ROP_EQUALK);
+                break;
+            case OP_NOT_EQUAL:
+                binary(gen, ROP_NOT_EQUAL, ROP_NOT_EQUALK);
+                break;
+            case OP_LESS_THAN:
+            case OP_LESS_NN:
+                comparison(gen, &offset, ROP_LESS, ROP_LESSK, ROP_LESS_JUMP, ROP_LESSK_JUMP);
+                continue;
+            case OP_LESS_EQUAL:
+            case OP_LESS_EQUAL_NN:
+                comparison(gen, &offset, ROP_LESS_EQUAL, ROP_LESS_EQUALK, ROP_LESS_EQUAL_JUMP,
+                           ROP_LESS_EQUALK_JUMP);
+                continue;
+            case OP_GREATER_THAN:
+            case OP_GREATER_NN:
+                comparison(gen, &offset, ROP_GREATER, ROP_GREATERK, ROP_GREATER_JUMP,
+                           ROP_GREATERK_JUMP);
+                continue;
+            case OP_GREATER_EQUAL:
+            case OP_GREATER_EQUAL_NN:
+                comparison(gen, &offset, ROP_GREATER_EQUAL, ROP_GREATER_EQUALK,
+                           ROP_GREATER_EQUAL_JUMP, ROP_GREATER_EQUALK_JUMP);
+                continue;
+            case OP_PRINT:
+                emit(gen, REG_ENCODE(ROP_PRINT, operand(gen, top), 0, 0));
+                gen->depth--;
+                break;
+            case OP_POP:
+                gen->depth--;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG: {
+                int name = code[offset] == OP_DEFINE_GLOBAL || code[offset] == OP_SET_GLOBAL
+                               ? code[offset + 1]
+                               : code[offset + 1] | (code[offset + 2] << 8) |
+                                     (code[offset + 3] << 16);
+                if (name > 0xffff) {
+                    gen->failed = true;
+                    break;
+                }
+                bool is_define =
+                    code[offset] == OP_DEFINE_GLOBAL || code[offset] == OP_DEFINE_GLOBAL_LONG;
+                emit(gen, REG_ENCODE_BX(is_define ? ROP_DEFINE_GLOBAL : ROP_SET_GLOBAL,
+                                        operand(gen, top), name));
+                if (is_define) {
+                    gen->depth--;
+                }
+                break;
+            }
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                int name = code[offset] == OP_GET_GLOBAL
+                               ? code[offset + 1]
+                               : code[offset + 1] | (code[offset + 2] << 8) |
+                                     (code[offset + 3] << 16);
+                if (name > 0xffff) {
+                    gen->failed = true;
+                    break;
+                }
+                emit_result(gen, REG_ENCODE_BX(ROP_GET_GLOBAL, gen->depth, name));
+                break;
+            }
+            case OP_GET_LOCAL: {
+                Slot_t local = gen->slots[code[offset + 1]];
+                push_slot(gen, local.kind, local.idx);
+                break;
+            }
+            case OP_SET_LOCAL:
+                set_local(gen, code[offset + 1]);
+                break;
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL_LONG:
+                gen->failed = true; // more locals than registers
+                break;
+            case OP_BRANCH_IF_FALSE: {
+                int target = branch_target(chunk, offset);
+                if (is_discarded(gen, next) && code[target] == OP_POP) {
+                    int cond = operand(gen, top);
+                    flush_below(gen, top);
+                    jump_to(gen, REG_ENCODE(ROP_JUMP_IF_FALSE, cond, 0, 0), target);
+                } else {
+                    flush_all(gen);
+                    jump_to(gen, REG_ENCODE(ROP_JUMP_IF_FALSE, top, 0, 0), target);
+                }
+                break;
+            }
+            case OP_BRANCH:
+            case OP_LOOP:
+                flush_all(gen);
+                jump_to(gen, REG_ENCODE(ROP_JUMP, 0, 0, 0), branch_target(chunk, offset));
+                break;
+            case OP_RETURN:
+                emit(gen, REG_ENCODE(ROP_RETURN, operand(gen, top), 0, 0));
+                gen->depth--;
+                break;
+            case OP_CALL: {
+                int arg_cnt = code[offset + 1];
+                int base = gen->depth - 1 - arg_cnt;
+                flush_all(gen);
+                emit(gen, REG_ENCODE(ROP_CALL, base, arg_cnt, 0));
+                gen->depth = base;
+                push_slot(gen, SLOT_REG, base);
+                break;
+            }
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG: {
+                bool is_long = code[offset] == OP_SUPER_INVOKE_LONG;
+                int name = is_long ? code[offset + 1] | (code[offset + 2] << 8) |
+                                         (code[offset + 3] << 16)
+                                   : code[offset + 1];
+                int arg_cnt = code[offset + (is_long ? 4 : 2)];
+                bool is_super = code[offset] != OP_INVOKE;
+                int base = gen->depth - 1 - arg_cnt - (is_super ? 1 : 0);
+                flush_all(gen);
+                emit_named(gen, REG_ENCODE(is_super ? ROP_SUPER_INVOKE : ROP_INVOKE, base, arg_cnt, 0),
+                           name);
+                gen->depth = base;
+                push_slot(gen, SLOT_REG, base);
+                break;
+            }
+            case OP_CLOSURE: {
+                int func_idx = code[offset + 1];
+                int upvalue_cnt = GET_FUNC(chunk->constants.values[func_idx])->upvalue_cnt;
+                flush_all(gen); // captured locals must sit in their registers
+                emit(gen, REG_ENCODE_BX(ROP_CLOSURE, gen->depth, func_idx));
+                for (int i = 0; i < upvalue_cnt; i++) {
+                    emit(gen, REG_ENCODE(code[offset + 2 + 2 * i], code[offset + 3 + 2 * i], 0, 0));
+                }
+                push_slot(gen, SLOT_REG, gen->depth);
+                break;
+            }
+            case OP_STACK_CLOSURE:
+                emit_result(gen, REG_ENCODE_BX(ROP_STACK_CLOSURE, gen->depth, code[offset + 1]));
+                break;
+            case OP_GET_UPVALUE:
+                emit_result(gen, REG_ENCODE(ROP_GET_UPVALUE, gen->depth, code[offset + 1], 0));
+                break;
+            case OP_SET_UPVALUE:
+                emit(gen, REG_ENCODE(ROP_SET_UPVALUE, operand(gen, top), code[offset + 1], 0));
+                break;
+            case OP_GET_ENCLOSING:
+                emit_result(gen, REG_ENCODE(ROP_GET_ENCLOSING, gen->depth, code[offset + 1], 0));
+                break;
+            case OP_SET_ENCLOSING:
+                emit(gen, REG_ENCODE(ROP_SET_ENCLOSING, operand(gen, top), code[offset + 1], 0));
+                break;
+            case OP_CLOSE_UPVALUE:
+                flush_slot(gen, top);
+                emit(gen, REG_ENCODE(ROP_CLOSE_UPVALUE, top, 0, 0));
+                gen->depth--;
+                break;
+            case OP_CLASS:
+            case OP_CLASS_LONG: {
+                int name = code[offset] == OP_CLASS ? code[offset + 1]
+                                                    : code[offset + 1] | (code[offset + 2] << 8) |
+                                                          (code[offset + 3] << 16);
+                if (name > 0xffff) {
+                    gen->failed = true;
+                    break;
+                }
+                emit(gen, REG_ENCODE_BX(ROP_CLASS, gen->depth, name));
+                push_slot(gen, SLOT_REG, gen->depth);
+                break;
+            }
+            case OP_GET_PROPERTY: {
+                int object = operand(gen, top);
+                gen->depth--;
+                int pc = emit(gen, REG_ENCODE(ROP_GET_PROPERTY, top, object, 0));
+                emit(gen, code[offset + 1]);
+                push_slot(gen, SLOT_REG, top);
+                gen->retarget = pc;
+                gen->retarget_end = gen->out->count;
+                break;
+            }
+            case OP_SET_PROPERTY: {
+                int object = operand(gen, top - 1);
+                int value = operand(gen, top);
+                emit_named(gen, REG_ENCODE(ROP_SET_PROPERTY, object, value, 0), code[offset + 1]);
+                leave_value(gen, 2, gen->slots[top], next);
+                break;
+            }
+            case OP_METHOD:
+            case OP_METHOD_LONG: {
+                int name = code[offset] == OP_METHOD ? code[offset + 1]
+                                                     : code[offset + 1] | (code[offset + 2] << 8) |
+                                                           (code[offset + 3] << 16);
+                emit_named(gen, REG_ENCODE(ROP_METHOD, operand(gen, top - 1), operand(gen, top), 0),
+                           name);
+                gen->depth--;
+                break;
+            }
+            case OP_INHERIT:
+                emit(gen, REG_ENCODE(ROP_INHERIT, operand(gen, top - 1), operand(gen, top), 0));
+                gen->depth--;
+                break;
+            case OP_GET_SUPER:
+            case OP_GET_SUPER_LONG: {
+                int name = code[offset] == OP_GET_SUPER ? code[offset + 1]
+                                                        : code[offset + 1] |
+                                                              (code[offset + 2] << 8) |
+                                                              (code[offset + 3] << 16);
+                int receiver = operand(gen, top - 1);
+                int superclass = operand(gen, top);
+                gen->depth -= 2;
+                emit_named(gen, REG_ENCODE(ROP_GET_SUPER, gen->depth, receiver, superclass), name);
+                push_slot(gen, SLOT_REG, gen->depth);
+                break;
+            }
+            case OP_BUILD_LIST: {
+                int elem_cnt = code[offset + 1];
+                int base = gen->depth - elem_cnt;
+                for (int pos = base; pos < gen->depth; pos++) {
+                    flush_slot(gen, pos);
+                }
+                emit(gen, REG_ENCODE(ROP_BUILD_LIST, base, elem_cnt, 0));
+                gen->depth = base;
+                push_slot(gen, SLOT_REG, base);
+                break;
+            }
+            case OP_INDEX_GET: {
+                int target = operand(gen, top - 1);
+                int idx = operand(gen, top);
+                gen->depth -= 2;
+                emit_result(gen, REG_ENCODE(ROP_INDEX_GET, gen->depth, target, idx));
+                break;
+            }
+            case OP_INDEX_SET: {
+                int target = operand(gen, top - 2);
+                int idx = operand(gen, top - 1);
+                int value = operand(gen, top);
+                emit(gen, REG_ENCODE(ROP_INDEX_SET, target, idx, value));
+                leave_value(gen, 3, gen->slots[top], next);
+                break;
+            }
+            case OP_ADD_LOCALS: {
+                Slot_t lhs = gen->slots[code[offset + 1]];
+                Slot_t rhs = gen->slots[code[offset + 2]];
+                push_slot(gen, lhs.kind, lhs.idx);
+                push_slot(gen, rhs.kind, rhs.idx);
+                if (!gen->failed) {
+                    binary(gen, ROP_ADD, ROP_ADDK);
+                }
+                break;
+            }
+            case OP_INC_LOCAL: {
+                int local = code[offset + 1];
+                int amount = code[offset + 2];
+                int src = operand(gen, local);
+                prepare_write(gen, local);
+                if (amount > 0xff) {
+                    int tmp = scratch(gen);
+                    emit_load(gen, (Slot_t){SLOT_CONST, amount}, tmp);
+                    emit(gen, REG_ENCODE(ROP_ADD, local, src, tmp));
+                } else {
+                    emit(gen, REG_ENCODE(ROP_ADDK, local, src, amount));
+                }
+                gen->slots[local] = (Slot_t){SLOT_REG, local};
+                gen->retarget = -1;
+                break;
+            }
+            case OP_LESS_LOCAL_CONST_JUMP: {
+                int target = branch_target(chunk, offset);
+                Slot_t local = gen->slots[code[offset + 1]];
+                push_slot(gen, local.kind, local.idx);
+                push_slot(gen, SLOT_CONST, code[offset + 2]);
+                if (gen->failed) {
+                    break;
+                }
+                int lhs = gen->depth - 2;
+                int a = operand(gen, lhs);
+                int b = const_operand(gen, lhs + 1);
+                RegOpCode_t op = ROP_LESSK_JUMP;
+                if (b == -1) {
+                    b = operand(gen, lhs + 1);
+                    op = ROP_LESS_JUMP;
+                }
+                if (code[target] == OP_POP) {
+                    gen->depth = lhs;
+                    flush_all(gen);
+                    gen->depth = lhs + 1; // the false the branch target pops
+                    jump_to(gen, REG_ENCODE(op, a, b, 0), target);
+                } else {
+                    // the target reads the condition, so it has to exist
+                    gen->depth = lhs;
+                    emit(gen, REG_ENCODE(op == ROP_LESSK_JUMP ? ROP_LESSK : ROP_LESS, lhs, a, b));
+                    flush_all(gen);
+                    gen->depth = lhs + 1;
+                    jump_to(gen, REG_ENCODE(ROP_JUMP_IF_FALSE, lhs, 0, 0), target);
+                }
+                gen->depth = lhs;
+                break;
+            }
+        }
+        offset = next;
+    }
+}
+
+bool generate_register_code(ObjectFunc_t *func) {
+    if (func->reg_chunk != NULL) {
+        return true;
+    }
+    Chunk_t *chunk = &func->chunk;
+    int n = chunk->count;
+
+    RegGen_t *gen = ALLOCATE(RegGen_t, 1);
+    gen->chunk = chunk;
+    gen->out = ALLOCATE(RegChunk_t, 1);
+    gen->out->count = 0;
+    gen->out->capacity = 0;
+    gen->out->code = NULL;
+    gen->out->lines = NULL;
+    gen->out->origins = NULL;
+    gen->out->reg_cnt = 0;
+    gen->depth = 0;
+    gen->is_target = calloc(n + 1, sizeof(bool));
+    gen->target_depth = ALLOCATE(int, n + 1);
+    gen->label = ALLOCATE(int, n + 1);
+    gen->patches = ALLOCATE(int, n + 1);
+    gen->patch_targets = ALLOCATE(int, n + 1);
+    gen->patch_cnt = 0;
+    gen->retarget = -1;
+    gen->retarget_end = -1;
+    gen->line = 0;
+    gen->origin = 0;
+    gen->failed = false;
+    for (int i = 0; i <= n; i++) {
+        gen->target_depth[i] = -1;
+        gen->label[i] = -1;
+    }
+    for (int offset = 0; offset < n; offset += instruction_length(chunk, offset)) {
+        if (is_branch(chunk->code[offset])) {
+            gen->is_target[branch_target(chunk, offset)] = true;
+        }
+    }
+
+    translate(gen, func->num_params);
+    for (int i = 0; i < gen->patch_cnt && !gen->failed; i++) {
+        int at = gen->patches[i];
+        gen->out->code[at] = (uint32_t)(gen->label[gen->patch_targets[i]] - (at + 1));
+    }
+
+    bool ok = !gen->failed;
+    if (ok) {
+        func->reg_chunk = gen->out;
+#ifdef DEBUG_PRINT_CODE
+        disassemble_reg_chunk(func->reg_chunk, &chunk->constants,
+                              func->name != NULL ? func->name->chars : "<script>");
+#endif
+    } else {
+        free_reg_chunk(gen->out);
+    }
+    free(gen->is_target);
+    free(gen->target_depth);
+    free(gen->label);
+    free(gen->patches);
+    free(gen->patch_targets);
+    free(gen);
+
+    // functions declared inside are constants of this one
+    for (int i = 0; ok && i < chunk->constants.count; i++) {
+        if (IS_FUNC(chunk->constants.values[i])) {
+            ok = generate_register_code(GET_FUNC(chunk->constants.values[i]));
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,574 @@
+#include "../includes/debug.h"
+#include "../includes/fiber.h"
+#include "../includes/memory.h"
+#include "../includes/object.h"
+#include "../includes/register.h"
+#include "../includes/vm.h"
+
+/*
+ * Execution loop for register code. A frame's registers are its stack slots,
+ * so calls, upvalues and the GC work exactly as for the stack VM. While a
+ * frame runs, cur_vm->stack_top sits just past its registers: everything below is
+ * a GC root and the helpers shared with the stack VM push scratch values
+ * above it.
+ */
+
+#define NUM_OPERANDS(lhs, rhs)                                                 \
+    if (!IS_NUMERIC_VAL(lhs) || !IS_NUMERIC_VAL(rhs)) {                        \
+        throw_runtime_error("Operands are not numbers");                       \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    }
+
+// func is one of the num_* helpers from value.h, type wraps its result
+#define REG_BINARY_OP(type, func, rhs)                                         \
+    {                                                                          \
+        Value_t lhs_ = regs[REG_B(word)];                                      \
+        Value_t rhs_ = rhs;                                                    \
+        NUM_OPERANDS(lhs_, rhs_);                                              \
+        regs[REG_A(word)] = type(func(lhs_, rhs_));                            \
+    }
+
+#define REG_INT_OP(op, rhs)                                                    \
+    {                                                                          \
+        Value_t lhs_ = regs[REG_B(word)];                                      \
+        Value_t rhs_ = rhs;                                                    \
+        if (!IS_INT_VAL(lhs_) || !IS_INT_VAL(rhs_)) {                          \
+            throw_runtime_error("Operands are not integers");                  \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        regs[REG_A(word)] = DECL_INT_VAL(GET_INT_VAL(lhs_) op GET_INT_VAL(rhs_)); \
+    }
+
+// jumps unless func(R[A], rhs), negate flips it for the !(a > b) style compares
+#define REG_COMPARE_JUMP(negate, func, rhs)                                    \
+    {                                                                          \
+        Value_t lhs_ = regs[REG_A(word)];                                      \
+        Value_t rhs_ = rhs;                                                    \
+        int32_t offset = (int32_t)READ_WORD();                                 \
+        NUM_OPERANDS(lhs_, rhs_);                                              \
+        if (func(lhs_, rhs_) == negate) {                                      \
+            frame->reg_pc += offset;                                           \
+        }                                                                      \
+    }
+
+#define NOT_BOOL_VAL(value) DECL_BOOL_VAL(!(value))
+#define AS_VAL(value) (value)
+
+// points a freshly pushed frame at its register code and clears the registers
+// past its arguments so the GC never sees values left by earlier frames
+static bool begin_frame(CallFrame_t *frame) {
+    ObjectFunc_t *func = frame->closure->func;
+    Value_t *top = frame->slots + func->reg_chunk->reg_cnt;
+    if (top + 8 > cur_vm->stack + sizeof(cur_vm->stack) / sizeof(Value_t)) {
+        throw_runtime_error("Stack overflow");
+        return false;
+    }
+    for (Value_t *slot = frame->slots + func->num_params + 1; slot < top; slot++) {
+        *slot = DECL_NONE_VAL;
+    }
+    frame->reg_pc = func->reg_chunk->code;
+    cur_vm->stack_top = top;
+    return true;
+}
+
+// numbers add in place, everything else goes through the stack helper
+static bool add_registers(Value_t a, Value_t b, Value_t *out) {
+    if (IS_NUMERIC_VAL(a) && IS_NUMERIC_VAL(b)) {
+        *out = num_add(a, b);
+        return true;
+    }
+    push(a);
+    push(b);
+    if (!add_values()) {
+        return false;
+    }
+    *out = pop();
+    return true;
+}
+
+// the registers above a call's arguments are dead, clear them before the GC
+// can run with cur_vm->stack_top lowered to the arguments
+static void lower_top(Value_t *args_end) {
+    for (Value_t *slot = args_end; slot < cur_vm->stack_top; slot++) {
+        *slot = DECL_NONE_VAL;
+    }
+    cur_vm->stack_top = args_end;
+}
+
+InterpretResult_t run_registers() {
+    CallFrame_t *frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+    Value_t *regs;
+    Value_t *constants;
+    if (!begin_frame(frame)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+#define READ_WORD() (*frame->reg_pc++)
+#define LOAD_FRAME()                                                           \
+    do {                                                                       \
+        regs = frame->slots;                                                   \
+        constants = frame->closure->func->chunk.constants.values;              \
+        cur_vm->stack_top = regs + frame->closure->func->reg_chunk->reg_cnt;        \
+    } while (false)
+#define READ_NAME() GET_STR_VAL(constants[READ_WORD()])
+
+    LOAD_FRAME();
+    while (true) {
+
+#ifdef DEBUG_TRACE_EXECUTION
+        printf(("       "));
+        for (Value_t *idx = regs; idx < cur_vm->stack_top; idx++) {
+            printf("[ ");
+            print_value(*idx);
+            printf(" ]");
+        }
+        printf("\n");
+        disassemble_reg_instruction(frame->closure->func->reg_chunk,
+                                    &frame->closure->func->chunk.constants,
+                                    (int)(frame->reg_pc - frame->closure->func->reg_chunk->code));
+#endif
+
+#ifdef DEBUG_COUNT_DISPATCH
+        cur_vm->dispatch_cnt++;
+#endif
+
+        uint32_t word = READ_WORD();
+        switch ((RegOpCode_t)REG_OP(word)) {
+            case ROP_MOVE: {
+                regs[REG_A(word)] = regs[REG_B(word)];
+                break;
+            }
+            case ROP_LOADK: {
+                regs[REG_A(word)] = constants[REG_BX(word)];
+                break;
+            }
+            case ROP_LOAD_NONE: {
+                regs[REG_A(word)] = DECL_NONE_VAL;
+                break;
+            }
+            case ROP_LOAD_TRUE: {
+                regs[REG_A(word)] = DECL_BOOL_VAL(true);
+                break;
+            }
+            case ROP_LOAD_FALSE: {
+                regs[REG_A(word)] = DECL_BOOL_VAL(false);
+                break;
+            }
+            case ROP_ADD: {
+                if (!add_registers(regs[REG_B(word)], regs[REG_C(word)], &regs[REG_A(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_ADDK: {
+                if (!add_registers(regs[REG_B(word)], constants[REG_C(word)],
+                                   &regs[REG_A(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_SUB: {
+                REG_BINARY_OP(AS_VAL, num_sub, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_SUBK: {
+                REG_BINARY_OP(AS_VAL, num_sub, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_MUL: {
+                REG_BINARY_OP(AS_VAL, num_mul, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_MULK: {
+                REG_BINARY_OP(AS_VAL, num_mul, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_DIV: {
+                REG_BINARY_OP(AS_VAL, num_div, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_DIVK: {
+                REG_BINARY_OP(AS_VAL, num_div, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_MOD:
+            case ROP_MODK: {
+                Value_t rhs = REG_OP(word) == ROP_MOD ? regs[REG_C(word)] : constants[REG_C(word)];
+                if (!mod_values(regs[REG_B(word)], rhs, &regs[REG_A(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_BIT_AND: {
+                REG_INT_OP(&, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_BIT_ANDK: {
+                REG_INT_OP(&, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_BIT_OR: {
+                REG_INT_OP(|, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_BIT_ORK: {
+                REG_INT_OP(|, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_BIT_XOR: {
+                REG_INT_OP(^, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_BIT_XORK: {
+                REG_INT_OP(^, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_SHIFT_LEFT:
+            case ROP_SHIFT_LEFTK:
+            case ROP_SHIFT_RIGHT:
+            case ROP_SHIFT_RIGHTK: {
+                uint8_t op = REG_OP(word);
+                Value_t rhs = op == ROP_SHIFT_LEFT || op == ROP_SHIFT_RIGHT ? regs[REG_C(word)]
+                                                                            : constants[REG_C(word)];
+                if (!shift_values(op == ROP_SHIFT_LEFT || op == ROP_SHIFT_LEFTK,
+                                  regs[REG_B(word)], rhs, &regs[REG_A(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_EQUAL: {
+                regs[REG_A(word)] = DECL_BOOL_VAL(equals(regs[REG_B(word)], regs[REG_C(word)]));
+                break;
+            }
+            case ROP_EQUALK: {
+                regs[REG_A(word)] =
+                    DECL_BOOL_VAL(equals(regs[REG_B(word)], constants[REG_C(word)]));
+                break;
+            }
+            case ROP_NOT_EQUAL: {
+                regs[REG_A(word)] = DECL_BOOL_VAL(!equals(regs[REG_B(word)], regs[REG_C(word)]));
+                break;
+            }
+            case ROP_NOT_EQUALK: {
+                regs[REG_A(word)] =
+                    DECL_BOOL_VAL(!equals(regs[REG_B(word)], constants[REG_C(word)]));
+                break;
+            }
+            case ROP_LESS: {
+                REG_BINARY_OP(DECL_BOOL_VAL, num_less, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_LESSK: {
+                REG_BINARY_OP(DECL_BOOL_VAL, num_less, constants[REG_C(word)]);
+                break;
+            }
+            // written as !(a > b) / !(a < b) to match the stack VM's NaN behaviour
+            case ROP_LESS_EQUAL: {
+                REG_BINARY_OP(NOT_BOOL_VAL, num_greater, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_LESS_EQUALK: {
+                REG_BINARY_OP(NOT_BOOL_VAL, num_greater, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_GREATER: {
+                REG_BINARY_OP(DECL_BOOL_VAL, num_greater, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_GREATERK: {
+                REG_BINARY_OP(DECL_BOOL_VAL, num_greater, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_GREATER_EQUAL: {
+                REG_BINARY_OP(NOT_BOOL_VAL, num_less, regs[REG_C(word)]);
+                break;
+            }
+            case ROP_GREATER_EQUALK: {
+                REG_BINARY_OP(NOT_BOOL_VAL, num_less, constants[REG_C(word)]);
+                break;
+            }
+            case ROP_NOT: {
+                regs[REG_A(word)] = DECL_BOOL_VAL(is_falsey(regs[REG_B(word)]));
+                break;
+            }
+            case ROP_NEGATE: {
+                Value_t value = regs[REG_B(word)];
+                if (!IS_NUMERIC_VAL(value)) {
+                    throw_runtime_error("Runtme Error: Operand is not a number ");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                regs[REG_A(word)] = num_negate(value);
+                break;
+            }
+            case ROP_JUMP: {
+                int32_t offset = (int32_t)READ_WORD();
+                frame->reg_pc += offset;
+                break;
+            }
+            case ROP_JUMP_IF_FALSE: {
+                int32_t offset = (int32_t)READ_WORD();
+                if (is_falsey(regs[REG_A(word)])) {
+                    frame->reg_pc += offset;
+                }
+                break;
+            }
+            case ROP_LESS_JUMP: {
+                REG_COMPARE_JUMP(false, num_less, regs[REG_B(word)]);
+                break;
+            }
+            case ROP_LESSK_JUMP: {
+                REG_COMPARE_JUMP(false, num_less, constants[REG_B(word)]);
+                break;
+            }
+            case ROP_LESS_EQUAL_JUMP: {
+                REG_COMPARE_JUMP(true, num_greater, regs[REG_B(word)]);
+                break;
+            }
+            case ROP_LESS_EQUALK_JUMP: {
+                REG_COMPARE_JUMP(true, num_greater, constants[REG_B(word)]);
+                break;
+            }
+            case ROP_GREATER_JUMP: {
+                REG_COMPARE_JUMP(false, num_greater, regs[REG_B(word)]);
+                break;
+            }
+            case ROP_GREATERK_JUMP: {
+                REG_COMPARE_JUMP(false, num_greater, constants[REG_B(word)]);
+                break;
+            }
+            case ROP_GREATER_EQUAL_JUMP: {
+                REG_COMPARE_JUMP(true, num_less, regs[REG_B(word)]);
+                break;
+            }
+            case ROP_GREATER_EQUALK_JUMP: {
+                REG_COMPARE_JUMP(true, num_less, constants[REG_B(word)]);
+                break;
+            }
+            case ROP_PRINT: {
+                write_value(cur_vm->out, regs[REG_A(word)]);
+                fputc('\n', cur_vm->out);
+                break;
+            }
+            case ROP_DEFINE_GLOBAL: {
+                insert(&cur_vm->globals, GET_STR_VAL(constants[REG_BX(word)]), regs[REG_A(word)]);
+                break;
+            }
+            case ROP_GET_GLOBAL: {
+                ObjectStr_t *global_name = GET_STR_VAL(constants[REG_BX(word)]);
+                Value_t *value = get(&cur_vm->globals, global_name);
+                if (value == NULL) {
+                    throw_runtime_error("This variable has not been defined '%s'",
+                                        global_name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                regs[REG_A(word)] = *value;
+                break;
+            }
+            case ROP_SET_GLOBAL: {
+                ObjectStr_t *global_name = GET_STR_VAL(constants[REG_BX(word)]);
+                if (insert(&cur_vm->globals, global_name, regs[REG_A(word)])) {
+                    drop(&cur_vm->globals, global_name);
+                    throw_runtime_error("Undefined variable name '%s' LET's define it!",
+                                        global_name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_GET_UPVALUE: {
+                regs[REG_A(word)] = *frame->closure->upvalues[REG_B(word)]->location;
+                break;
+            }
+            case ROP_SET_UPVALUE: {
+                *frame->closure->upvalues[REG_B(word)]->location = regs[REG_A(word)];
+                break;
+            }
+            case ROP_GET_ENCLOSING: {
+                regs[REG_A(word)] = frame[-1].slots[REG_B(word)];
+                break;
+            }
+            case ROP_SET_ENCLOSING: {
+                frame[-1].slots[REG_B(word)] = regs[REG_A(word)];
+                break;
+            }
+            case ROP_CLOSE_UPVALUE: {
+                close_upvalues(regs + REG_A(word));
+                break;
+            }
+            case ROP_CALL:
+            case ROP_INVOKE:
+            case ROP_SUPER_INVOKE: {
+                int base = REG_A(word);
+                int arg_cnt = REG_B(word);
+                bool ok;
+                if (REG_OP(word) == ROP_CALL && IS_CLOSURE(regs[base])) {
+                    // pushing a frame allocates nothing, so nothing needs clearing
+                    cur_vm->stack_top = regs + base + arg_cnt + 1;
+                    ok = call_closure(GET_CLOSURE(regs[base]), arg_cnt);
+                } else if (REG_OP(word) == ROP_CALL) {
+                    lower_top(regs + base + arg_cnt + 1);
+                    ok = call_value(regs[base], arg_cnt);
+                } else if (REG_OP(word) == ROP_INVOKE) {
+                    ObjectStr_t *method = READ_NAME();
+                    lower_top(regs + base + arg_cnt + 1);
+                    ok = invoke(method, arg_cnt);
+                } else {
+                    ObjectStr_t *method = READ_NAME();
+                    ObjectClass_t *superclass = GET_CLASS(regs[base + arg_cnt + 1]);
+                    lower_top(regs + base + arg_cnt + 1);
+                    ok = invoke_from_class(superclass, method, arg_cnt);
+                }
+                if (!ok) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // fibers switch to frames that are already running
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+                if (frame->reg_pc == NULL && !begin_frame(frame)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // natives and classes without init leave the result in R[base]
+                LOAD_FRAME();
+                break;
+            }
+            case ROP_RETURN: {
+                Value_t res = regs[REG_A(word)];
+                close_upvalues(frame->slots);
+                cur_vm->frame_cnt--;
+                if (cur_vm->frame_cnt == 0) {
+                    cur_vm->stack_top = cur_vm->stack;
+                    return INTERPRET_OK;
+                }
+
+                if (cur_vm->fiber != NULL && cur_vm->frame_cnt == cur_vm->fiber->frame_base) {
+                    // a fiber's function returned, the result goes to the
+                    // register of the call that resumed it
+                    frame->slots[-1] = res;
+                    cur_vm->stack_top = frame->slots;
+                    if (!finish_fiber()) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+                    if (frame->reg_pc == NULL && !begin_frame(frame)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+                frame->slots[0] = res; // the callee register of the caller
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case ROP_CLOSURE: {
+                ObjectFunc_t *func = GET_FUNC(constants[REG_BX(word)]);
+                if (func->upvalue_cnt == 0) {
+                    regs[REG_A(word)] = DECL_OBJ_VAL(func->shared_closure);
+                    break;
+                }
+                ObjectClosure_t *closure = create_closure(func);
+                regs[REG_A(word)] = DECL_OBJ_VAL(closure);
+                for (int i = 0; i < closure->upvalue_cnt; i++) {
+                    uint32_t upvalue = READ_WORD();
+                    if (REG_OP(upvalue)) {
+                        closure->upvalues[i] = capture_upvalue(regs + REG_A(upvalue));
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[REG_A(upvalue)];
+                    }
+                }
+                break;
+            }
+            case ROP_STACK_CLOSURE: {
+                regs[REG_A(word)] = DECL_OBJ_VAL(GET_FUNC(constants[REG_BX(word)])->shared_closure);
+                break;
+            }
+            case ROP_CLASS: {
+                regs[REG_A(word)] =
+                    DECL_OBJ_VAL(create_class(GET_STR_VAL(constants[REG_BX(word)])));
+                break;
+            }
+            case ROP_GET_PROPERTY: {
+                Value_t object = regs[REG_B(word)];
+                ObjectStr_t *name = READ_NAME();
+                if (!IS_INSTANCE(object)) {
+                    throw_runtime_error("Only instances of a class have fields");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ObjectInstance_t *instance = GET_INSTANCE(object);
+                Value_t *value = get(&instance->fields, name);
+                if (value) {
+                    regs[REG_A(word)] = *value;
+                    break;
+                }
+                push(object);
+                if (!bind_method(instance->class_, name)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                regs[REG_A(word)] = pop();
+                break;
+            }
+            case ROP_SET_PROPERTY: {
+                Value_t object = regs[REG_A(word)];
+                ObjectStr_t *name = READ_NAME();
+                if (!IS_INSTANCE(object)) {
+                    throw_runtime_error("Only instances can have fields");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                set_field(GET_INSTANCE(object), name, regs[REG_B(word)]);
+                break;
+            }
+            case ROP_METHOD: {
+                push(regs[REG_A(word)]);
+                push(regs[REG_B(word)]);
+                define_method(READ_NAME());
+                pop();
+                break;
+            }
+            case ROP_INHERIT: {
+                Value_t superclass = regs[REG_A(word)];
+                if (!IS_CLASS(superclass)) {
+                    throw_runtime_error("You tried to inherit from something "
+                                        "that wasn't a class :(");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                inherit(GET_CLASS(superclass), GET_CLASS(regs[REG_B(word)]));
+                break;
+            }
+            case ROP_GET_SUPER: {
+                ObjectStr_t *name = READ_NAME();
+                push(regs[REG_B(word)]);
+                if (!bind_method(GET_CLASS(regs[REG_C(word)]), name)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                regs[REG_A(word)] = pop();
+                break;
+            }
+            case ROP_BUILD_LIST: {
+                int elem_cnt = REG_B(word);
+                ObjectList_t *list = create_list();
+                push(DECL_OBJ_VAL(list)); // GC bug
+                if (elem_cnt > 0) {
+                    list->items.values = resize(NULL, sizeof(Value_t), 0, elem_cnt);
+                    list->items.capacity = elem_cnt;
+                    memcpy(list->items.values, regs + REG_A(word), sizeof(Value_t) * elem_cnt);
+                    list->items.count = elem_cnt;
+                }
+                regs[REG_A(word)] = pop();
+                break;
+            }
+            case ROP_INDEX_GET: {
+                if (!index_get(regs[REG_B(word)], regs[REG_C(word)], &regs[REG_A(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case ROP_INDEX_SET: {
+                if (!index_set(regs[REG_A(word)], regs[REG_B(word)], regs[REG_C(word)])) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+        }
+    }
+#undef READ_WORD
+#undef LOAD_FRAME
+#undef READ_NAME
+}
@@ -1,6 +1,6 @@
 #include "../includes/scanner.h"
 
-Scanner_t scanner;
+THREAD_LOCAL Scanner_t scanner;
 
 bool at_end();
 bool is_digit(char c);
@@ -75,6 +75,10 @@ Token_t scan_token() {
             return init_token(TOKEN_OPEN_CURLY);
         case '}':
             return init_token(TOKEN_CLOSE_CURLY);
+        case '[':
+            return init_token(TOKEN_OPEN_BRACKET);
+        case ']':
+            return init_token(TOKEN_CLOSE_BRACKET);
         case ',':
             return init_token(TOKEN_COMMA);
         case '.':
@@ -87,6 +91,14 @@ Token_t scan_token() {
             return init_token(TOKEN_MUL);
         case '/':
             return init_token(TOKEN_DIV);
+        case '%':
+            return init_token(TOKEN_MOD);
+        case '&':
+            return init_token(TOKEN_BIT_AND);
+        case '|':
+            return init_token(TOKEN_BIT_OR);
+        case '^':
+            return init_token(TOKEN_BIT_XOR);
         case ';':
             return init_token(TOKEN_SEMICOLON);
         case '!':
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+
+#include "../includes/server.h"
+#include "../includes/batch.h"
+#include "../includes/memory.h"
+#include "../includes/vm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Prefork server: the prelude runs once in the server's vm, then every worker
+ * is a fork() of that process and starts with the compiled prelude and its
+ * heap shared copy-on-write. Idle workers block in accept() on the listening
+ * socket the server made before forking them. A job is the script's source
+ * sent by the client up to EOF, the reply is "<exit status>\n" followed by
+ * everything the script printed, errors included.
+ *
+ * When a worker accepts a job it writes its pid to the report pipe, which is
+ * how the server knows it is busy and forks a replacement, so the pool always
+ * has worker_cnt idle workers ready. Workers exit after their one job, so no
+ * job sees the globals another left behind.
+ */
+
+typedef struct {
+    pid_t pid;
+    double started_ms; // 0 while it waits in accept()
+    bool is_killed;    // for running over the timeout
+} Worker_t;
+
+typedef struct {
+    vm_t *vm;
+    int listen_fd;
+    int report_fds[2]; // workers write their pid to [1] when they take a job
+    Worker_t *workers;
+    int worker_cnt;
+    int worker_capacity;
+    int idle_target;
+    double timeout_ms;
+} Server_t;
+
+static volatile sig_atomic_t is_stopping = 0;
+
+static void on_stop(int signal) {
+    is_stopping = 1;
+}
+
+// only there so poll() returns as soon as a worker exits
+static void on_child(int signal) {
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// everything up to EOF as a string the caller frees
+static char *read_all(int fd, size_t *size) {
+    size_t capacity = 4096;
+    char *data = (char *)malloc(capacity);
+    *size = 0;
+    while (data != NULL) {
+        if (*size + 1 == capacity) {
+            capacity *= 2;
+            data = (char *)realloc(data, capacity);
+            continue;
+        }
+        ssize_t n = read(fd, data + *size, capacity - *size - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            data[*size] = '\0';
+            break;
+        }
+        *size += n;
+    }
+    return data;
+}
+
+static bool unix_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: socket path \"%s\" is too long\n", path);
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static void serve_job(Server_t *server) {
+    int client;
+    do {
+        client = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (client < 0 && errno == EINTR);
+    if (client < 0) {
+        _exit(74);
+    }
+    pid_t pid = getpid();
+    write_all(server->report_fds[1], (const char *)&pid, sizeof(pid));
+
+    size_t code_size;
+    char *code = read_all(client, &code_size);
+    char *output = NULL;
+    size_t output_size = 0;
+    FILE *out = open_memstream(&output, &output_size);
+    vm_t *vm = server->vm;
+    vm->out = out;
+    vm->err = out;
+    InterpretResult_t result = interpret(vm, code);
+    int status = result == INTERPRET_COMPILE_ERROR   ? 65
+                 : result == INTERPRET_RUNTIME_ERROR ? 70
+                                                     : 0;
+    fclose(out);
+
+    char header[16];
+    int header_size = snprintf(header, sizeof(header), "%d\n", status);
+    if (write_all(client, header, header_size)) {
+        write_all(client, output, output_size);
+    }
+    close(client);
+    // the process ends here, so the vm and buffers are left to the kernel
+    _exit(0);
+}
+
+static bool spawn_worker(Server_t *server) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        close(server->report_fds[0]);
+        serve_job(server);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Server: cannot fork a worker: %s\n", strerror(errno));
+        return false;
+    }
+    if (server->worker_cnt == server->worker_capacity) {
+        server->worker_capacity = grow_capacity(server->worker_capacity);
+        server->workers =
+            (Worker_t *)realloc(server->workers, sizeof(Worker_t) * server->worker_capacity);
+        if (server->workers == NULL) {
+            exit(1);
+        }
+    }
+    server->workers[server->worker_cnt++] = (Worker_t){pid, 0, false};
+    return true;
+}
+
+static Worker_t *find_worker(Server_t *server, pid_t pid) {
+    for (int i = 0; i < server->worker_cnt; i++) {
+        if (server->workers[i].pid == pid) {
+            return &server->workers[i];
+        }
+    }
+    return NULL;
+}
+
+static int idle_cnt(Server_t *server) {
+    int cnt = 0;
+    for (int i = 0; i < server->worker_cnt; i++) {
+        cnt += server->workers[i].started_ms == 0;
+    }
+    return cnt;
+}
+
+static void read_reports(Server_t *server) {
+    pid_t pids[64];
+    ssize_t n = read(server->report_fds[0], pids, sizeof(pids));
+    double now = now_ms();
+    for (int i = 0; i < n / (ssize_t)sizeof(pid_t); i++) {
+        Worker_t *worker = find_worker(server, pids[i]);
+        if (worker != NULL) {
+            worker->started_ms = now;
+        }
+    }
+}
+
+static void reap_workers(Server_t *server) {
+    int wait_status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
+        Worker_t *worker = find_worker(server, pid);
+        if (worker == NULL) {
+            continue;
+        }
+        if (worker->is_killed) {
+            fprintf(stderr, "Server: killed worker %d after %.0f ms\n", pid, server->timeout_ms);
+        } else if (WIFSIGNALED(wait_status)) {
+            fprintf(stderr, "Server: worker %d died of signal %d\n", pid, WTERMSIG(wait_status));
+        }
+        *worker = server->workers[--server->worker_cnt];
+    }
+}
+
+// kills the workers past the timeout, returns how long until the next one is
+static int enforce_timeout(Server_t *server) {
+    if (server->timeout_ms <= 0) {
+        return -1;
+    }
+    double now = now_ms();
+    double next = -1;
+    for (int i = 0; i < server->worker_cnt; i++) {
+        Worker_t *worker = &server->workers[i];
+        if (worker->started_ms == 0 || worker->is_killed) {
+            continue;
+        }
+        double left = worker->started_ms + server->timeout_ms - now;
+        if (left <= 0) {
+            kill(worker->pid, SIGKILL);
+            worker->is_killed = true;
+        } else if (next < 0 || left < next) {
+            next = left;
+        }
+    }
+    return next < 0 ? -1 : (int)next + 1;
+}
+
+static void stop_workers(Server_t *server) {
+    for (int i = 0; i < server->worker_cnt; i++) {
+        kill(server->workers[i].pid, SIGTERM);
+    }
+    for (int i = 0; i < server->worker_cnt; i++) {
+        waitpid(server->workers[i].pid, NULL, 0);
+    }
+    server->worker_cnt = 0;
+}
+
+int run_server(const char *socket_path, const char *prelude_path, int worker_cnt,
+               double timeout_ms, bool use_registers) {
+    struct sockaddr_un addr;
+    if (!unix_address(socket_path, &addr)) {
+        return 64;
+    }
+
+    Server_t server;
+    server.vm = create_vm();
+    server.vm->use_registers = use_registers;
+    server.workers = NULL;
+    server.worker_cnt = 0;
+    server.worker_capacity = 0;
+    server.idle_target = worker_cnt > 0 ? worker_cnt : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    server.timeout_ms = timeout_ms;
+
+    if (prelude_path != NULL) {
+        char *code = read_script(prelude_path);
+        if (code == NULL) {
+            fprintf(stderr, "Error: invalid path \"%s\"\n", prelude_path);
+            return 74;
+        }
+        InterpretResult_t result = interpret(server.vm, code);
+        free(code);
+        if (result != INTERPRET_OK) {
+            return result == INTERPRET_COMPILE_ERROR ? 65 : 70;
+        }
+        // workers share the heap only as long as nobody writes to it, so
+        // collect now rather than in every worker's first job
+        vm_t *prev = cur_vm;
+        cur_vm = server.vm;
+        collect_garbage();
+        cur_vm = prev;
+    }
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path); // a socket file left by an earlier run
+    if (server.listen_fd < 0 ||
+        bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server.listen_fd, 128) < 0) {
+        fprintf(stderr, "Error: cannot listen on \"%s\": %s\n", socket_path, strerror(errno));
+        return 74;
+    }
+    if (pipe2(server.report_fds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "Error: cannot create a pipe: %s\n", strerror(errno));
+        return 74;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = on_child;
+    action.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, NULL);
+
+    fprintf(stderr, "Serving on %s with %d workers\n", socket_path, server.idle_target);
+    while (!is_stopping) {
+        while (idle_cnt(&server) < server.idle_target && spawn_worker(&server)) {
+        }
+        struct pollfd pfd = {server.report_fds[0], POLLIN, 0};
+        if (poll(&pfd, 1, enforce_timeout(&server)) > 0) {
+            read_reports(&server);
+        }
+        reap_workers(&server);
+        enforce_timeout(&server);
+    }
+
+    stop_workers(&server);
+    close(server.listen_fd);
+    close(server.report_fds[0]);
+    close(server.report_fds[1]);
+    unlink(socket_path);
+    free(server.workers);
+    free_vm(server.vm);
+    return 0;
+}
+
+int run_client(const char *socket_path, const char *path) {
+    struct sockaddr_un addr;
+    if (!unix_address(socket_path, &addr)) {
+        return 64;
+    }
+    char *code = read_script(path);
+    if (code == NULL) {
+        fprintf(stderr, "Error: invalid path \"%s\"\n", path);
+        return 74;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: cannot connect to \"%s\": %s\n", socket_path, strerror(errno));
+        free(code);
+        return 74;
+    }
+    bool is_sent = write_all(fd, code, strlen(code));
+    free(code);
+    shutdown(fd, SHUT_WR);
+
+    size_t size = 0;
+    char *reply = is_sent ? read_all(fd, &size) : NULL;
+    close(fd);
+    char *body = reply == NULL ? NULL : memchr(reply, '\n', size);
+    if (body == NULL) {
+        // killed for running too long or crashed before it could answer
+        fprintf(stderr, "Error: the server dropped the job\n");
+        free(reply);
+        return 70;
+    }
+    int status = atoi(reply);
+    body++;
+    fwrite(body, 1, size - (body - reply), stdout);
+    free(reply);
+    return status;
+}
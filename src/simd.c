@@ -0,0 +1,389 @@
+#include "../includes/simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+Float64Kernels_t f64_kernels;
+
+// ------------------------- Scalar Fallbacks ------------------------ //
+
+static double sum_scalar(const double *a, int n) {
+    double res = 0;
+    for (int i = 0; i < n; i++) {
+        res += a[i];
+    }
+    return res;
+}
+
+// every level returns the first NaN in the array if there is one. Vector
+// min/max return the second operand when either is NaN, so the vector kernels
+// watch for NaN lanes and hand such arrays to the scalar ones
+static inline double min_step(double res, double x) {
+    return x < res || x != x ? x : res;
+}
+
+static inline double max_step(double res, double x) {
+    return x > res || x != x ? x : res;
+}
+
+static double min_scalar(const double *a, int n) {
+    double res = a[0];
+    for (int i = 1; i < n && res == res; i++) {
+        res = min_step(res, a[i]);
+    }
+    return res;
+}
+
+static double max_scalar(const double *a, int n) {
+    double res = a[0];
+    for (int i = 1; i < n && res == res; i++) {
+        res = max_step(res, a[i]);
+    }
+    return res;
+}
+
+static double dot_scalar(const double *a, const double *b, int n) {
+    double res = 0;
+    for (int i = 0; i < n; i++) {
+        res += a[i] * b[i];
+    }
+    return res;
+}
+
+static void scale_scalar(double *a, double k, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] *= k;
+    }
+}
+
+static void add_scalar(double *a, const double *b, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] += b[i];
+    }
+}
+
+static void fill_scalar(double *a, double v, int n) {
+    for (int i = 0; i < n; i++) {
+        a[i] = v;
+    }
+}
+
+static void prefix_sum_scalar(double *a, int n) {
+    for (int i = 1; i < n; i++) {
+        a[i] += a[i - 1];
+    }
+}
+
+#ifdef SIMD_X86
+
+// ------------------------------ SSE2 ------------------------------- //
+// loads/stores are unaligned since the buffers live inside heap objects
+
+__attribute__((target("sse2"))) static double sum_sse2(const double *a, int n) {
+    __m128d acc_0 = _mm_setzero_pd();
+    __m128d acc_1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc_0 = _mm_add_pd(acc_0, _mm_loadu_pd(a + i));
+        acc_1 = _mm_add_pd(acc_1, _mm_loadu_pd(a + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc_0, acc_1));
+    double res = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+        res += a[i];
+    }
+    return res;
+}
+
+__attribute__((target("sse2"))) static double min_sse2(const double *a, int n) {
+    if (n < 2) {
+        return min_scalar(a, n);
+    }
+    __m128d acc = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(acc, acc);
+    int i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        acc = _mm_min_pd(acc, x);
+    }
+    if (_mm_movemask_pd(nan) != 0) {
+        return min_scalar(a, n);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double res = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    for (; i < n; i++) {
+        res = min_step(res, a[i]);
+    }
+    return res;
+}
+
+__attribute__((target("sse2"))) static double max_sse2(const double *a, int n) {
+    if (n < 2) {
+        return max_scalar(a, n);
+    }
+    __m128d acc = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(acc, acc);
+    int i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        acc = _mm_max_pd(acc, x);
+    }
+    if (_mm_movemask_pd(nan) != 0) {
+        return max_scalar(a, n);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    double res = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < n; i++) {
+        res = max_step(res, a[i]);
+    }
+    return res;
+}
+
+__attribute__((target("sse2"))) static double dot_sse2(const double *a, const double *b,
+                                                       int n) {
+    __m128d acc_0 = _mm_setzero_pd();
+    __m128d acc_1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc_0 = _mm_add_pd(acc_0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc_1 = _mm_add_pd(acc_1,
+                           _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(acc_0, acc_1));
+    double res = lanes[0] + lanes[1];
+    for (; i < n; i++) {
+        res += a[i] * b[i];
+    }
+    return res;
+}
+
+__attribute__((target("sse2"))) static void scale_sse2(double *a, double k, int n) {
+    __m128d factor = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    }
+    for (; i < n; i++) {
+        a[i] *= k;
+    }
+}
+
+__attribute__((target("sse2"))) static void add_sse2(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        a[i] += b[i];
+    }
+}
+
+__attribute__((target("sse2"))) static void fill_sse2(double *a, double v, int n) {
+    __m128d value = _mm_set1_pd(v);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(a + i, value);
+    }
+    for (; i < n; i++) {
+        a[i] = v;
+    }
+}
+
+// in-register scan of each pair, then add the running total carried across
+__attribute__((target("sse2"))) static void prefix_sum_sse2(double *a, int n) {
+    __m128d carry = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x)); // [a, a + b]
+        x = _mm_add_pd(x, carry);
+        _mm_storeu_pd(a + i, x);
+        carry = _mm_unpackhi_pd(x, x);
+    }
+    double total = _mm_cvtsd_f64(carry);
+    for (; i < n; i++) {
+        total += a[i];
+        a[i] = total;
+    }
+}
+
+// ------------------------------ AVX2 ------------------------------- //
+
+__attribute__((target("avx2"))) static double hsum_avx2(__m256d x) {
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+__attribute__((target("avx2"))) static double sum_avx2(const double *a, int n) {
+    __m256d acc_0 = _mm256_setzero_pd();
+    __m256d acc_1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc_0 = _mm256_add_pd(acc_0, _mm256_loadu_pd(a + i));
+        acc_1 = _mm256_add_pd(acc_1, _mm256_loadu_pd(a + i + 4));
+    }
+    double res = hsum_avx2(_mm256_add_pd(acc_0, acc_1));
+    for (; i < n; i++) {
+        res += a[i];
+    }
+    return res;
+}
+
+__attribute__((target("avx2"))) static double min_avx2(const double *a, int n) {
+    if (n < 4) {
+        return min_scalar(a, n);
+    }
+    __m256d acc = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        acc = _mm256_min_pd(acc, x);
+    }
+    if (_mm256_movemask_pd(nan) != 0) {
+        return min_scalar(a, n);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double res = min_scalar(lanes, 4);
+    for (; i < n; i++) {
+        res = min_step(res, a[i]);
+    }
+    return res;
+}
+
+__attribute__((target("avx2"))) static double max_avx2(const double *a, int n) {
+    if (n < 4) {
+        return max_scalar(a, n);
+    }
+    __m256d acc = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        acc = _mm256_max_pd(acc, x);
+    }
+    if (_mm256_movemask_pd(nan) != 0) {
+        return max_scalar(a, n);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double res = max_scalar(lanes, 4);
+    for (; i < n; i++) {
+        res = max_step(res, a[i]);
+    }
+    return res;
+}
+
+__attribute__((target("avx2,fma"))) static double dot_avx2(const double *a, const double *b,
+                                                           int n) {
+    __m256d acc_0 = _mm256_setzero_pd();
+    __m256d acc_1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc_0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc_0);
+        acc_1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), acc_1);
+    }
+    double res = hsum_avx2(_mm256_add_pd(acc_0, acc_1));
+    for (; i < n; i++) {
+        res += a[i] * b[i];
+    }
+    return res;
+}
+
+__attribute__((target("avx2"))) static void scale_avx2(double *a, double k, int n) {
+    __m256d factor = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    }
+    for (; i < n; i++) {
+        a[i] *= k;
+    }
+}
+
+__attribute__((target("avx2"))) static void add_avx2(double *a, const double *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        a[i] += b[i];
+    }
+}
+
+__attribute__((target("avx2"))) static void fill_avx2(double *a, double v, int n) {
+    __m256d value = _mm256_set1_pd(v);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(a + i, value);
+    }
+    for (; i < n; i++) {
+        a[i] = v;
+    }
+}
+
+/*
+ * x        = [a, b, c, d]
+ * shift 1  = [a, a + b, b + c, c + d]
+ * shift 2  = [a, a + b, a + b + c, a + b + c + d]
+ * + carry (last element of the previous block broadcast to every lane)
+ */
+__attribute__((target("avx2"))) static void prefix_sum_avx2(double *a, int n) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d shift_1 = _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x90), zero, 0x1);
+        x = _mm256_add_pd(x, shift_1);
+        __m256d shift_2 = _mm256_permute2f128_pd(x, x, 0x08);
+        x = _mm256_add_pd(x, shift_2);
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(a + i, x);
+        carry = _mm256_permute4x64_pd(x, 0xFF);
+    }
+    double total = _mm256_cvtsd_f64(carry);
+    for (; i < n; i++) {
+        total += a[i];
+        a[i] = total;
+    }
+}
+
+#endif
+
+// GLIDE_SIMD=scalar|sse2 caps the kernel level (handy for comparing results)
+void init_simd_kernels() {
+    const char *cap = getenv("GLIDE_SIMD");
+    f64_kernels = (Float64Kernels_t){"scalar",  sum_scalar,   min_scalar,
+                                     max_scalar, dot_scalar,  scale_scalar,
+                                     add_scalar, fill_scalar, prefix_sum_scalar};
+#ifdef SIMD_X86
+    if (cap != NULL && strcmp(cap, "scalar") == 0) {
+        return;
+    }
+    __builtin_cpu_init();
+    bool allow_avx2 = cap == NULL || strcmp(cap, "sse2") != 0;
+    if (allow_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        f64_kernels = (Float64Kernels_t){"avx2",   sum_avx2,   min_avx2,
+                                         max_avx2, dot_avx2,   scale_avx2,
+                                         add_avx2, fill_avx2,  prefix_sum_avx2};
+    } else if (__builtin_cpu_supports("sse2")) {
+        f64_kernels = (Float64Kernels_t){"sse2",   sum_sse2,   min_sse2,
+                                         max_sse2, dot_sse2,   scale_sse2,
+                                         add_sse2, fill_sse2,  prefix_sum_sse2};
+    }
+#else
+    (void)cap;
+#endif
+}
@@ -2,6 +2,8 @@
 #include "../includes/memory.h"
 #include "../includes/object.h"
 
+#include <inttypes.h>
+
 // init / reset method for value arrays
 void init_value_array(ValueArray_t *array) {
     array->capacity = 0;
@@ -23,79 +25,144 @@ void write_value_array(ValueArray_t *array, Value_t value) {
 
 // free value array helper function
 void free_value_array(ValueArray_t *array) {
-    free(array->values);
+    FREE_ARRAY(Value_t, array->values, array->capacity);
     init_value_array(array);
 }
 
-void print_func(ObjectFunc_t *func) {
+void print_func(FILE *out, ObjectFunc_t *func) {
     if (func->name == NULL) {
-        printf("<script>");
+        fprintf(out, "<script>");
         return;
     }
-    printf("<fn %s>", func->name->chars);
+    fprintf(out, "<fn %s>", func->name->chars);
 }
 
-void print_object(Value_t value) {
+void print_object(FILE *out, Value_t value) {
     Object_t *obj = GET_OBJ_VAL(value);
     switch (obj->type) {
         case OBJ_STR:
-            printf("%s", GET_CSTR_VAL(value));
+            fprintf(out, "%s", GET_CSTR_VAL(value));
             break;
         case OBJ_FUNC:
-            print_func((ObjectFunc_t *)obj);
+            print_func(out, (ObjectFunc_t *)obj);
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            fprintf(out, "<native fn>");
             break;
         case OBJ_CLOSURE:
-            print_func(GET_CLOSURE(value)->func);
+            print_func(out, GET_CLOSURE(value)->func);
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            fprintf(out, "upvalue");
             break;
         case OBJ_CLASS:
-            printf("%s", GET_CLASS(value)->name->chars);
+            fprintf(out, "%s", GET_CLASS(value)->name->chars);
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", GET_INSTANCE(value)->class_->name->chars);
+            fprintf(out, "%s instance", GET_INSTANCE(value)->class_->name->chars);
             break;
         case OBJ_BOUND_METHOD:
-            print_func(GET_BOUND_METHOD(value)->method->func);
+            print_func(out, GET_BOUND_METHOD(value)->method->func);
+            break;
+        case OBJ_LIST: {
+            ValueArray_t *items = &GET_LIST(value)->items;
+            fprintf(out, "[");
+            for (int i = 0; i < items->count; i++) {
+                if (i > 0) {
+                    fprintf(out, ", ");
+                }
+                write_value(out, items->values[i]);
+            }
+            fprintf(out, "]");
             break;
+        }
+        case OBJ_F64_ARRAY: {
+            ObjectFloat64Array_t *array = GET_F64_ARRAY(value);
+            fprintf(out, "Float64Array[");
+            for (int i = 0; i < array->length; i++) {
+                fprintf(out, i > 0 ? ", %g" : "%g", array->data[i]);
+            }
+            fprintf(out, "]");
+            break;
+        }
+        case OBJ_FIBER:
+            fprintf(out, "<fiber>");
+            break;
+        case OBJ_ISOLATE:
+            fprintf(out, "<isolate>");
+            break;
+        case OBJ_MAP: {
+            ValueTable_t *entries = &GET_MAP(value)->entries;
+            bool first = true;
+            fprintf(out, "{");
+            for (int i = 0; i < entries->capacity; i++) {
+                if (!entries->table[i].is_used) {
+                    continue;
+                }
+                fprintf(out, first ? "" : ", ");
+                write_value(out, entries->table[i].key);
+                fprintf(out, ": ");
+                write_value(out, entries->table[i].value);
+                first = false;
+            }
+            fprintf(out, "}");
+            break;
+        }
     }
 }
 
-// print value helper function for other disassembler
-void print_value(Value_t value) {
+// writes value the way the print statement shows it
+void write_value(FILE *out, Value_t value) {
     switch (value.type) {
         case VAL_BOOL:
-            printf(GET_BOOL_VAL(value) ? "true" : "false");
+            fprintf(out, GET_BOOL_VAL(value) ? "true" : "false");
             break;
         case VAL_NONE:
-            printf("none");
+            fprintf(out, "none");
             break;
         case VAL_NUM:
-            printf("%g", GET_NUM_VAL(value));
+            fprintf(out, "%g", GET_NUM_VAL(value));
+            break;
+        case VAL_INT:
+            fprintf(out, "%" PRId64, GET_INT_VAL(value));
             break;
         case VAL_OBJ:
-            print_object(value);
+            print_object(out, value);
             break;
     }
 }
 
+// print value helper function for other disassembler
+void print_value(Value_t value) {
+    write_value(stdout, value);
+}
+
 bool equals(Value_t a, Value_t b) {
     if (a.type != b.type) {
-        return false;
+        // 1 == 1.0
+        return IS_NUMERIC_VAL(a) && IS_NUMERIC_VAL(b) && GET_DOUBLE_VAL(a) == GET_DOUBLE_VAL(b);
     }
     switch (a.type) {
         case VAL_BOOL:
             return GET_BOOL_VAL(a) == GET_BOOL_VAL(b);
         case VAL_NUM:
             return GET_NUM_VAL(a) == GET_NUM_VAL(b);
+        case VAL_INT:
+            return GET_INT_VAL(a) == GET_INT_VAL(b);
         case VAL_NONE:
             return true;
         case VAL_OBJ: {
-            return GET_OBJ_VAL(a) == GET_OBJ_VAL(b);
+            if (GET_OBJ_VAL(a) == GET_OBJ_VAL(b)) {
+                return true;
+            }
+            // whether a.m hands back a new bound method or a cached one
+            // depends on the bound cache, so they compare by what they bind
+            if (IS_BOUND_METHOD(a) && IS_BOUND_METHOD(b)) {
+                ObjectBoundMethod_t *x = GET_BOUND_METHOD(a);
+                ObjectBoundMethod_t *y = GET_BOUND_METHOD(b);
+                return x->method == y->method && equals(x->receiver, y->receiver);
+            }
+            return false;
         }
         default:
             return false;
@@ -1,93 +1,182 @@
 #include "../includes/vm.h"
 #include "../includes/debug.h"
+#include "../includes/fiber.h"
+#include "../includes/isolate.h"
 #include "../includes/memory.h"
+#include "../includes/native.h"
 #include "../includes/object.h"
+#include "../includes/optimizer.h"
+#include "../includes/register.h"
+#include "../includes/simd.h"
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
-#include <time.h>
 
 Value_t peek(int offset);
-void throw_runtime_error(const char *format, ...);
+void reset_stack();
 
-#define BINARY_OP(type, op)                                                    \
-    if (!IS_NUM_VAL(peek(0)) || !IS_NUM_VAL(peek(1))) {                        \
+// func is one of the num_* helpers from value.h, type wraps its result
+#define BINARY_OP(type, func)                                                  \
+    if (!IS_NUMERIC_VAL(peek(0)) || !IS_NUMERIC_VAL(peek(1))) {                \
         throw_runtime_error("Operands are not numbers");                       \
         return INTERPRET_RUNTIME_ERROR;                                        \
     }                                                                          \
-    double b = GET_NUM_VAL(pop());                                             \
-    double a = GET_NUM_VAL(pop());                                             \
-    push(type(a op b));
+    Value_t b = pop();                                                         \
+    Value_t a = pop();                                                         \
+    push(type(func(a, b)));
 
-vm_t vm;
+#define INT_OP(op)                                                             \
+    if (!IS_INT_VAL(peek(0)) || !IS_INT_VAL(peek(1))) {                        \
+        throw_runtime_error("Operands are not integers");                      \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    }                                                                          \
+    int64_t b = GET_INT_VAL(pop());                                            \
+    int64_t a = GET_INT_VAL(pop());                                            \
+    push(DECL_INT_VAL(a op b));
 
-void define_native(const char *name, NativeFunc_t func) {
-    push(DECL_OBJ_VAL(allocate_str(name, (int)strlen(name))));
-    push(DECL_OBJ_VAL(create_native(func)));
-    insert(&vm.globals, GET_STR_VAL(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
-}
+// operands the type inference pass proved to be numbers
+#define UNCHECKED_OP(type, func)                                               \
+    Value_t b = pop();                                                         \
+    Value_t a = pop();                                                         \
+    push(type(func(a, b)));
 
-Value_t clock_native(int arg_cnt, Value_t *args) {
-    return DECL_NUM_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+#define AS_VAL(value) (value)
 
-void init_vm() {
-    vm.stack_top = vm.stack;
-    vm.frame_cnt = 0;
-    vm.objects = NULL;
-    vm.grey_capacity = 0;
-    vm.grey_cnt = 0;
-    vm.grey_stack = NULL;
-    vm.bytes_allocated = 0;
-    vm.next_GC = 1024 * 1024;
+#define NOT_BOOL_VAL(value) DECL_BOOL_VAL(!(value))
 
-    init_hash_table(&vm.strings);
-    init_hash_table(&vm.globals);
+THREAD_LOCAL vm_t *cur_vm = NULL;
 
-    vm.init_str = NULL;
-    vm.init_str = allocate_str("init", 4);
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
 
-    define_native("clock", clock_native);
+vm_t *create_vm() {
+    vm_t *vm = (vm_t *)malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Error: not enough memory available to create a vm\n");
+        exit(74);
+    }
+    vm_t *prev = cur_vm;
+    cur_vm = vm;
+    cur_vm->stack_top = cur_vm->stack;
+    cur_vm->frame_cnt = 0;
+    // capture_upvalue() takes a non-NULL slot for an open upvalue even above
+    // open_top, and malloc may hand back a freed vm's memory
+    memset(cur_vm->open_upvalues, 0, sizeof(cur_vm->open_upvalues));
+    cur_vm->open_top = 0;
+    cur_vm->fiber = NULL;
+    init_event_loop(&cur_vm->loop);
+    cur_vm->isolate = NULL;
+    cur_vm->objects = NULL;
+    cur_vm->grey_capacity = 0;
+    cur_vm->grey_cnt = 0;
+    cur_vm->grey_stack = NULL;
+    cur_vm->bytes_allocated = 0;
+    cur_vm->next_GC = GC_MIN_HEAP;
+    cur_vm->gc_cnt = 0;
+
+    init_hash_table(&cur_vm->strings);
+    init_hash_table(&cur_vm->globals);
+    register_intern_reader(&cur_vm->intern_reader);
+
+    cur_vm->init_str = NULL;
+    flush_method_cache(NULL);
+    flush_bound_cache();
+    cur_vm->use_registers = false;
+    cur_vm->dispatch_cnt = 0;
+    cur_vm->profile = NULL;
+    cur_vm->sampler = NULL;
+
+    cur_vm->whole_program = false;
+    cur_vm->out = stdout;
+    cur_vm->err = stderr;
+
+    // allocating can collect, so everything a collection reads is set by now
+    cur_vm->init_str = allocate_str("init", 4);
+
+    // the kernels are picked once per process and shared by every vm
+    pthread_once(&kernels_once, init_simd_kernels);
+    define_natives();
+    cur_vm = prev;
+    return vm;
 }
 
-void free_vm() {
-    free_hash_table(&vm.strings);
-    free_hash_table(&vm.globals);
-    vm.init_str = NULL;
+// drops the globals and everything only they kept alive, so the vm can run
+// an unrelated program while keeping its heap and intern table warm
+void reset_vm(vm_t *vm) {
+    vm_t *prev = cur_vm;
+    cur_vm = vm;
+    reset_stack();
+    free_hash_table(&cur_vm->globals);
+    init_hash_table(&cur_vm->globals);
+    flush_method_cache(NULL);
+    flush_bound_cache();
+    define_natives();
+    collect_garbage();
+    cur_vm = prev;
+}
+
+void free_vm(vm_t *vm) {
+    vm_t *prev = cur_vm;
+    cur_vm = vm;
+#ifdef DEBUG_COUNT_DISPATCH
+    fprintf(stderr, "instructions dispatched: %zu\n", cur_vm->dispatch_cnt);
+#endif
+    if (cur_vm->sampler != NULL) {
+        // stops its timer before the frames it reads go away
+        free_sampler(cur_vm->sampler);
+        cur_vm->sampler = NULL;
+    }
+    free_hash_table(&cur_vm->strings);
+    free_hash_table(&cur_vm->globals);
+    cur_vm->init_str = NULL;
+    free_event_loop(&cur_vm->loop);
     free_objects();
+    if (cur_vm->isolate != NULL) {
+        release_isolate(cur_vm->isolate);
+    }
+    unregister_intern_reader(&cur_vm->intern_reader);
+    if (cur_vm->profile != NULL) {
+        free_profile(cur_vm->profile);
+    }
+    reclaim_shared_strs();
+    cur_vm = prev == vm ? NULL : prev;
+    free(vm);
 }
 
 void push(Value_t value) {
-    *vm.stack_top = value;
-    vm.stack_top++;
+    *cur_vm->stack_top = value;
+    cur_vm->stack_top++;
 }
 
 Value_t pop() {
-    vm.stack_top--;
-    return *vm.stack_top;
+    cur_vm->stack_top--;
+    return *cur_vm->stack_top;
 }
 
 Value_t peek(int offset) {
-    return vm.stack_top[-1 - offset];
+    return cur_vm->stack_top[-1 - offset];
 }
 
-static bool call(ObjectClosure_t *closure, int arg_cnt) {
+bool call_closure(ObjectClosure_t *closure, int arg_cnt) {
     if (arg_cnt != closure->func->num_params) {
         throw_runtime_error("Expected %d parameters but got %d",
                             closure->func->num_params, arg_cnt);
         return false;
     }
 
-    if (vm.frame_cnt == 64) {
+    if (cur_vm->frame_cnt == 64) {
         throw_runtime_error("Stack overflow");
         return false;
     }
-    CallFrame_t *frame = &vm.frames[vm.frame_cnt++];
+    CallFrame_t *frame = &cur_vm->frames[cur_vm->frame_cnt];
     frame->closure = closure;
     frame->pc = closure->func->chunk.code;
-    frame->slots = vm.stack_top - arg_cnt - 1;
+    frame->reg_pc = NULL;
+    frame->slots = cur_vm->stack_top - arg_cnt - 1;
+    // counted once whole, a sampling signal may read the frames in between
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    cur_vm->frame_cnt++;
     return true;
 }
 
@@ -95,34 +184,46 @@ bool call_value(Value_t callee, int arg_cnt) {
     if (IS_OBJ_VAL(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_CLOSURE:
-                return call(GET_CLOSURE(callee), arg_cnt);
+                return call_closure(GET_CLOSURE(callee), arg_cnt);
             case OBJ_NATIVE: {
-                NativeFunc_t native = GET_NATIVE(callee);
-                Value_t res = native(arg_cnt, vm.stack_top - arg_cnt);
-                vm.stack_top -= arg_cnt + 1;
-                push(res);
+                ObjectNative_t *native = (ObjectNative_t *)GET_OBJ_VAL(callee);
+                if (native->arity != -1 && arg_cnt != native->arity) {
+                    throw_runtime_error("Expected %d parameters but got %d",
+                                        native->arity, arg_cnt);
+                    return false;
+                }
+                // result is written over the callee slot
+                if (!native->func(arg_cnt, cur_vm->stack_top - arg_cnt)) {
+                    return false;
+                }
+                cur_vm->stack_top -= arg_cnt;
                 return true;
             }
             case OBJ_CLASS: {
                 ObjectClass_t *class_ = GET_CLASS(callee);
-                vm.stack_top[-arg_cnt - 1] =
+                cur_vm->stack_top[-arg_cnt - 1] =
                     DECL_OBJ_VAL(create_instance(class_));
-                // constructor check
-                Value_t *constructor = get(&class_->methods, vm.init_str);
-                if (constructor) {
-                    return call(GET_CLOSURE(*constructor), arg_cnt);
+                if (class_->initializer != NULL) {
+                    return call_closure(class_->initializer, arg_cnt);
                 } else if (arg_cnt != 0) {
                     throw_runtime_error("Class without initializer expected 0 "
                                         "arguments but got %d",
                                         arg_cnt);
+                    return false;
                 }
                 return true;
             }
             case OBJ_BOUND_METHOD: {
                 ObjectBoundMethod_t *bound = GET_BOUND_METHOD(callee);
-                vm.stack_top[-arg_cnt - 1] = bound->receiver;
-                return call(bound->method, arg_cnt);
+                cur_vm->stack_top[-arg_cnt - 1] = bound->receiver;
+                return call_closure(bound->method, arg_cnt);
             }
+            case OBJ_FIBER:
+                if (GET_FIBER(callee)->is_task) {
+                    throw_runtime_error("Cannot resume a task, run_loop() runs it");
+                    return false;
+                }
+                return resume_fiber(GET_FIBER(callee), arg_cnt);
             default:
                 break;
         }
@@ -133,29 +234,46 @@ bool call_value(Value_t callee, int arg_cnt) {
 }
 
 void reset_stack() {
-    vm.stack_top = vm.stack;
-    vm.frame_cnt = 0;
-    vm.open_upvalues = NULL;
+    cur_vm->stack_top = cur_vm->stack;
+    cur_vm->frame_cnt = 0;
+    for (int slot = 0; slot < cur_vm->open_top; slot++) {
+        cur_vm->open_upvalues[slot] = NULL;
+    }
+    cur_vm->open_top = 0;
+    abandon_fibers();
 }
 
 void throw_runtime_error(const char *format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(cur_vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", cur_vm->err);
 
     // print stack trace
-    for (int i = vm.frame_cnt - 1; i >= 0; i--) {
-        CallFrame_t *frame = &vm.frames[i];
+    for (int i = cur_vm->frame_cnt - 1; i >= 0; i--) {
+        CallFrame_t *frame = &cur_vm->frames[i];
         ObjectFunc_t *func = frame->closure->func;
-        size_t instruction = frame->pc - func->chunk.code - 1;
-        fprintf(stderr, "[line %d] in  ",
-                get_line(frame->closure->func->chunk.line_runs, instruction));
+        int instruction;
+        if (frame->reg_pc != NULL) {
+            instruction = func->reg_chunk->origins[frame->reg_pc - func->reg_chunk->code - 1];
+        } else {
+            instruction = frame->pc - func->chunk.code - 1;
+        }
+        int line = get_line(func->chunk.line_runs, instruction);
+        // an inlined call still shows up as its own frame
+        for (int k = 0; k < func->chunk.inline_site_cnt; k++) {
+            InlineSite_t *site = &func->chunk.inline_sites[k];
+            if (instruction >= site->start && instruction < site->end) {
+                fprintf(cur_vm->err, "[line %d] in  %s()\n", line, site->name->chars);
+                line = site->call_line;
+            }
+        }
+        fprintf(cur_vm->err, "[line %d] in  ", line);
         if (func->name == NULL) {
-            fprintf(stderr, "script\n");
+            fprintf(cur_vm->err, "script\n");
         } else {
-            fprintf(stderr, "%s()\n", func->name->chars);
+            fprintf(cur_vm->err, "%s()\n", func->name->chars);
         }
     }
 
@@ -178,41 +296,198 @@ void concatenate() {
     new_str[new_length] = '\0';
 
     ObjectStr_t *res = allocate_str(new_str, new_length);
+    free(new_str); // allocate_str() copied it
     pop(); // GC bug
     pop(); // GC bug
     push(DECL_OBJ_VAL(res));
 }
 
+// open upvalues are found by stack slot so capturing never searches
 ObjectUpvalue_t *capture_upvalue(Value_t *local) {
-    ObjectUpvalue_t *prev_upvalue = NULL;
-    ObjectUpvalue_t *cur_upvalue = vm.open_upvalues;
+    int slot = (int)(local - cur_vm->stack);
+    if (cur_vm->open_upvalues[slot] == NULL) {
+        cur_vm->open_upvalues[slot] = create_upvalue(local);
+        if (slot >= cur_vm->open_top) {
+            cur_vm->open_top = slot + 1;
+        }
+    }
+    return cur_vm->open_upvalues[slot];
+}
 
-    while (cur_upvalue != NULL && cur_upvalue->location > local) {
-        prev_upvalue = cur_upvalue;
-        cur_upvalue = cur_upvalue->next;
+// only slots below open_top can hold an upvalue and open_top drops to last
+// afterwards, so returns from frames that captured nothing skip the loop
+void close_upvalues(Value_t *last) {
+    int first = (int)(last - cur_vm->stack);
+    for (int slot = cur_vm->open_top - 1; slot >= first; slot--) {
+        ObjectUpvalue_t *upvalue = cur_vm->open_upvalues[slot];
+        if (upvalue != NULL) {
+            upvalue->closed = *upvalue->location;
+            upvalue->location = &upvalue->closed;
+            cur_vm->open_upvalues[slot] = NULL;
+        }
+    }
+    if (cur_vm->open_top > first) {
+        cur_vm->open_top = first;
     }
+}
 
-    if (cur_upvalue != NULL && cur_upvalue->location == local) {
-        return cur_upvalue;
+// validates a subscript into a list or array of given length and converts it
+// to a C index
+bool check_index(Value_t index, int length, int *out) {
+    if (IS_INT_VAL(index)) {
+        int64_t idx = GET_INT_VAL(index);
+        if (idx < 0 || idx >= length) {
+            throw_runtime_error("Index %" PRId64 " out of range for length %d", idx, length);
+            return false;
+        }
+        *out = (int)idx;
+        return true;
+    }
+    if (!IS_NUM_VAL(index)) {
+        throw_runtime_error("Index must be a number");
+        return false;
+    }
+    double num = GET_NUM_VAL(index);
+    int idx = (int)num;
+    if (num != idx || idx < 0 || idx >= length) {
+        throw_runtime_error("Index %g out of range for length %d", num, length);
+        return false;
     }
+    *out = idx;
+    return true;
+}
 
-    ObjectUpvalue_t *new_upvalue = create_upvalue(local);
-    new_upvalue->next = cur_upvalue;
+// reads target[index] for lists, arrays and maps
+bool index_get(Value_t target, Value_t index, Value_t *out) {
+    int idx;
+    if (IS_LIST(target)) {
+        ObjectList_t *list = GET_LIST(target);
+        if (!check_index(index, list->items.count, &idx)) {
+            return false;
+        }
+        *out = list->items.values[idx];
+    } else if (IS_F64_ARRAY(target)) {
+        ObjectFloat64Array_t *array = GET_F64_ARRAY(target);
+        if (!check_index(index, array->length, &idx)) {
+            return false;
+        }
+        *out = DECL_NUM_VAL(array->data[idx]);
+    } else if (IS_MAP(target)) {
+        Value_t *value = value_table_get(&GET_MAP(target)->entries, index);
+        if (value == NULL) {
+            throw_runtime_error("Key not found in map");
+            return false;
+        }
+        *out = *value;
+    } else {
+        throw_runtime_error("Only lists, arrays and maps can be indexed");
+        return false;
+    }
+    return true;
+}
 
-    if (prev_upvalue == NULL) {
-        vm.open_upvalues = new_upvalue;
+bool index_set(Value_t target, Value_t index, Value_t value) {
+    int idx;
+    if (IS_LIST(target)) {
+        ObjectList_t *list = GET_LIST(target);
+        if (!check_index(index, list->items.count, &idx)) {
+            return false;
+        }
+        list->items.values[idx] = value;
+    } else if (IS_F64_ARRAY(target)) {
+        ObjectFloat64Array_t *array = GET_F64_ARRAY(target);
+        if (!check_index(index, array->length, &idx)) {
+            return false;
+        }
+        if (!IS_NUMERIC_VAL(value)) {
+            throw_runtime_error("Float64Array elements must be numbers");
+            return false;
+        }
+        array->data[idx] = GET_DOUBLE_VAL(value);
+    } else if (IS_MAP(target)) {
+        value_table_insert(&GET_MAP(target)->entries, index, value);
     } else {
-        prev_upvalue->next = new_upvalue;
+        throw_runtime_error("Only lists, arrays and maps can be indexed");
+        return false;
     }
-    return new_upvalue;
+    return true;
 }
 
-void close_upvalues(Value_t *last) {
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-        ObjectUpvalue_t *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+// % on two numbers, an int modulo by zero is an error
+bool mod_values(Value_t a, Value_t b, Value_t *out) {
+    if (!IS_NUMERIC_VAL(a) || !IS_NUMERIC_VAL(b)) {
+        throw_runtime_error("Operands are not numbers");
+        return false;
+    }
+    if (IS_INT_VAL(a) && IS_INT_VAL(b) && GET_INT_VAL(b) == 0) {
+        throw_runtime_error("Modulo by zero");
+        return false;
+    }
+    *out = num_mod(a, b);
+    return true;
+}
+
+// << and >> on two ints with a count the shift is defined for
+bool shift_values(bool left, Value_t a, Value_t b, Value_t *out) {
+    if (!IS_INT_VAL(a) || !IS_INT_VAL(b)) {
+        throw_runtime_error("Operands are not integers");
+        return false;
+    }
+    int64_t count = GET_INT_VAL(b);
+    if (count < 0 || count > 63) {
+        throw_runtime_error("Shift count must be between 0 and 63");
+        return false;
+    }
+    *out = DECL_INT_VAL(left ? shift_left(GET_INT_VAL(a), count)
+                             : shift_right(GET_INT_VAL(a), count));
+    return true;
+}
+
+// OP_ADD on the top two stack values: numbers add, strings concatenate
+bool add_values() {
+    if (IS_STR(peek(0)) && IS_STR(peek(1))) {
+        concatenate();
+    } else if (IS_NUMERIC_VAL(peek(0)) && IS_NUMERIC_VAL(peek(1))) {
+        Value_t b = pop();
+        Value_t a = pop();
+        push(num_add(a, b));
+    } else {
+        throw_runtime_error("Runtime Error: Operands are not both "
+                            "strings or both numbers");
+        return false;
+    }
+    return true;
+}
+
+// the method name resolves to on class_, or NULL
+ObjectClosure_t *lookup_method(ObjectClass_t *class_, ObjectStr_t *name) {
+    uintptr_t key = ((uintptr_t)class_ >> 4) ^ ((uintptr_t)name >> 4) * 31;
+    MethodCacheEntry_t *entry = &cur_vm->method_cache[key & (METHOD_CACHE_SIZE - 1)];
+    if (entry->class_ == class_ && entry->name == name) {
+        return entry->method;
+    }
+    Value_t *method = get(&class_->methods, name);
+    if (method == NULL) {
+        return NULL;
+    }
+    *entry = (MethodCacheEntry_t){class_, name, GET_CLOSURE(*method)};
+    return entry->method;
+}
+
+// drops the entries of class_, or every entry if it is NULL
+void flush_method_cache(ObjectClass_t *class_) {
+    for (int i = 0; i < METHOD_CACHE_SIZE; i++) {
+        if (class_ == NULL || cur_vm->method_cache[i].class_ == class_) {
+            cur_vm->method_cache[i].class_ = NULL;
+            cur_vm->method_cache[i].name = NULL;
+            cur_vm->method_cache[i].method = NULL;
+        }
+    }
+}
+
+void flush_bound_cache() {
+    for (int i = 0; i < BOUND_CACHE_SIZE; i++) {
+        cur_vm->bound_cache[i] = NULL;
     }
 }
 
@@ -220,29 +495,58 @@ void define_method(ObjectStr_t *name) {
     Value_t method = peek(0);
     ObjectClass_t *class_ = GET_CLASS(peek(1));
     insert(&class_->methods, name, method);
+    flush_method_cache(class_);
+    if (name == cur_vm->init_str) {
+        class_->initializer = GET_CLOSURE(method);
+    }
     pop();
 }
 
+void inherit(ObjectClass_t *superclass, ObjectClass_t *subclass) {
+    table_add_all(&superclass->methods, &subclass->methods);
+    flush_method_cache(subclass);
+    Value_t *initializer = get(&subclass->methods, cur_vm->init_str);
+    subclass->initializer = initializer != NULL ? GET_CLOSURE(*initializer) : NULL;
+}
+
+void set_field(ObjectInstance_t *instance, ObjectStr_t *name, Value_t value) {
+    if (insert(&instance->fields, name, value) &&
+        instance->fields.num_elems > instance->class_->field_cnt) {
+        instance->class_->field_cnt = instance->fields.num_elems;
+    }
+}
+
 bool bind_method(ObjectClass_t *class_, ObjectStr_t *name) {
-    Value_t *method = get(&class_->methods, name);
+    ObjectClosure_t *method = lookup_method(class_, name);
     if (method == NULL) {
         throw_runtime_error("Undefined field '%s'", name->chars);
         return false;
     }
-    ObjectBoundMethod_t *bound =
-        create_bound_method(peek(0), GET_CLOSURE(*method));
+    // bound methods are immutable, so taking the same method off the same
+    // receiver again can hand back the earlier one instead of allocating.
+    // equals() compares bound methods by receiver and method, so whether
+    // this hits or misses can't be observed through ==
+    Object_t *receiver = GET_OBJ_VAL(peek(0));
+    uintptr_t key = ((uintptr_t)receiver >> 4) ^ ((uintptr_t)method >> 4) * 31;
+    ObjectBoundMethod_t **slot = &cur_vm->bound_cache[key & (BOUND_CACHE_SIZE - 1)];
+    ObjectBoundMethod_t *bound = *slot;
+    if (bound == NULL || bound->method != method ||
+        GET_OBJ_VAL(bound->receiver) != receiver) {
+        bound = create_bound_method(peek(0), method);
+        *slot = bound;
+    }
     pop();
     push(DECL_OBJ_VAL(bound));
     return true;
 }
 
 bool invoke_from_class(ObjectClass_t *class_, ObjectStr_t *name, int arg_cnt) {
-    Value_t *method = get(&class_->methods, name);
+    ObjectClosure_t *method = lookup_method(class_, name);
     if (!method) {
         throw_runtime_error("'%s' is undefined", name->chars);
         return false;
     }
-    return call(GET_CLOSURE(*method), arg_cnt);
+    return call_closure(method, arg_cnt);
 }
 
 bool invoke(ObjectStr_t *name, int arg_cnt) {
@@ -256,14 +560,17 @@ bool invoke(ObjectStr_t *name, int arg_cnt) {
     ObjectInstance_t *instance = GET_INSTANCE(receiver);
     Value_t *value = get(&instance->fields, name);
     if (value) {
-        vm.stack_top[-arg_cnt - 1] = *value;
+        cur_vm->stack_top[-arg_cnt - 1] = *value;
         return call_value(*value, arg_cnt);
     }
     return invoke_from_class(instance->class_, name, arg_cnt);
 }
 
 InterpretResult_t run() {
-    CallFrame_t *frame = &vm.frames[vm.frame_cnt - 1];
+    // read once so the check below is a register test the branch predictor
+    // always gets right when profiling is off
+    const bool profiling = cur_vm->profile != NULL;
+    CallFrame_t *frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
 
 #define READ_BYTE() (*frame->pc++)
 #define READ_LONG()                                                            \
@@ -282,7 +589,7 @@ InterpretResult_t run() {
 
 #ifdef DEBUG_TRACE_EXECUTION
         printf(("       "));
-        for (Value_t *idx = vm.stack; idx < vm.stack_top; idx++) {
+        for (Value_t *idx = cur_vm->stack; idx < cur_vm->stack_top; idx++) {
             printf("[ ");
             print_value(*idx);
             printf(" ]");
@@ -293,6 +600,13 @@ InterpretResult_t run() {
             (int)(frame->pc - frame->closure->func->chunk.code));
 #endif
 
+#ifdef DEBUG_COUNT_DISPATCH
+        cur_vm->dispatch_cnt++;
+#endif
+        if (profiling) {
+            profile_instruction(cur_vm->profile, *frame->pc, frame->closure->func);
+        }
+
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
@@ -324,11 +638,11 @@ InterpretResult_t run() {
                 break;
             }
             case OP_GREATER_THAN: {
-                BINARY_OP(DECL_BOOL_VAL, >);
+                BINARY_OP(DECL_BOOL_VAL, num_greater);
                 break;
             }
             case OP_LESS_THAN: {
-                BINARY_OP(DECL_BOOL_VAL, <);
+                BINARY_OP(DECL_BOOL_VAL, num_less);
                 break;
             }
             case OP_NOT: {
@@ -336,40 +650,63 @@ InterpretResult_t run() {
                 break;
             }
             case OP_ADD: {
-                if (IS_STR(peek(0)) && IS_STR(peek(1))) {
-                    concatenate();
-                } else if (IS_NUM_VAL(peek(0)) && IS_NUM_VAL(peek(1))) {
-                    BINARY_OP(DECL_NUM_VAL, +);
-                } else {
-                    throw_runtime_error("Runtime Error: Operands are not both "
-                                        "strings or both numbers");
+                if (!add_values()) {
+                    return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
             case OP_SUB: {
-                BINARY_OP(DECL_NUM_VAL, -);
+                BINARY_OP(AS_VAL, num_sub);
                 break;
             }
             case OP_MUL: {
-                BINARY_OP(DECL_NUM_VAL, *);
+                BINARY_OP(AS_VAL, num_mul);
                 break;
             }
             case OP_DIV: {
-                BINARY_OP(DECL_NUM_VAL, /);
+                BINARY_OP(AS_VAL, num_div);
+                break;
+            }
+            case OP_MOD: {
+                if (!mod_values(peek(1), peek(0), cur_vm->stack_top - 2)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                cur_vm->stack_top--;
+                break;
+            }
+            case OP_SHIFT_LEFT:
+            case OP_SHIFT_RIGHT: {
+                bool left = frame->pc[-1] == OP_SHIFT_LEFT;
+                if (!shift_values(left, peek(1), peek(0), cur_vm->stack_top - 2)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                cur_vm->stack_top--;
+                break;
+            }
+            case OP_BIT_AND: {
+                INT_OP(&);
+                break;
+            }
+            case OP_BIT_OR: {
+                INT_OP(|);
+                break;
+            }
+            case OP_BIT_XOR: {
+                INT_OP(^);
                 break;
             }
             case OP_NEGATE: {
-                if (!IS_NUM_VAL(peek(0))) {
+                if (!IS_NUMERIC_VAL(peek(0))) {
                     throw_runtime_error(
                         "Runtme Error: Operand is not a number ");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(DECL_NUM_VAL(-GET_NUM_VAL(pop())));
+                push(num_negate(pop()));
                 break;
             }
             case OP_PRINT: {
-                print_value(pop());
-                printf("\n");
+                write_value(cur_vm->out, pop());
+                fputc('\n', cur_vm->out);
                 break;
             }
             case OP_POP: {
@@ -378,19 +715,19 @@ InterpretResult_t run() {
             }
             case OP_DEFINE_GLOBAL: {
                 ObjectStr_t *global_name = READ_STRING();
-                insert(&vm.globals, global_name, peek(0));
+                insert(&cur_vm->globals, global_name, peek(0));
                 pop();
                 break;
             }
             case OP_DEFINE_GLOBAL_LONG: {
                 ObjectStr_t *global_name = READ_STRING_LONG();
-                insert(&vm.globals, global_name, peek(0));
+                insert(&cur_vm->globals, global_name, peek(0));
                 pop();
                 break;
             }
             case OP_GET_GLOBAL: {
                 ObjectStr_t *global_name = READ_STRING();
-                Value_t *value = get(&vm.globals, global_name);
+                Value_t *value = get(&cur_vm->globals, global_name);
                 if (value == NULL) {
                     throw_runtime_error(
                         "This variable has not been defined '%s'",
@@ -402,7 +739,7 @@ InterpretResult_t run() {
             }
             case OP_GET_GLOBAL_LONG: {
                 ObjectStr_t *global_name = READ_STRING_LONG();
-                Value_t *value = get(&vm.globals, global_name);
+                Value_t *value = get(&cur_vm->globals, global_name);
                 if (value == NULL) {
                     throw_runtime_error(
                         "This variable has not been defined '%s'",
@@ -414,8 +751,8 @@ InterpretResult_t run() {
             }
             case OP_SET_GLOBAL: {
                 ObjectStr_t *global_name = READ_STRING();
-                if (insert(&vm.globals, global_name, peek(0))) {
-                    drop(&vm.globals, global_name);
+                if (insert(&cur_vm->globals, global_name, peek(0))) {
+                    drop(&cur_vm->globals, global_name);
                     throw_runtime_error(
                         "Undefined variable name '%s' LET's define it!",
                         global_name->chars);
@@ -425,8 +762,8 @@ InterpretResult_t run() {
             }
             case OP_SET_GLOBAL_LONG: {
                 ObjectStr_t *global_name = READ_STRING_LONG();
-                if (insert(&vm.globals, global_name, peek(0))) {
-                    drop(&vm.globals, global_name);
+                if (insert(&cur_vm->globals, global_name, peek(0))) {
+                    drop(&cur_vm->globals, global_name);
                     throw_runtime_error(
                         "Undefined variable name '%s' LET's define it!",
                         global_name->chars);
@@ -476,11 +813,15 @@ InterpretResult_t run() {
                 if (!call_value(peek(arg_cnt), arg_cnt)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_cnt - 1];
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
                 break;
             }
             case OP_CLOSURE: {
                 ObjectFunc_t *func = GET_FUNC(READ_CONSTANT());
+                if (func->upvalue_cnt == 0) {
+                    push(DECL_OBJ_VAL(func->shared_closure));
+                    break;
+                }
                 ObjectClosure_t *closure = create_closure(func);
                 push(DECL_OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalue_cnt; i++) {
@@ -495,6 +836,12 @@ InterpretResult_t run() {
                 }
                 break;
             }
+            case OP_STACK_CLOSURE: {
+                ObjectFunc_t *func = GET_FUNC(READ_CONSTANT());
+                push(DECL_OBJ_VAL(func->shared_closure));
+                frame->pc += 2 * func->upvalue_cnt; // nothing to capture
+                break;
+            }
             case OP_GET_UPVALUE: {
                 uint8_t idx = READ_BYTE();
                 push(*frame->closure->upvalues[idx]->location);
@@ -506,10 +853,18 @@ InterpretResult_t run() {
                 break;
             }
             case OP_CLOSE_UPVALUE: {
-                close_upvalues(vm.stack_top - 1);
+                close_upvalues(cur_vm->stack_top - 1);
                 pop();
                 break;
             }
+            case OP_GET_ENCLOSING: {
+                push(frame[-1].slots[READ_BYTE()]);
+                break;
+            }
+            case OP_SET_ENCLOSING: {
+                frame[-1].slots[READ_BYTE()] = peek(0);
+                break;
+            }
             case OP_CLASS: {
                 push(DECL_OBJ_VAL(create_class(READ_STRING())));
                 break;
@@ -542,8 +897,7 @@ InterpretResult_t run() {
                     throw_runtime_error("Only instances can have fields");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjectInstance_t *instance = GET_INSTANCE(peek(1));
-                insert(&instance->fields, READ_STRING(), peek(0));
+                set_field(GET_INSTANCE(peek(1)), READ_STRING(), peek(0));
 
                 Value_t value = pop();
                 pop();
@@ -564,7 +918,7 @@ InterpretResult_t run() {
                 if (!invoke(method, arg_cnt)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_cnt - 1];
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
                 break;
             }
             case OP_INHERIT: {
@@ -574,9 +928,7 @@ InterpretResult_t run() {
                                         "that wasn't a class :(");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjectClass_t *subclass = GET_CLASS(peek(0));
-                table_add_all(&GET_CLASS(superclass)->methods,
-                              &subclass->methods);
+                inherit(GET_CLASS(superclass), GET_CLASS(peek(0)));
                 pop(); // pop off the subclass
                 break;
             }
@@ -605,7 +957,7 @@ InterpretResult_t run() {
                 if (!invoke_from_class(superclass, method, arg_cnt)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_cnt - 1];
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
                 break;
             }
             case OP_SUPER_INVOKE_LONG: {
@@ -615,22 +967,178 @@ InterpretResult_t run() {
                 if (!invoke_from_class(superclass, method, arg_cnt)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_cnt - 1];
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+                break;
+            }
+            case OP_BUILD_LIST: {
+                int elem_cnt = READ_BYTE();
+                ObjectList_t *list = create_list();
+                push(DECL_OBJ_VAL(list)); // GC bug
+                if (elem_cnt > 0) {
+                    list->items.values =
+                        resize(NULL, sizeof(Value_t), 0, elem_cnt);
+                    list->items.capacity = elem_cnt;
+                    memcpy(list->items.values, cur_vm->stack_top - 1 - elem_cnt,
+                           sizeof(Value_t) * elem_cnt);
+                    list->items.count = elem_cnt;
+                }
+                cur_vm->stack_top -= elem_cnt + 1;
+                push(DECL_OBJ_VAL(list));
+                break;
+            }
+            case OP_INDEX_GET: {
+                Value_t value;
+                if (!index_get(peek(1), peek(0), &value)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                cur_vm->stack_top -= 2;
+                push(value);
+                break;
+            }
+            case OP_INDEX_SET: {
+                if (!index_set(peek(2), peek(1), peek(0))) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value_t value = pop();
+                cur_vm->stack_top -= 2;
+                push(value);
+                break;
+            }
+            case OP_ADD_LOCALS: {
+                Value_t a = frame->slots[READ_BYTE()];
+                Value_t b = frame->slots[READ_BYTE()];
+                int64_t sum;
+                if (IS_INT_VAL(a) && IS_INT_VAL(b) &&
+                    !__builtin_add_overflow(GET_INT_VAL(a), GET_INT_VAL(b), &sum)) {
+                    push(DECL_INT_VAL(sum));
+                    break;
+                }
+                if (IS_NUMERIC_VAL(a) && IS_NUMERIC_VAL(b)) {
+                    push(num_add(a, b));
+                    break;
+                }
+                push(a);
+                push(b);
+                if (!add_values()) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_INC_LOCAL: {
+                Value_t *slot = &frame->slots[READ_BYTE()];
+                Value_t amount = READ_CONSTANT();
+                int64_t sum;
+                // the slot only takes the sum when it fits, num_add promotes otherwise
+                if (IS_INT_VAL(*slot) && IS_INT_VAL(amount) &&
+                    !__builtin_add_overflow(GET_INT_VAL(*slot), GET_INT_VAL(amount), &sum)) {
+                    GET_INT_VAL(*slot) = sum;
+                    break;
+                }
+                if (IS_NUMERIC_VAL(*slot) && IS_NUMERIC_VAL(amount)) {
+                    *slot = num_add(*slot, amount);
+                    break;
+                }
+                push(*slot);
+                push(amount);
+                if (!add_values()) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *slot = pop();
+                break;
+            }
+            case OP_LESS_LOCAL_CONST_JUMP: {
+                Value_t a = frame->slots[READ_BYTE()];
+                Value_t b = READ_CONSTANT();
+                uint16_t offset = READ_SHORT();
+                bool less;
+                if (IS_INT_VAL(a) && IS_INT_VAL(b)) {
+                    less = GET_INT_VAL(a) < GET_INT_VAL(b);
+                } else if (IS_NUM_VAL(a) && IS_NUM_VAL(b)) {
+                    less = GET_NUM_VAL(a) < GET_NUM_VAL(b);
+                } else if (!IS_NUMERIC_VAL(a) || !IS_NUMERIC_VAL(b)) {
+                    throw_runtime_error("Operands are not numbers");
+                    return INTERPRET_RUNTIME_ERROR;
+                } else {
+                    less = num_less(a, b);
+                }
+                if (!less) {
+                    // the branch target still pops the condition
+                    push(DECL_BOOL_VAL(false));
+                    frame->pc += offset;
+                }
+                break;
+            }
+            case OP_NOT_EQUAL: {
+                Value_t b = pop();
+                Value_t a = pop();
+                push(DECL_BOOL_VAL(!equals(a, b)));
+                break;
+            }
+            // written as !(a > b) / !(a < b) to match the unfused NaN behaviour
+            case OP_LESS_EQUAL: {
+                BINARY_OP(NOT_BOOL_VAL, num_greater);
+                break;
+            }
+            case OP_GREATER_EQUAL: {
+                BINARY_OP(NOT_BOOL_VAL, num_less);
+                break;
+            }
+            case OP_ADD_NN: {
+                UNCHECKED_OP(AS_VAL, num_add);
+                break;
+            }
+            case OP_SUB_NN: {
+                UNCHECKED_OP(AS_VAL, num_sub);
+                break;
+            }
+            case OP_MUL_NN: {
+                UNCHECKED_OP(AS_VAL, num_mul);
+                break;
+            }
+            case OP_DIV_NN: {
+                UNCHECKED_OP(AS_VAL, num_div);
+                break;
+            }
+            case OP_LESS_NN: {
+                UNCHECKED_OP(DECL_BOOL_VAL, num_less);
+                break;
+            }
+            case OP_GREATER_NN: {
+                UNCHECKED_OP(DECL_BOOL_VAL, num_greater);
+                break;
+            }
+            case OP_LESS_EQUAL_NN: {
+                UNCHECKED_OP(NOT_BOOL_VAL, num_greater);
+                break;
+            }
+            case OP_GREATER_EQUAL_NN: {
+                UNCHECKED_OP(NOT_BOOL_VAL, num_less);
                 break;
             }
             case OP_RETURN: {
                 Value_t res = pop();
                 close_upvalues(frame->slots);
-                vm.frame_cnt--;
-                if (vm.frame_cnt == 0) {
+                cur_vm->frame_cnt--;
+                if (cur_vm->frame_cnt == 0) {
                     pop();
                     return INTERPRET_OK;
                 }
 
-                vm.stack_top =
+                if (cur_vm->fiber != NULL && cur_vm->frame_cnt == cur_vm->fiber->frame_base) {
+                    // a fiber's function returned, the result replaces the
+                    // fiber in the call that resumed it
+                    cur_vm->stack_top = frame->slots - 1;
+                    push(res);
+                    if (!finish_fiber()) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &cur_vm->frames[cur_vm->frame_cnt - 1];
+                    break;
+                }
+                cur_vm->stack_top =
                     frame->slots; // go back to where caller locals are
                 push(res);
-                frame = &vm.frames[vm.frame_cnt - 1]; // return to callers frame
+                frame = &cur_vm->frames[cur_vm->frame_cnt - 1]; // return to callers frame
                 break;
             }
         }
@@ -644,17 +1152,36 @@ InterpretResult_t run() {
 #undef READ_STRING_LONG
 }
 
-InterpretResult_t interpret(const char *code) {
+// compiles and runs code on cur_vm
+static InterpretResult_t interpret_current(const char *code) {
     ObjectFunc_t *func = compile(code);
     if (func == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
     push(DECL_OBJ_VAL(func));
+#ifndef DISABLE_INLINING
+    if (cur_vm->whole_program) {
+        inline_calls(func);
+    }
+#endif
+
+    bool use_registers = cur_vm->use_registers && generate_register_code(func);
+    if (cur_vm->use_registers && !use_registers) {
+        fprintf(cur_vm->err, "Warning: program too large for the register VM, using the stack VM\n");
+    }
 
     ObjectClosure_t *closure = create_closure(func);
     pop();
     push(DECL_OBJ_VAL(closure));
     call_value(DECL_OBJ_VAL(closure), 0); // i.e. main()
 
-    return run();
+    return use_registers ? run_registers() : run();
+}
+
+InterpretResult_t interpret(vm_t *vm, const char *code) {
+    vm_t *prev = cur_vm;
+    cur_vm = vm;
+    InterpretResult_t result = interpret_current(code);
+    cur_vm = prev;
+    return result;
 }
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Runs every tests/*.gld on both the stack and the register VM and compares
+# what it printed, errors included, and its exit status with tests/<name>.out
+#
+#   tests/run.sh [interpreter]    (./main by default)
+#
+# A .out is made with: (./main tests/x.gld 2>&1; echo "exit $?") > tests/x.out
+MAIN=${1:-./main}
+MAIN="$(cd "$(dirname "$MAIN")" && pwd)/$(basename "$MAIN")" # scripts run from tests/
+DIR=$(dirname "$0")
+failed=0
+for script in "$DIR"/*.gld; do
+    expected="${script%.gld}.out"
+    # the Float64Array kernels must agree at every GLIDE_SIMD level
+    levels=default
+    case "$(basename "$script")" in
+        f64*) levels="scalar sse2 avx2" ;;
+    esac
+    for level in $levels; do
+        for vm in stack register; do
+            actual=$( (cd "$DIR" && if [ "$level" != default ]; then export GLIDE_SIMD=$level; fi
+                       "$MAIN" --vm=$vm "$(basename "$script")" 2>&1; echo "exit $?") )
+            if ! diff -u "$expected" <(echo "$actual") > /tmp/glide_test_diff.$$; then
+                label="$vm vm"
+                if [ "$level" != default ]; then label="$label, GLIDE_SIMD=$level"; fi
+                echo "FAIL $(basename "$script") ($label)"
+                head -20 /tmp/glide_test_diff.$$
+                failed=$((failed + 1))
+            fi
+        done
+    done
+done
+rm -f /tmp/glide_test_diff.$$
+if [ $failed -gt 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "All tests passed"
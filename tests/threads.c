@@ -0,0 +1,183 @@
+// threads.c
+// Every vm_t is meant to be independent of every other, on any thread. This
+// runs THREAD_CNT threads that each create, run and free ROUND_CNT vms on both
+// backends, then drives two vms in turn from one thread, and checks what each
+// vm printed. With --shared-strings every vm interns through the one
+// process-wide table, so the threads keep interning and dropping the same
+// strings while their collections run. Built and run, both ways, by make
+// test-threads.
+#define _POSIX_C_SOURCE 200809L
+#include "../includes/intern.h"
+#include "../includes/vm.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_CNT 8
+#define ROUND_CNT 3
+
+// allocates enough to collect several times and touches classes, closures,
+// strings and globals, all of which live in the vm
+static const char *WORKLOAD =
+    "class P { init(n) { this.n = n; } get(x) { return this.n + x; } }\n"
+    "func fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "func counter() { let c = 0; func inc() { c = c + 1; return c; } return inc; }\n"
+    "let inc = counter();\n"
+    "let s = \"\";\n"
+    "let l = [];\n"
+    "for (let i = 0; i < 20000; i = i + 1) {\n"
+    "    let p = P(i);\n"
+    "    l = [p.get(1), s];\n"
+    "    s = \"a\" + \"b\";\n"
+    "    inc();\n"
+    "}\n"
+    "print fib(20);\n"
+    "print l[0];\n"
+    "print inc();\n";
+static const char *WORKLOAD_OUT = "6765\n20000\n20001\n";
+
+// every thread makes the same short and long (over SHARED_STR_MIN) strings,
+// drops them and makes them again, enough to collect many times over
+static const char *STRINGS_WORKLOAD =
+    "let words = [\"alpha\", \"beta\", \"gamma\", \"delta\", \"eps\", \"zeta\", \"eta\", \"theta\"];\n"
+    "let long = \"0123456789abcdef\";\n"
+    "for (let i = 0; i < 6; i = i + 1) { long = long + long; }\n"
+    "let same = 0;\n"
+    "for (let round = 0; round < 100; round = round + 1) {\n"
+    "    let keep = [];\n"
+    "    for (let a = 0; a < 8; a = a + 1) {\n"
+    "        for (let b = 0; b < 8; b = b + 1) {\n"
+    "            push(keep, words[a] + words[b]);\n"
+    "            push(keep, long + words[a] + words[b]);\n"
+    "        }\n"
+    "    }\n"
+    "    for (let i = 0; i < 64; i = i + 1) {\n"
+    "        let a = (i - i % 8) / 8;\n"
+    "        let b = i % 8;\n"
+    "        if (keep[2 * i] == words[a] + words[b]) same = same + 1;\n"
+    "        if (keep[2 * i + 1] == long + words[a] + words[b]) same = same + 1;\n"
+    "    }\n"
+    "}\n"
+    "print same;\n"
+    "print len(long + words[7]);\n";
+static const char *STRINGS_WORKLOAD_OUT = "12800\n1029\n";
+
+static int failures = 0;
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void fail(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&failures_lock);
+    fprintf(stderr, "FAIL ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    failures++;
+    pthread_mutex_unlock(&failures_lock);
+    va_end(args);
+}
+
+// a vm whose print output is collected in memory instead of going to stdout
+typedef struct {
+    vm_t *vm;
+    char *out;
+    size_t out_len;
+} Capture_t;
+
+static void open_capture(Capture_t *capture, bool use_registers) {
+    capture->vm = create_vm();
+    capture->vm->use_registers = use_registers;
+    capture->out = NULL;
+    capture->out_len = 0;
+    capture->vm->out = open_memstream(&capture->out, &capture->out_len);
+}
+
+// runs code and checks it printed expected since the last call
+static void expect(Capture_t *capture, const char *code, const char *expected, const char *what) {
+    long start = ftell(capture->vm->out);
+    InterpretResult_t result = interpret(capture->vm, code);
+    fflush(capture->vm->out);
+    const char *got = capture->out + start;
+    if (result != INTERPRET_OK) {
+        fail("%s: interpret returned %d", what, result);
+    } else if (strcmp(got, expected) != 0) {
+        fail("%s: printed \"%s\", expected \"%s\"", what, got, expected);
+    }
+}
+
+static void close_capture(Capture_t *capture) {
+    fclose(capture->vm->out);
+    capture->vm->out = stdout;
+    free_vm(capture->vm);
+    free(capture->out);
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    for (int round = 0; round < ROUND_CNT; round++) {
+        for (int use_registers = 0; use_registers < 2; use_registers++) {
+            char what[64];
+            snprintf(what, sizeof(what), "thread %ld round %d %s vm", id, round,
+                     use_registers ? "register" : "stack");
+            Capture_t capture;
+            open_capture(&capture, use_registers);
+            capture.vm->whole_program = true; // as run_file() does
+            expect(&capture, WORKLOAD, WORKLOAD_OUT, what);
+            expect(&capture, STRINGS_WORKLOAD, STRINGS_WORKLOAD_OUT, what);
+            close_capture(&capture);
+        }
+    }
+    return NULL;
+}
+
+// two vms alive at once on one thread, each resumed after the other ran, must
+// each keep their own globals, strings and heap
+static void interleave(bool use_registers) {
+    const char *what = use_registers ? "interleaved register vms" : "interleaved stack vms";
+    Capture_t a, b;
+    open_capture(&a, use_registers);
+    open_capture(&b, use_registers);
+    expect(&a, "let x = 1; let s = \"a\";", "", what);
+    expect(&b, "let x = 2; let s = \"b\";", "", what);
+    for (int i = 0; i < 50; i++) {
+        expect(&a, "x = x + 1; s = s + \"a\"; let junk = [s, s + s];", "", what);
+        expect(&b, "x = x + 2; s = s + \"b\"; let junk = [s, s + s];", "", what);
+    }
+    expect(&a, "print x; print len(s);", "51\n51\n", what);
+    expect(&b, "print x; print len(s);", "102\n51\n", what);
+    close_capture(&a);
+    expect(&b, "print x;", "102\n", what);
+    close_capture(&b);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--shared-strings") == 0) {
+        share_strings = true;
+    } else if (argc > 1) {
+        fprintf(stderr, "Usage: threads [--shared-strings]\n");
+        return 64;
+    }
+    pthread_t threads[THREAD_CNT];
+    for (long i = 0; i < THREAD_CNT; i++) {
+        if (pthread_create(&threads[i], NULL, worker, (void *)i) != 0) {
+            fprintf(stderr, "Error: could not start thread %ld\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < THREAD_CNT; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    interleave(false);
+    interleave(true);
+    if (failures > 0) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("All thread tests passed%s\n", share_strings ? " with shared strings" : "");
+    return 0;
+}